@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "arena.h"
+
+/* every allocation is rounded up to this, which suits any type. */
+#define	ARENA_ALIGN	16
+
+struct chunk;
+typedef struct chunk *chunk_t;
+
+struct chunk {
+	chunk_t		next;
+	size_t		size, used;
+	char		*last;		/* most recent allocation, for grow */
+	char		data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+struct arena {
+	size_t		chunk_size;
+	chunk_t		chunks;		/* all of them, in order of use */
+	chunk_t		cur;		/* the one being bumped through */
+};
+
+static chunk_t chunk_new(size_t);
+static void *arena_json_malloc(size_t);
+static void arena_json_free(void *);
+
+static arena_t json_arena = NULL;
+
+/* arena_new(chunk_size) -- create an arena that grows in chunks of this size
+ */
+arena_t
+arena_new(size_t chunk_size) {
+	arena_t ret = malloc(sizeof *ret);
+	if (ret == NULL)
+		abort();
+	ret->chunk_size = chunk_size;
+	ret->chunks = ret->cur = chunk_new(chunk_size);
+	return ret;
+}
+
+/* arena_alloc(size) -- allocate uninitialized memory from an arena
+ */
+void *
+arena_alloc(arena_t arena, size_t size) {
+	chunk_t cur = arena->cur;
+	char *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	while (cur->size - cur->used < size) {
+		/* chunks after cur are empty, left over from before a reset;
+		 * one too small for this request gets a bigger one before it.
+		 */
+		if (cur->next == NULL || cur->next->size < size) {
+			chunk_t new = chunk_new(size > arena->chunk_size ?
+						size : arena->chunk_size);
+			new->next = cur->next;
+			cur->next = new;
+		}
+		cur = arena->cur = cur->next;
+	}
+	ret = cur->data + cur->used;
+	cur->used += size;
+	cur->last = ret;
+	return ret;
+}
+
+/* arena_grow(ptr, old, new) -- resize an arena allocation, as realloc() would
+ *
+ * the most recent allocation grows in place if its chunk has the room.
+ */
+void *
+arena_grow(arena_t arena, void *ptr, size_t old_size, size_t new_size) {
+	chunk_t cur = arena->cur;
+	void *ret;
+
+	if (ptr == NULL)
+		return arena_alloc(arena, new_size);
+	if (ptr == cur->last) {
+		size_t need = (size_t)(cur->last - cur->data) + new_size;
+
+		need = (need + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+		if (need <= cur->size) {
+			cur->used = need;
+			return ptr;
+		}
+	}
+	if (new_size <= old_size)
+		return ptr;
+	ret = arena_alloc(arena, new_size);
+	memcpy(ret, ptr, old_size);
+	return ret;
+}
+
+/* arena_strdup(str) -- copy a string into an arena
+ */
+char *
+arena_strdup(arena_t arena, const char *str) {
+	size_t len = strlen(str) + 1;
+
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/* arena_sprintf(fmt, ...) -- format a string into an arena
+ */
+char *
+arena_sprintf(arena_t arena, const char *fmt, ...) {
+	va_list ap;
+	char *ret, one[1];
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(one, sizeof one, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		abort();
+	ret = arena_alloc(arena, (size_t)len + 1);
+	va_start(ap, fmt);
+	(void) vsnprintf(ret, (size_t)len + 1, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+/* arena_owns(ptr) -- was this memory allocated from this arena?
+ */
+bool
+arena_owns(arena_t arena, const void *ptr) {
+	const char *p = ptr;
+
+	for (chunk_t chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+		if (p >= chunk->data && p < chunk->data + chunk->size)
+			return true;
+	return false;
+}
+
+/* arena_reset() -- take back everything allocated from an arena
+ */
+void
+arena_reset(arena_t arena) {
+	for (chunk_t chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+		chunk->used = 0;
+		chunk->last = NULL;
+		if (chunk == arena->cur)
+			break;
+	}
+	arena->cur = arena->chunks;
+}
+
+/* arena_destroy() -- free an arena and everything allocated from it
+ */
+void
+arena_destroy(arena_t *arenap) {
+	arena_t arena = *arenap;
+	chunk_t next;
+
+	*arenap = NULL;
+	if (arena == json_arena)
+		json_arena = NULL;
+	for (chunk_t chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/* arena_json(arena) -- route jansson's allocations to an arena, or NULL
+ *
+ * while an arena is named, json_decref() of anything allocated from it
+ * does nothing, and the memory comes back with arena_reset(). anything
+ * jansson allocates meanwhile must be released before the arena is reset
+ * or unnamed. with NULL, jansson uses malloc() and free() as usual.
+ */
+void
+arena_json(arena_t arena) {
+	static bool installed = false;
+
+	if (!installed) {
+		json_set_alloc_funcs(arena_json_malloc, arena_json_free);
+		installed = true;
+	}
+	json_arena = arena;
+}
+
+/* chunk_new(size) -- allocate an empty chunk with this much room
+ */
+static chunk_t
+chunk_new(size_t size) {
+	chunk_t ret = malloc(sizeof *ret + size);
+	if (ret == NULL)
+		abort();
+	ret->next = NULL;
+	ret->size = size;
+	ret->used = 0;
+	ret->last = NULL;
+	return ret;
+}
+
+static void *
+arena_json_malloc(size_t size) {
+	if (json_arena != NULL)
+		return arena_alloc(json_arena, size);
+	return malloc(size);
+}
+
+static void
+arena_json_free(void *ptr) {
+	if (json_arena != NULL && arena_owns(json_arena, ptr))
+		return;
+	free(ptr);
+}
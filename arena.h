@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ARENA_H_INCLUDED
+#define __ARENA_H_INCLUDED 1
+
+/* an arena hands out memory by bumping a pointer through large chunks,
+ * and takes all of it back at once, with arena_reset(). nothing in an
+ * arena is freed on its own. the chunks are kept across resets, so an
+ * arena that is reset per line settles down to no malloc() at all.
+ */
+
+struct arena;
+typedef struct arena *arena_t;
+
+arena_t arena_new(size_t);
+void *arena_alloc(arena_t, size_t);
+void *arena_grow(arena_t, void *, size_t, size_t);
+char *arena_strdup(arena_t, const char *);
+char *arena_sprintf(arena_t, const char *, ...)
+	__attribute__ ((format (printf, 2, 3)));
+bool arena_owns(arena_t, const void *);
+void arena_reset(arena_t);
+void arena_destroy(arena_t *);
+void arena_json(arena_t);
+
+#endif /*__ARENA_H_INCLUDED*/
@@ -25,31 +25,134 @@
 /* asprintf() does not appear on linux without this */
 #define _GNU_SOURCE
 
+#include <sys/socket.h>
+
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <resolv.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "globals.h"
 
 #ifndef CRIPPLED_LIBC  /* must be after globals.h - which includes defs.h */
 
 #include "asinfo.h"
+#include "pfx2as.h"
 
 /* private. */
 
+/* one ASINFO name, looked up when first needed and again once its answer
+ * expires. until it is done, it is either queued for a free query slot,
+ * or in flight; .link chains it on whichever list that is.
+ */
+struct asinfo {
+	asinfo_t	next;		/* hash chain */
+	asinfo_t	link;		/* queued, in flight, or parked */
+	asinfo_t	parked;		/* waiting for this one, see below */
+	char		*dname;
+	uint32_t	addr;		/* if .ipv4, the address it names */
+	/* once done: why it failed, or else the AS and CIDR, if any. */
+	char		*result, *asnum, *cidr;
+	long long	expires;	/* when the answer goes stale */
+	long long	resend_at;
+	int		tries;
+	uint16_t	id;
+	bool		ipv4;
+	bool		queued;
+	bool		done;
+	bool		counted;	/* its query is in asinfo_counts.misses */
+};
+
+/* a node of the prefix trie, which maps every IPv4 prefix learned from an
+ * answer to that answer, so other addresses within it need no query. the
+ * trie is path compressed: a node's children agree with its first .len
+ * bits, and with each other on none past that. nodes which only fork the
+ * trie, or whose answer has expired, aren't .known, or don't count.
+ *
+ * while a lookup is due for an address, others within ASINFO_PREFIX_LEN
+ * of it are parked behind that .lead, on the guess that its answer will
+ * cover them too. once a guess has been wrong, that prefix is .lone.
+ */
+struct asinfo_node {
+	struct asinfo_node *child[2];
+	uint32_t	prefix;		/* host order, zero past .len bits */
+	int		len;
+	bool		known;
+	bool		lone;
+	long long	expires;
+	char		*result, *asnum, *cidr;
+	asinfo_t	lead;
+};
+
 static struct __res_state res;
 
+/* a local pfx2as table, if -D named one, which replaces the DNS. */
+static pfx2as_t asinfo_pfx2as = NULL;
+
+/* the cache, which owns every asinfo and all of their strings. */
+static arena_t asinfo_arena = NULL;
+static asinfo_t *asinfo_table = NULL;
+static size_t asinfo_buckets = 0, asinfo_count = 0;
+static struct asinfo_node *asinfo_trie = NULL;
+static struct asinfo_stats asinfo_counts;
+
+/* the nonblocking socket our queries go out on, and the (IPv4) servers
+ * they go to. -1 if it isn't open yet, or couldn't be, in which case
+ * every lookup is a blocking res_nquery().
+ */
+static int asinfo_sock = -1;
+static bool asinfo_nosock = false;
+static struct sockaddr_in asinfo_servers[MAXNS];
+static int asinfo_nservers = 0;
+
+/* lookups waiting for a query slot, and those in flight, oldest first. */
+static asinfo_t asinfo_queued = NULL, asinfo_queued_last = NULL;
+static asinfo_t asinfo_flight = NULL, asinfo_flight_last = NULL;
+static int asinfo_nflight = 0;
+
 /* forward. */
 
+static void asinfo_init(void);
+static bool asinfo_open(void);
+static asinfo_t asinfo_find(const char *, bool);
+static uint32_t asinfo_hash(const char *);
+static void asinfo_queue(asinfo_t);
+static void asinfo_pump(void);
+static void asinfo_send(asinfo_t);
+static void asinfo_reply(const u_char *, size_t, const struct sockaddr_in *);
+static void asinfo_unflight(asinfo_t);
+static void asinfo_query(asinfo_t);
+static void asinfo_fail(asinfo_t, int, long);
+static void asinfo_settle(asinfo_t, char *, char *, char *, long);
+static void asinfo_renew(asinfo_t);
+static void asinfo_cover(asinfo_t, const struct asinfo_node *);
+static void asinfo_release(asinfo_t);
+static void asinfo_learn(asinfo_t);
+static struct asinfo_node *asinfo_insert(uint32_t, int);
+static const struct asinfo_node *asinfo_match(uint32_t, long long);
+static bool asinfo_cidr(const char *, uint32_t *, int *);
+static uint32_t asinfo_mask(int);
+static long asinfo_ttl(const u_char *, int);
+static long long asinfo_now(void);
+static int asinfo_name_ipv4(const char *, uint32_t *, char *, size_t);
 static char *asinfo_from_ipv4(const char *, char **, char **);
 #ifdef asinfo_ipv6
 static const char *asinfo_from_ipv6(const char *, char **, char **);
-#endif
 static char *asinfo_from_dns(const char *, char **, char **);
+#endif
+static char *asinfo_from_lookup(asinfo_t, char **, char **);
+static char *asinfo_from_table(const char *, const char *, char **, char **);
+static char *asinfo_answer(const char *, const char *, const char *,
+			   char **, char **);
+static char *asinfo_parse(const u_char *, int, char **, char **);
 static const char *keep_best(char **, char **, char *, char *);
 
 /* public. */
@@ -65,6 +168,8 @@ asinfo_from_rr(const char *rrtype, const char *rdata,
 	       char **asnum, char **cidr)
 {
 	if (asinfo_lookup) {
+		if (asinfo_pfx2as != NULL)
+			return asinfo_from_table(rrtype, rdata, asnum, cidr);
 		if (strcmp(rrtype, "A") == 0)
 			return asinfo_from_ipv4(rdata, asnum, cidr);
 #ifdef asinfo_ipv6
@@ -75,6 +180,121 @@ asinfo_from_rr(const char *rrtype, const char *rdata,
 	return NULL;
 }
 
+/* asinfo_start(rrtype, rdata) -- begin looking up ASINFO for A/AAAA string
+ *
+ * return the lookup to wait for, or NULL if there is nothing to wait for,
+ * because the answer is already known or none will be needed.
+ *
+ * an address within a prefix learned from an earlier answer is known
+ * without a query, as is one whose own answer hasn't expired yet.
+ */
+asinfo_t
+asinfo_start(const char *rrtype, const char *rdata) {
+	char dname[NS_MAXDNAME];
+	long long now;
+	uint32_t addr;
+	asinfo_t a;
+
+	if (!asinfo_lookup || asinfo_pfx2as != NULL ||
+	    strcmp(rrtype, "A") != 0)
+		return NULL;
+	if (asinfo_name_ipv4(rdata, &addr, dname, sizeof dname) < 0)
+		return NULL;
+	now = asinfo_now();
+	if (asinfo_match(addr, now) != NULL)
+		return NULL;
+	a = asinfo_find(dname, true);
+	a->addr = addr;
+	a->ipv4 = true;
+	if ((a->done && a->expires > now) || !asinfo_open())
+		return NULL;
+	if (a->done)
+		asinfo_renew(a);
+	asinfo_queue(a);
+	return a;
+}
+
+/* asinfo_done(a) -- has this lookup been answered (or given up on)?
+ */
+bool
+asinfo_done(asinfo_t a) {
+	return a->done;
+}
+
+/* asinfo_wait(a) -- wait until this lookup has been answered, handling
+ * whatever other answers and retransmissions come due meanwhile.
+ */
+void
+asinfo_wait(asinfo_t a) {
+	while (!a->done) {
+		struct pollfd pfd = { .fd = asinfo_sock, .events = POLLIN };
+
+		if (poll(&pfd, 1, asinfo_timeout()) < 0 && errno != EINTR)
+			my_panic(true, "poll");
+		asinfo_poll();
+	}
+}
+
+/* asinfo_fd() -- the socket to watch for answers, or -1 if none are due.
+ */
+int
+asinfo_fd(void) {
+	return asinfo_nflight > 0 ? asinfo_sock : -1;
+}
+
+/* asinfo_timeout() -- milliseconds until a query needs retransmitting,
+ * or -1 if none are in flight.
+ */
+int
+asinfo_timeout(void) {
+	long long wait;
+
+	if (asinfo_flight == NULL)
+		return -1;
+	/* every query waits as long, so the oldest is due first. */
+	wait = asinfo_flight->resend_at - asinfo_now();
+	return wait < 0 ? 0 : (int)wait;
+}
+
+/* asinfo_poll() -- take in whatever answers have arrived, retransmit or
+ * give up on queries whose time is up, and fill any free query slots.
+ * never blocks.
+ */
+void
+asinfo_poll(void) {
+	u_char buf[NS_PACKETSZ];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	long long now;
+	ssize_t n;
+
+	if (asinfo_sock < 0)
+		return;
+	for (;;) {
+		fromlen = sizeof from;
+		n = recvfrom(asinfo_sock, buf, sizeof buf, 0,
+			     (struct sockaddr *)&from, &fromlen);
+		if (n < 0)
+			break;
+		asinfo_reply(buf, (size_t)n, &from);
+	}
+
+	/* each try goes to the next server, as res_nsend() would. */
+	now = asinfo_now();
+	while (asinfo_flight != NULL && asinfo_flight->resend_at <= now) {
+		asinfo_t a = asinfo_flight;
+
+		asinfo_unflight(a);
+		if (a->tries >= res.retry * asinfo_nservers) {
+			DEBUG(1, true, "asinfo timeout (%s)\n", a->dname);
+			asinfo_fail(a, TRY_AGAIN, -1);
+		} else {
+			asinfo_send(a);
+		}
+	}
+	asinfo_pump();
+}
+
 /* asinfo_domain_exists(domain) -- verify DNS-level existence of a domain
  *
  * return boolean -- does this domain exist in some form?
@@ -83,20 +303,655 @@ bool
 asinfo_domain_exists(const char *domain) {
 	u_char buf[NS_PACKETSZ];
 
-	return res_query(domain, ns_c_in, ns_t_txt, buf, sizeof buf) > 0 ||
-		_res.res_h_errno != HOST_NOT_FOUND;
+	asinfo_init();
+	return res_nquery(&res, domain, ns_c_in, ns_t_txt,
+			  buf, sizeof buf) > 0 ||
+		res.res_h_errno != HOST_NOT_FOUND;
+}
+
+/* asinfo_stats(stats) -- say how many lookups the prefix trie answered
+ */
+void
+asinfo_stats(struct asinfo_stats *stats) {
+	*stats = asinfo_counts;
+}
+
+/* asinfo_use_table(path) -- use a local pfx2as table instead of the DNS
+ *
+ * return NULL on success, or else, reason (static string) for failure.
+ */
+const char *
+asinfo_use_table(const char *path) {
+	const char *msg = NULL;
+	size_t n4, n6;
+
+	if ((asinfo_pfx2as = pfx2as_open(path, &msg)) == NULL)
+		return msg;
+	pfx2as_count(asinfo_pfx2as, &n4, &n6);
+	DEBUG(1, true, "asinfo table %s: %zu IPv4, %zu IPv6 prefixes\n",
+	      path, n4, n6);
+	return NULL;
 }
 
 /* asinfo_shutdown() -- deallocate underlying library's heap resources
  */
 void
 asinfo_shutdown(void) {
+	if (asinfo_sock >= 0) {
+		close(asinfo_sock);
+		asinfo_sock = -1;
+	}
+	if (asinfo_arena != NULL) {
+		DEBUG(1, true, "asinfo: %zu names\n", asinfo_count);
+		arena_destroy(&asinfo_arena);
+		DESTROY(asinfo_table);
+		asinfo_buckets = asinfo_count = 0;
+		asinfo_trie = NULL;
+		asinfo_queued = asinfo_queued_last = NULL;
+		asinfo_flight = asinfo_flight_last = NULL;
+		asinfo_nflight = 0;
+	}
+	if (asinfo_pfx2as != NULL)
+		pfx2as_close(&asinfo_pfx2as);
 	if ((res.options & RES_INIT) != 0)
 		res_nclose(&res);
 }
 
 /* static. */
 
+/* asinfo_init() -- set up the resolver context, if that hasn't been done.
+ *
+ * the DNSDBQ_ASINFO_SERVER environment variable, if set, replaces the
+ * system's name servers with one address[:port] of our own.
+ */
+static void
+asinfo_init(void) {
+	const char *value;
+
+	if ((res.options & RES_INIT) != 0)
+		return;
+	res_ninit(&res);
+	if ((value = getenv(env_asinfo_server)) != NULL) {
+		struct sockaddr_in sin = { .sin_family = AF_INET,
+					   .sin_port = htons(NS_DEFAULTPORT) };
+		char *addr = strdup(value), *port = strchr(addr, ':');
+
+		if (port != NULL)
+			*port++ = '\0';
+		if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1 ||
+		    (port != NULL && (atoi(port) <= 0 || atoi(port) > 65535)))
+		{
+			my_logf("%s must be an IPv4 address[:port]",
+				env_asinfo_server);
+			my_exit(1);
+		}
+		if (port != NULL)
+			sin.sin_port = htons((uint16_t)atoi(port));
+		res.nsaddr_list[0] = sin;
+		res.nscount = 1;
+		free(addr);
+	}
+}
+
+/* asinfo_open() -- open the socket that queries go out on, if need be.
+ *
+ * return false if it can't be, such as when no IPv4 server is configured.
+ */
+static bool
+asinfo_open(void) {
+	int i;
+
+	if (asinfo_sock >= 0)
+		return true;
+	if (asinfo_nosock)
+		return false;
+	asinfo_init();
+	asinfo_nosock = true;
+	for (i = 0; i < res.nscount; i++)
+		if (res.nsaddr_list[i].sin_family == AF_INET)
+			asinfo_servers[asinfo_nservers++] =
+				res.nsaddr_list[i];
+	if (asinfo_nservers == 0)
+		return false;
+	asinfo_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (asinfo_sock < 0)
+		return false;
+	if (fcntl(asinfo_sock, F_SETFL,
+		  fcntl(asinfo_sock, F_GETFL) | O_NONBLOCK) < 0 ||
+	    fcntl(asinfo_sock, F_SETFD, FD_CLOEXEC) < 0)
+	{
+		close(asinfo_sock);
+		asinfo_sock = -1;
+		return false;
+	}
+	asinfo_nosock = false;
+	return true;
+}
+
+/* asinfo_find(dname, add) -- find a name's lookup in the cache, or add it.
+ *
+ * return NULL if it isn't there, and isn't to be added.
+ */
+static asinfo_t
+asinfo_find(const char *dname, bool add) {
+	uint32_t hash = asinfo_hash(dname);
+	asinfo_t a;
+
+	if (asinfo_arena == NULL)
+		asinfo_arena = arena_new(ASINFO_ARENA_CHUNK);
+	if (asinfo_table != NULL)
+		for (a = asinfo_table[hash & (asinfo_buckets - 1)];
+		     a != NULL; a = a->next)
+			if (strcmp(a->dname, dname) == 0)
+				return a;
+	if (!add)
+		return NULL;
+
+	/* keep the chains short by doubling, rehashing from the names. */
+	if (asinfo_count == asinfo_buckets) {
+		size_t buckets = asinfo_buckets == 0 ? 1024 :
+			asinfo_buckets * 2;
+		asinfo_t *table = calloc(buckets, sizeof *table);
+
+		if (table == NULL)
+			my_panic(true, "calloc");
+		for (size_t i = 0; i < asinfo_buckets; i++)
+			while ((a = asinfo_table[i]) != NULL) {
+				uint32_t h = asinfo_hash(a->dname);
+
+				asinfo_table[i] = a->next;
+				a->next = table[h & (buckets - 1)];
+				table[h & (buckets - 1)] = a;
+			}
+		free(asinfo_table);
+		asinfo_table = table;
+		asinfo_buckets = buckets;
+	}
+	a = arena_alloc(asinfo_arena, sizeof *a);
+	memset(a, 0, sizeof *a);
+	a->dname = arena_strdup(asinfo_arena, dname);
+	a->next = asinfo_table[hash & (asinfo_buckets - 1)];
+	asinfo_table[hash & (asinfo_buckets - 1)] = a;
+	asinfo_count++;
+	return a;
+}
+
+/* asinfo_hash(dname) -- FNV-1a hash of a name, for the cache.
+ */
+static uint32_t
+asinfo_hash(const char *dname) {
+	uint32_t hash = 2166136261u;
+
+	for (const char *p = dname; *p != '\0'; p++)
+		hash = (hash ^ (u_char)*p) * 16777619u;
+	return hash;
+}
+
+/* asinfo_queue(a) -- send a lookup's query, or queue it for a free slot,
+ * or park it behind one due for a nearby address.
+ */
+static void
+asinfo_queue(asinfo_t a) {
+	if (a->queued)
+		return;
+	a->queued = true;
+	a->link = NULL;
+	if (a->ipv4) {
+		struct asinfo_node *n = asinfo_insert(a->addr,
+						      ASINFO_PREFIX_LEN);
+
+		if (n->lead != NULL && !n->lone) {
+			a->link = n->lead->parked;
+			n->lead->parked = a;
+			return;
+		}
+		n->lead = a;
+	}
+	if (asinfo_queued_last == NULL)
+		asinfo_queued = a;
+	else
+		asinfo_queued_last->link = a;
+	asinfo_queued_last = a;
+	asinfo_pump();
+}
+
+/* asinfo_pump() -- send queued queries while there are free slots.
+ *
+ * a lookup whose address is covered by a prefix learned while it waited
+ * is answered from that, and needs no query after all.
+ */
+static void
+asinfo_pump(void) {
+	while (asinfo_queued != NULL && asinfo_nflight < ASINFO_MAX_QUERIES) {
+		const struct asinfo_node *n;
+		asinfo_t a = asinfo_queued;
+
+		asinfo_queued = a->link;
+		if (asinfo_queued == NULL)
+			asinfo_queued_last = NULL;
+		if (a->ipv4 && (n = asinfo_match(a->addr, asinfo_now())) != NULL)
+			asinfo_cover(a, n);
+		else
+			asinfo_send(a);
+	}
+}
+
+/* asinfo_send(a) -- (re)send a lookup's query, and put it in flight.
+ *
+ * a query keeps its ID across retransmissions, so a late answer to an
+ * earlier try still counts.
+ */
+static void
+asinfo_send(asinfo_t a) {
+	const struct sockaddr_in *server;
+	u_char buf[NS_PACKETSZ];
+	int n;
+
+	n = res_nmkquery(&res, ns_o_query, a->dname, ns_c_in, ns_t_txt,
+			 NULL, 0, NULL, buf, sizeof buf);
+	if (n < 0) {
+		asinfo_fail(a, NO_RECOVERY, -1);
+		return;
+	}
+	if (a->tries == 0)
+		a->id = (uint16_t)ns_get16(buf);
+	else
+		ns_put16(a->id, buf);
+	server = &asinfo_servers[a->tries % asinfo_nservers];
+	DEBUG(2, true, "asinfo send (%s) id %u try %d\n",
+	      a->dname, a->id, a->tries);
+	/* a failed send is a lost query, to be retransmitted later. */
+	(void) sendto(asinfo_sock, buf, (size_t)n, 0,
+		      (const struct sockaddr *)server, sizeof *server);
+	a->tries++;
+	a->resend_at = asinfo_now() + res.retrans * 1000LL;
+	a->link = NULL;
+	if (asinfo_flight_last == NULL)
+		asinfo_flight = a;
+	else
+		asinfo_flight_last->link = a;
+	asinfo_flight_last = a;
+	asinfo_nflight++;
+}
+
+/* asinfo_reply(buf, len, from) -- match an answer to its query, and take it.
+ *
+ * anything not from one of our servers, or not answering a query in
+ * flight, is ignored. results are what res_nquery() would have given.
+ */
+static void
+asinfo_reply(const u_char *buf, size_t len, const struct sockaddr_in *from) {
+	char *result = NULL, *asnum = NULL, *cidr = NULL;
+	int i, rcode;
+	asinfo_t a;
+	ns_msg msg;
+	ns_rr rr;
+
+	for (i = 0; i < asinfo_nservers; i++)
+		if (from->sin_addr.s_addr ==
+		    asinfo_servers[i].sin_addr.s_addr &&
+		    from->sin_port == asinfo_servers[i].sin_port)
+			break;
+	if (i == asinfo_nservers)
+		return;
+	if (ns_initparse(buf, (int)len, &msg) < 0 ||
+	    ns_msg_getflag(msg, ns_f_qr) == 0 ||
+	    ns_msg_count(msg, ns_s_qd) != 1 ||
+	    ns_parserr(&msg, ns_s_qd, 0, &rr) < 0)
+		return;
+	for (a = asinfo_flight; a != NULL; a = a->link)
+		if (a->id == ns_msg_id(msg) &&
+		    strcasecmp(ns_rr_name(rr), a->dname) == 0)
+			break;
+	if (a == NULL || ns_rr_type(rr) != ns_t_txt ||
+	    ns_rr_class(rr) != ns_c_in)
+		return;
+	asinfo_unflight(a);
+
+	/* a truncated answer is retried over TCP, by the stub resolver. */
+	if (ns_msg_getflag(msg, ns_f_tc) != 0) {
+		asinfo_query(a);
+		return;
+	}
+	rcode = ns_msg_getflag(msg, ns_f_rcode);
+	if (rcode == ns_r_noerror && ns_msg_count(msg, ns_s_an) != 0) {
+		result = asinfo_parse(buf, (int)len, &asnum, &cidr);
+		asinfo_settle(a, result, asnum, cidr, result == NULL ?
+			      asinfo_ttl(buf, (int)len) : -1);
+	} else if (rcode == ns_r_nxdomain) {
+		asinfo_fail(a, HOST_NOT_FOUND, asinfo_ttl(buf, (int)len));
+	} else if (rcode == ns_r_servfail) {
+		asinfo_fail(a, TRY_AGAIN, -1);
+	} else if (rcode == ns_r_noerror) {
+		asinfo_fail(a, NO_DATA, asinfo_ttl(buf, (int)len));
+	} else {
+		asinfo_fail(a, NO_RECOVERY, -1);
+	}
+}
+
+/* asinfo_unflight(a) -- take a lookup off the in flight list.
+ */
+static void
+asinfo_unflight(asinfo_t a) {
+	asinfo_t *ap, prev = NULL;
+
+	for (ap = &asinfo_flight; *ap != a; ap = &(*ap)->link)
+		prev = *ap;
+	*ap = a->link;
+	if (asinfo_flight_last == a)
+		asinfo_flight_last = prev;
+	a->link = NULL;
+	asinfo_nflight--;
+}
+
+/* asinfo_query(a) -- look a name up with a blocking res_nquery().
+ */
+static void
+asinfo_query(asinfo_t a) {
+	char *result = NULL, *asnum = NULL, *cidr = NULL;
+	u_char buf[NS_PACKETSZ];
+	int n;
+
+	DEBUG(1, true, "asinfo_query(%s)\n", a->dname);
+	asinfo_init();
+	n = res_nquery(&res, a->dname, ns_c_in, ns_t_txt, buf, sizeof buf);
+	if (n < 0) {
+		/* res_nquery() doesn't say how long a negative answer lasts. */
+		asinfo_fail(a, res.res_h_errno, -1);
+		return;
+	}
+	result = asinfo_parse(buf, n, &asnum, &cidr);
+	asinfo_settle(a, result, asnum, cidr,
+		      result == NULL ? asinfo_ttl(buf, n) : -1);
+}
+
+/* asinfo_fail(a, herrno, ttl) -- settle a lookup that got no usable answer.
+ *
+ * a name that doesn't exist isn't an error, it just has no ASINFO.
+ */
+static void
+asinfo_fail(asinfo_t a, int herrno, long ttl) {
+	asinfo_settle(a, herrno == HOST_NOT_FOUND ? NULL :
+		      strdup(hstrerror(herrno)), NULL, NULL, ttl);
+}
+
+/* asinfo_settle(a, result, asnum, cidr, ttl) -- remember how a lookup went
+ *
+ * takes (frees) the heap-allocated strings, keeping copies in the cache.
+ * an answer that lasts ttl seconds is learned, and one that lasts none
+ * (ttl <= 0, as errors do) is looked up again the next time it's needed.
+ */
+static void
+asinfo_settle(asinfo_t a, char *result, char *asnum, char *cidr, long ttl) {
+	if (result != NULL)
+		a->result = arena_strdup(asinfo_arena, result);
+	else if (asnum != NULL && cidr != NULL) {
+		a->asnum = arena_strdup(asinfo_arena, asnum);
+		a->cidr = arena_strdup(asinfo_arena, cidr);
+	}
+	DESTROY(result);
+	DESTROY(asnum);
+	DESTROY(cidr);
+	a->expires = asinfo_now() + (ttl > 0 ? ttl * 1000LL : 0);
+	a->done = true;
+	if (ttl > 0 && a->ipv4)
+		asinfo_learn(a);
+	asinfo_release(a);
+}
+
+/* asinfo_renew(a) -- forget how a lookup came out, to look it up again.
+ */
+static void
+asinfo_renew(asinfo_t a) {
+	a->result = a->asnum = a->cidr = NULL;
+	a->tries = 0;
+	a->queued = a->done = a->counted = false;
+}
+
+/* asinfo_cover(a, n) -- answer a lookup from a learned prefix, without
+ * ever querying for it.
+ */
+static void
+asinfo_cover(asinfo_t a, const struct asinfo_node *n) {
+	a->result = n->result;
+	a->asnum = n->asnum;
+	a->cidr = n->cidr;
+	a->expires = n->expires;
+	a->done = a->counted = true;
+	asinfo_release(a);
+}
+
+/* asinfo_release(a) -- a lookup is done, so those parked behind it aren't
+ * waiting anymore. whichever its answer covered are answered from that,
+ * and the rest are queued, with no more parking in that prefix.
+ */
+static void
+asinfo_release(asinfo_t a) {
+	const struct asinfo_node *cover;
+	struct asinfo_node *n;
+	long long now;
+	asinfo_t p;
+
+	if (!a->ipv4)
+		return;
+	n = asinfo_insert(a->addr, ASINFO_PREFIX_LEN);
+	if (n->lead != a)
+		return;
+	n->lead = NULL;
+	now = asinfo_now();
+	cover = asinfo_match(a->addr, now);
+	if (cover == NULL || cover->len > ASINFO_PREFIX_LEN)
+		n->lone = true;
+	while ((p = a->parked) != NULL) {
+		a->parked = p->link;
+		p->link = NULL;
+		if ((cover = asinfo_match(p->addr, now)) != NULL) {
+			asinfo_cover(p, cover);
+		} else {
+			p->queued = false;
+			asinfo_queue(p);
+		}
+	}
+}
+
+/* asinfo_learn(a) -- add what a lookup's answer says to the prefix trie.
+ *
+ * an AS and CIDR cover every address in that prefix; an answer having
+ * neither, only that address. if the prefix doesn't cover the address,
+ * something is wrong with it, and it isn't learned.
+ */
+static void
+asinfo_learn(asinfo_t a) {
+	struct asinfo_node *n;
+	uint32_t prefix = a->addr;
+	int len = 32;
+
+	if (a->result == NULL && a->asnum != NULL) {
+		if (!asinfo_cidr(a->cidr, &prefix, &len) ||
+		    ((a->addr ^ prefix) & asinfo_mask(len)) != 0)
+			return;
+	}
+	n = asinfo_insert(prefix, len);
+	if (!n->known) {
+		if (a->asnum != NULL)
+			asinfo_counts.prefixes++;
+		else
+			asinfo_counts.negatives++;
+	}
+	n->known = true;
+	n->expires = a->expires;
+	n->result = a->result;
+	n->asnum = a->asnum;
+	n->cidr = a->cidr;
+	DEBUG(2, true, "asinfo learn %08x/%d (%s)\n", prefix, len, a->dname);
+}
+
+/* asinfo_insert(prefix, len) -- find a prefix's node in the trie, or add it.
+ */
+static struct asinfo_node *
+asinfo_insert(uint32_t prefix, int len) {
+	struct asinfo_node **np, *n, *new, *fork;
+	int common;
+
+	prefix &= asinfo_mask(len);
+	for (np = &asinfo_trie; (n = *np) != NULL; np = &n->child[
+		     (prefix >> (31 - n->len)) & 1])
+	{
+		uint32_t diff = n->prefix ^ prefix;
+
+		common = diff == 0 ? 32 : __builtin_clz(diff);
+		if (common > n->len)
+			common = n->len;
+		if (common > len)
+			common = len;
+		if (common == n->len && common == len)
+			return n;
+		if (common < n->len)
+			break;
+		/* n covers the prefix, which goes somewhere below it. */
+	}
+	new = arena_alloc(asinfo_arena, sizeof *new);
+	memset(new, 0, sizeof *new);
+	new->prefix = prefix;
+	new->len = len;
+	if (n == NULL) {
+		*np = new;
+	} else if (common == len) {
+		/* the prefix covers n, so goes above it. */
+		new->child[(n->prefix >> (31 - len)) & 1] = n;
+		*np = new;
+	} else {
+		/* the prefix and n part ways, so fork where they do. */
+		fork = arena_alloc(asinfo_arena, sizeof *fork);
+		memset(fork, 0, sizeof *fork);
+		fork->prefix = prefix & asinfo_mask(common);
+		fork->len = common;
+		fork->child[(prefix >> (31 - common)) & 1] = new;
+		fork->child[(n->prefix >> (31 - common)) & 1] = n;
+		*np = fork;
+	}
+	return new;
+}
+
+/* asinfo_match(addr, now) -- longest unexpired learned prefix covering addr
+ *
+ * return NULL if there is none.
+ */
+static const struct asinfo_node *
+asinfo_match(uint32_t addr, long long now) {
+	const struct asinfo_node *n, *best = NULL;
+
+	for (n = asinfo_trie;
+	     n != NULL && ((addr ^ n->prefix) & asinfo_mask(n->len)) == 0;
+	     n = n->len < 32 ? n->child[(addr >> (31 - n->len)) & 1] : NULL)
+		if (n->known && n->expires > now)
+			best = n;
+	return best;
+}
+
+/* asinfo_cidr(cidr, prefix, len) -- parse an IPv4 "address/length"
+ *
+ * return true if it was one.
+ */
+static bool
+asinfo_cidr(const char *cidr, uint32_t *prefix, int *len) {
+	char addr[INET_ADDRSTRLEN];
+	const char *slash = strchr(cidr, '/');
+	struct in_addr in;
+	char *end;
+	long n;
+
+	if (slash == NULL || (size_t)(slash - cidr) >= sizeof addr)
+		return false;
+	memcpy(addr, cidr, (size_t)(slash - cidr));
+	addr[slash - cidr] = '\0';
+	n = strtol(slash + 1, &end, 10);
+	if (inet_pton(AF_INET, addr, &in) != 1 ||
+	    end == slash + 1 || *end != '\0' || n < 0 || n > 32)
+		return false;
+	*prefix = ntohl(in.s_addr);
+	*len = (int)n;
+	return true;
+}
+
+/* asinfo_mask(len) -- netmask, in host order, of a prefix length.
+ */
+static uint32_t
+asinfo_mask(int len) {
+	return len == 0 ? 0 : ~0u << (32 - len);
+}
+
+/* asinfo_ttl(buf, n) -- how many seconds an ASINFO DNS answer may be kept
+ *
+ * that is the least TTL of its TXT RRs, or for a negative answer, the SOA
+ * minimum (RFC 2308), or -1 if there is no saying.
+ */
+static long
+asinfo_ttl(const u_char *buf, int n) {
+	long ttl = -1;
+	ns_msg msg;
+	ns_rr rr;
+
+	if (ns_initparse(buf, n, &msg) < 0)
+		return -1;
+	for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++)
+		if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 &&
+		    ns_rr_type(rr) == ns_t_txt &&
+		    (ttl < 0 || (long)ns_rr_ttl(rr) < ttl))
+			ttl = (long)ns_rr_ttl(rr);
+	if (ttl >= 0 || ns_msg_count(msg, ns_s_an) != 0)
+		return ttl;
+	for (int i = 0; i < ns_msg_count(msg, ns_s_ns); i++)
+		if (ns_parserr(&msg, ns_s_ns, i, &rr) == 0 &&
+		    ns_rr_type(rr) == ns_t_soa && ns_rr_rdlen(rr) >= 4)
+		{
+			long minimum = (long)ns_get32(ns_rr_rdata(rr) +
+						      ns_rr_rdlen(rr) - 4);
+
+			ttl = (long)ns_rr_ttl(rr);
+			if (minimum < ttl)
+				ttl = minimum;
+			break;
+		}
+	return ttl;
+}
+
+/* asinfo_now() -- current time in milliseconds, on a monotonic clock.
+ */
+static long long
+asinfo_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* asinfo_name_ipv4(addr, a4, dname, size) -- form the ASINFO name of an
+ * address, and parse the address (into *a4, in host order).
+ *
+ * return 0 on success, or else -1, with errno set.
+ */
+static int
+asinfo_name_ipv4(const char *addr, uint32_t *a4p, char *dname, size_t size) {
+	u_char a4[32/8];
+
+	if (inet_pton(AF_INET, addr, a4) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	*a4p = (uint32_t)a4[0] << 24 | (uint32_t)a4[1] << 16 |
+		(uint32_t)a4[2] << 8 | a4[3];
+	int n = snprintf(dname, size, "%d.%d.%d.%d.%s",
+			 a4[3], a4[2], a4[1], a4[0], asinfo_domain);
+	if (n < 0)
+		return -1;
+	if ((size_t)n >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
 /* asinfo_from_ipv4(addr, asnum, cidr) -- prepare and use ASINFO IPv4 name
  *
  * return NULL on success, or else, reason (malloc'd string) for failure.
@@ -105,18 +960,33 @@ asinfo_shutdown(void) {
  */
 static char *
 asinfo_from_ipv4(const char *addr, char **asnum, char **cidr) {
-	u_char a4[32/8];
-	char *dname;
+	const struct asinfo_node *n;
+	char dname[NS_MAXDNAME];
+	long long now;
+	uint32_t a4;
+	asinfo_t a;
 
-	if (inet_pton(AF_INET, addr, a4) < 0)
+	if (asinfo_name_ipv4(addr, &a4, dname, sizeof dname) < 0)
 		return strdup(strerror(errno));
-	int n = asprintf(&dname, "%d.%d.%d.%d.%s",
-			 a4[3], a4[2], a4[1], a4[0], asinfo_domain);
-	if (n < 0)
-		return strdup(strerror(errno));
-	char *result = asinfo_from_dns(dname, asnum, cidr);
-	free(dname);
-	return result;
+
+	/* the address's own answer, if it has one, is the most specific;
+	 * a learned prefix will do if it has none, or it has gone stale.
+	 */
+	now = asinfo_now();
+	a = asinfo_find(dname, false);
+	if ((a == NULL || (a->done && a->expires <= now)) &&
+	    (n = asinfo_match(a4, now)) != NULL)
+	{
+		asinfo_counts.hits++;
+		return asinfo_answer(n->result, n->asnum, n->cidr,
+				     asnum, cidr);
+	}
+	if (a == NULL) {
+		a = asinfo_find(dname, true);
+		a->addr = a4;
+		a->ipv4 = true;
+	}
+	return asinfo_from_lookup(a, asnum, cidr);
 }
 
 #ifdef asinfo_ipv6
@@ -157,7 +1027,6 @@ asinfo_from_ipv6(const char *addr, char **asnum, char **cidr) {
 	free(dname);
 	return result;
 }
-#endif
 
 /* asinfo_from_dns(dname, asnum, cidr) -- retrieve and parse a ASINFO DNS TXT
  *
@@ -167,22 +1036,106 @@ asinfo_from_ipv6(const char *addr, char **asnum, char **cidr) {
  */
 static char *
 asinfo_from_dns(const char *dname, char **asnum, char **cidr) {
-	u_char buf[NS_PACKETSZ];
-	int n, an, rrn, rcode;
+	return asinfo_from_lookup(asinfo_find(dname, true), asnum, cidr);
+}
+#endif
+
+/* asinfo_from_lookup(a, asnum, cidr) -- finish a lookup, and use its answer
+ *
+ * return NULL on success, or else, reason (malloc'd string) for failure.
+ *
+ * side effect: on success, *asnum and *cidr will be heap-allocated strings.
+ *
+ * a name looked up before is answered from the cache, even if it has
+ * since expired; one being looked up is waited for, along with anything
+ * else in flight.
+ */
+static char *
+asinfo_from_lookup(asinfo_t a, char **asnum, char **cidr) {
+	if (!a->done) {
+		if (asinfo_open()) {
+			asinfo_queue(a);
+			asinfo_wait(a);
+		} else {
+			asinfo_query(a);
+		}
+	}
+	if (a->counted) {
+		asinfo_counts.hits++;
+	} else {
+		asinfo_counts.misses++;
+		a->counted = true;
+	}
+	return asinfo_answer(a->result, a->asnum, a->cidr, asnum, cidr);
+}
+
+/* asinfo_answer(result, asnum, cidr, asnump, cidrp) -- copy out an answer
+ *
+ * return NULL on success, or else, reason (malloc'd string) for failure.
+ *
+ * side effect: on success, *asnump and *cidrp will be heap-allocated strings.
+ */
+static char *
+asinfo_answer(const char *result, const char *asnum, const char *cidr,
+	      char **asnump, char **cidrp)
+{
+	if (result != NULL)
+		return strdup(result);
+	if (asnum != NULL && cidr != NULL) {
+		*asnump = strdup(asnum);
+		*cidrp = strdup(cidr);
+	}
+	return NULL;
+}
+
+/* asinfo_from_table(rrtype, rdata, asnum, cidr) -- find ASINFO for A/AAAA
+ * string in the local pfx2as table.
+ *
+ * return NULL on success, or else, reason (malloc'd string) for failure.
+ *
+ * side effect: on success, *asnum and *cidr will be heap-allocated strings.
+ */
+static char *
+asinfo_from_table(const char *rrtype, const char *rdata,
+		  char **asnum, char **cidr)
+{
+	char addr[INET6_ADDRSTRLEN];
+	u_char a[128/8];
+	const void *prefix;
+	const char *as;
+	int af, len;
+
+	if (strcmp(rrtype, "A") == 0)
+		af = AF_INET;
+	else if (strcmp(rrtype, "AAAA") == 0)
+		af = AF_INET6;
+	else
+		return NULL;
+	if (inet_pton(af, rdata, a) != 1)
+		return strdup(strerror(EINVAL));
+	as = pfx2as_lookup(asinfo_pfx2as, af, a, &prefix, &len);
+	if (as == NULL ||
+	    inet_ntop(af, prefix, addr, sizeof addr) == NULL)
+		return NULL;
+	if (asprintf(cidr, "%s/%d", addr, len) < 0)
+		return strdup(strerror(errno));
+	*asnum = strdup(as);
+	return NULL;
+}
+
+/* asinfo_parse(buf, n, asnum, cidr) -- parse an ASINFO DNS TXT answer
+ *
+ * return NULL on success, or else, reason (malloc'd string) for failure.
+ *
+ * side effect: on success, *asnum and *cidr will be heap-allocated strings.
+ */
+static char *
+asinfo_parse(const u_char *buf, int n, char **asnum, char **cidr) {
+	int an, rrn, rcode;
 	char *result;
 	ns_msg msg;
 	ns_rr rr;
 
-	DEBUG(1, true, "asinfo_from_dns(%s)\n", dname);
-	if ((res.options & RES_INIT) == 0)
-		res_ninit(&res);
-	n = res_nquery(&res, dname, ns_c_in, ns_t_txt, buf, sizeof buf);
-	if (n < 0) {
-		if (res.res_h_errno == HOST_NOT_FOUND)
-			return NULL;
-		else
-			return strdup(hstrerror(res.res_h_errno));
-	}
 	if (ns_initparse(buf, n, &msg) < 0)
 		return strdup(strerror(errno));
 	rcode = ns_msg_getflag(msg, ns_f_rcode);
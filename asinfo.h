@@ -18,15 +18,52 @@
 #define ASINFO_H_INCLUDED 1
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* one ASINFO lookup, which may still be in flight; see asinfo_start(). */
+struct asinfo;
+typedef struct asinfo *asinfo_t;
 
 #ifndef CRIPPLED_LIBC
 char *
 asinfo_from_rr(const char *rrtype, const char *rdata, char **asn, char **cidr);
+
+asinfo_t
+asinfo_start(const char *rrtype, const char *rdata);
+
+bool
+asinfo_done(asinfo_t);
+
+void
+asinfo_wait(asinfo_t);
+
+int
+asinfo_fd(void);
+
+int
+asinfo_timeout(void);
+
+void
+asinfo_poll(void);
+
+/* how many addresses were answered by a learned prefix or an earlier
+ * answer (hits) or needed a query (misses), and what has been learned.
+ */
+struct asinfo_stats {
+	size_t		hits, misses;
+	size_t		prefixes, negatives;
+};
+
+void
+asinfo_stats(struct asinfo_stats *);
 #endif
 
 bool
 asinfo_domain_exists(const char *);
 
+const char *
+asinfo_use_table(const char *);
+
 void
 asinfo_shutdown(void);
 
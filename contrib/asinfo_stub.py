@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2021 by Farsight Security, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""asinfo_stub -- a stand-in DNS server for exercising dnsdbq -a.
+
+It answers TXT questions for d.c.b.a.<any domain> over UDP, the way
+asn.routeviews.org or origin.asn.cymru.com would for the address a.b.c.d,
+after an optional delay and with optional packet loss. Point dnsdbq at it
+with DNSDBQ_ASINFO_SERVER:
+
+    contrib/asinfo_stub.py -p 5353 -d 0.05 &
+    DNSDBQ_ASINFO_SERVER=127.0.0.1:5353 dnsdbq -a -r example.com/A
+
+The answer is made up from the address: AS 64000+b, announced as a.b.0.0/16
+and a.b.c.0/24. Some addresses fail, so that those paths run too. The
+outcome follows the address's last octet, or with --by-prefix its third
+octet, so that every address in a /24 gets the same answer:
+    a multiple of 7:   NXDOMAIN
+    a multiple of 11:  SERVFAIL
+    a multiple of 13:  no data
+NXDOMAIN and no-data answers carry an SOA whose MINIMUM is 30 seconds.
+Names that are not under a reversed address, such as the domain itself,
+get an empty NOERROR answer.
+
+dnsdbq learns prefixes from the answers, and assumes, as holds for real
+ASINFO data, that a prefix's addresses all get the same answer. Without
+--by-prefix that isn't so, and which answer an address is shown with can
+depend on the order the answers arrive in. So to compare runs, say with
+and without -d or -l, use --by-prefix.
+"""
+
+import argparse
+import heapq
+import random
+import select
+import socket
+import struct
+import time
+
+T_TXT = 16
+T_SOA = 6
+C_IN = 1
+NXDOMAIN = 3
+SERVFAIL = 2
+
+
+def question(pkt):
+    """return the question's labels, and the offset just past it."""
+    i = 12
+    labels = []
+    while pkt[i] != 0:
+        n = pkt[i]
+        labels.append(pkt[i + 1:i + 1 + n].decode('ascii', 'replace'))
+        i += 1 + n
+    return labels, i + 1 + 4
+
+
+def cstr(s):
+    b = s.encode('ascii')
+    return bytes([len(b)]) + b
+
+
+def txt_rdata(args, a):
+    """the TXT rdatas announcing the address a (a list of four octets)."""
+    asn = str(64000 + a[1])
+    if args.format == 'cymru':
+        return [cstr('%s | %d.%d.0.0/16 | US | arin | 2000-01-01'
+                     % (asn, a[0], a[1]))]
+    return [cstr(asn) + cstr('%d.%d.0.0' % (a[0], a[1])) + cstr('16'),
+            cstr(asn) + cstr('%d.%d.%d.0' % (a[0], a[1], a[2])) + cstr('24')]
+
+
+def answer(args, pkt):
+    labels, qend = question(pkt)
+    rcode = 0
+    rdatas = []
+    if len(labels) >= 4 and all(x.isdigit() for x in labels[:4]):
+        a = [int(x) for x in reversed(labels[:4])]
+        k = a[2] if args.by_prefix else a[3]
+        if k % 7 == 0:
+            rcode = NXDOMAIN
+        elif k % 11 == 0:
+            rcode = SERVFAIL
+        elif k % 13 != 0:
+            rdatas = txt_rdata(args, a)
+    soa = not rdatas and rcode != SERVFAIL
+    hdr = pkt[:2] + struct.pack('>HHHHH', 0x8180 | rcode, 1, len(rdatas),
+                                1 if soa else 0, 0)
+    body = pkt[12:qend]
+    for rd in rdatas:
+        body += b'\xc0\x0c' + struct.pack('>HHIH', T_TXT, C_IN, args.ttl,
+                                          len(rd)) + rd
+    if soa:
+        rd = b'\x02ns\x00\x02hm\x00' + struct.pack('>IIIII', 1, 2, 3, 4, 30)
+        body += b'\xc0\x0c' + struct.pack('>HHIH', T_SOA, C_IN, 60,
+                                          len(rd)) + rd
+    return hdr + body
+
+
+def serve(args):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    s.bind((args.address, args.port))
+    s.setblocking(False)
+    pending = []        # (due, sequence, response, address)
+    seq = 0
+    while True:
+        timeout = None
+        if pending:
+            timeout = max(0.0, pending[0][0] - time.time())
+        readable, _, _ = select.select([s], [], [], timeout)
+        while readable:
+            try:
+                pkt, addr = s.recvfrom(4096)
+            except BlockingIOError:
+                break
+            if len(pkt) < 12 or random.random() < args.loss:
+                continue
+            seq += 1
+            heapq.heappush(pending, (time.time() + args.delay, seq,
+                                     answer(args, pkt), addr))
+        now = time.time()
+        while pending and pending[0][0] <= now:
+            _, _, resp, addr = heapq.heappop(pending)
+            s.sendto(resp, addr)
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='answer ASINFO TXT questions for dnsdbq -a testing')
+    p.add_argument('-a', dest='address', default='127.0.0.1',
+                   help='address to listen on (default 127.0.0.1)')
+    p.add_argument('-p', dest='port', type=int, default=5353,
+                   help='UDP port to listen on (default 5353)')
+    p.add_argument('-d', dest='delay', type=float, default=0.0,
+                   help='seconds to wait before each answer')
+    p.add_argument('-l', dest='loss', type=float, default=0.0,
+                   help='fraction of questions to drop, 0 to 1')
+    p.add_argument('-t', dest='ttl', type=int, default=300,
+                   help='TTL of the TXT answers (default 300)')
+    p.add_argument('-f', dest='format', choices=('routeviews', 'cymru'),
+                   default='routeviews', help='TXT answer format')
+    p.add_argument('--by-prefix', action='store_true',
+                   help='choose failures by third octet, not last')
+    serve(p.parse_args())
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
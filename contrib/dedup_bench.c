@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* dedup_bench -- time the -p minimal deduper.
+ *
+ * usage: dedup_bench [-a megabytes] keys ...
+ *
+ * for each count given, a fresh deduper is offered that many distinct
+ * host names, each of them twice, in a scrambled order such that every
+ * name's second offer comes after its first. the names are formatted as
+ * they are offered rather than kept, so that only the deduper's own
+ * memory grows with the count; the time spent formatting is measured in
+ * a pass of its own and taken out. -a times the approximate deduper,
+ * whose memory is fixed, instead of the exact one.
+ *
+ * the exact deduper needs about 65 bytes per key, so 1e8 keys want a
+ * machine with 10 GB or more; -a runs at any count in fixed memory.
+ */
+
+#include <sys/resource.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../deduper.h"
+
+#define	SCRAMBLE 2654435761u	/* prime, so (i * SCRAMBLE) % n covers n */
+
+static void run(size_t, size_t);
+static double elapsed(const struct timespec *);
+static size_t key(char *, size_t, size_t);
+static void usage(void) __attribute__((noreturn));
+
+static const char *program_name;
+static volatile size_t sink;
+
+int
+main(int argc, char *argv[]) {
+	size_t approx = 0;
+	int ch;
+
+	program_name = argv[0];
+	while ((ch = getopt(argc, argv, "a:")) != -1) {
+		switch (ch) {
+		case 'a':
+			approx = strtoul(optarg, NULL, 10);
+			if (approx == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+	for (int i = 0; i < argc; i++) {
+		double keys = strtod(argv[i], NULL);
+		size_t n = (size_t)keys;
+
+		if (n == 0)
+			usage();
+		run(n, approx);
+	}
+	return 0;
+}
+
+/* run -- offer n keys twice each to a new deduper, and report.
+ */
+static void
+run(size_t n, size_t approx) {
+	struct deduper_stats stats;
+	struct timespec start;
+	struct rusage ru;
+	double fmt, total;
+	size_t i, dups, sum;
+	deduper_t d;
+	char buf[64];
+
+	if (approx != 0)
+		d = deduper_new_approx(approx << 20, 0.001);
+	else
+		d = deduper_new(10000);
+	if (d == NULL) {
+		fprintf(stderr, "%s: no memory for a deduper\n",
+			program_name);
+		exit(1);
+	}
+
+	/* the formatting alone, kept so that it isn't optimized away. */
+	sum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 2 * n; i++)
+		sum += key(buf, sizeof buf, (i * SCRAMBLE) % n);
+	fmt = elapsed(&start);
+	sink = sum;
+
+	dups = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 2 * n; i++) {
+		key(buf, sizeof buf, (i * SCRAMBLE) % n);
+		if (deduper_tas(d, buf))
+			dups++;
+	}
+	total = elapsed(&start);
+
+	deduper_stats(d, &stats);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%zu keys: %zu dups (%zu expected), %.0f ns/op, "
+	       "maxrss %ld MB",
+	       n, dups, n, (total - fmt) * 1e9 / (double)(2 * n),
+	       ru.ru_maxrss / 1024);
+	if (approx != 0)
+		printf(", false rate %.2g", stats.false_rate);
+	putchar('\n');
+	deduper_destroy(&d);
+}
+
+/* elapsed -- seconds since start.
+ */
+static double
+elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* key -- format the k'th host name into buf, returning its length.
+ */
+static size_t
+key(char *buf, size_t size, size_t k) {
+	int len = snprintf(buf, size, "host%zu.example%zu.com.", k, k % 977);
+
+	return (size_t)len;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: %s [-a megabytes] keys ...\n", program_name);
+	exit(1);
+}
@@ -15,48 +15,112 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "deduper.h"
 
-struct chainlink;
-typedef struct chainlink *chainlink_t;
+/* the table is open-addressed, in groups of DEDUP_GROUP slots. each slot
+ * has a control octet, kept apart from the slots so that a whole group's
+ * fit in one word: DEDUP_EMPTY, or the top seven bits of the key's hash.
+ * a lookup looks at its hash's group, then the next one up, then three
+ * up, and so on; and in each group, only at the slots whose control octet
+ * matches. the table doubles when it's 7/8 full, and nothing is ever
+ * removed, so an empty slot ends every search. keys are copied into an
+ * arena, and never move.
+ *
+ * an approximate deduper is a blocked bloom filter instead: each string
+ * sets (and tests) some bits in one cache-line-sized block, chosen by its
+ * hash. its memory is fixed, and a string is wrongly called a duplicate at
+ * the rate the bits already set in its block make likely.
+ */
+#define	DEDUP_GROUP 8
+#define	DEDUP_EMPTY 0x80
+#define	DEDUP_ARENA_CHUNK (64 * 1024)
+#define	DEDUP_BLOCK 8		/* 64-bit words, 512 bits */
+#define	DEDUP_MAX_HASHES 16
 
-struct chainlink {
-	chainlink_t next;
-	char str[];
+struct dedup_slot {
+	const char	*str;
+	uint32_t	len;
+	uint32_t	hash;		/* low bits, which choose the group */
 };
-
-/* keep this adjacent to the related 'struct' (chainlink). */
-static inline size_t
-chainlink_size(size_t length) {
-	return sizeof(struct chainlink) + length + 1;
-}
+typedef struct dedup_slot *dedup_slot_t;
 
 struct deduper {
-	size_t buckets;
-	chainlink_t chains[];
+	arena_t		keys;
+	uint8_t		*ctrl;
+	dedup_slot_t	slots;
+	size_t		ngroup;		/* a power of two */
+	size_t		count;
+	/* if approximate. */
+	uint64_t	*filter;	/* blocks, aligned */
+	void		*filter_mem;	/* as allocated */
+	size_t		nblock;
+	unsigned	nhash;		/* bits per string */
+	size_t		tested, unique;
 };
 
-/* keep this adjacent to the related 'struct' (deduper). */
-static inline size_t
-deduper_size(size_t buckets) {
-	return sizeof(struct deduper) + buckets * sizeof(chainlink_t);
-}
+static bool deduper_filter_tas(deduper_t, uint64_t);
+static void deduper_grow(deduper_t);
+static size_t deduper_find(deduper_t, uint32_t, uint8_t);
+static uint64_t hash_str(const char *, size_t);
+static inline uint64_t hash_fmix(uint64_t);
+
+/* deduper_new(size) -- create a deduper with room for this many strings
+ *
+ * it grows as needed, so the size is only a hint.
+ */
+deduper_t
+deduper_new(size_t size) {
+	deduper_t ret = malloc(sizeof *ret);
+	size_t ngroup = 1;
 
-static unsigned long hash_djb2(const char *);
+	if (ret == NULL)
+		abort();
+	while (ngroup * (DEDUP_GROUP - 1) < size)
+		ngroup *= 2;
+	*ret = (struct deduper){ .keys = arena_new(DEDUP_ARENA_CHUNK),
+				 .ngroup = ngroup };
+	ret->ctrl = malloc(ngroup * DEDUP_GROUP);
+	ret->slots = malloc(ngroup * DEDUP_GROUP * sizeof *ret->slots);
+	if (ret->ctrl == NULL || ret->slots == NULL)
+		abort();
+	memset(ret->ctrl, DEDUP_EMPTY, ngroup * DEDUP_GROUP);
+	return ret;
+}
 
-/* deduper_new(buckets) -- create a deduper having a set number of buckets
+/* deduper_new_approx(size, rate) -- create a deduper of fixed size, in octets
+ *
+ * it tests strings against a bloom filter, so that some which were never
+ * set will be seen as duplicates. rate is how often that's acceptable,
+ * which holds until there's a string set for about every 1.44*log2(1/rate)
+ * bits of the filter (15 at 0.001), and then rises. returns NULL, with
+ * errno set, if the filter can't be allocated.
  */
 deduper_t
-deduper_new(size_t buckets) {
-	deduper_t ret = malloc(deduper_size(buckets));
+deduper_new_approx(size_t size, double rate) {
+	deduper_t ret = malloc(sizeof *ret);
+	size_t block = DEDUP_BLOCK * sizeof(uint64_t);
+	unsigned nhash = 0;
+
 	if (ret == NULL)
 		abort();
-	memset(ret, 0x00, deduper_size(buckets));
-	ret->buckets = buckets;
+	/* log2(1/rate) bits per string is the optimum for a bloom filter. */
+	for (double p = 1.0; p > rate && nhash < DEDUP_MAX_HASHES; p /= 2)
+		nhash++;
+	*ret = (struct deduper){ .nhash = nhash > 0 ? nhash : 1,
+				 .nblock = size / block > 0 ? size / block : 1 };
+	ret->filter_mem = calloc(ret->nblock + 1, block);
+	if (ret->filter_mem == NULL) {
+		free(ret);
+		return NULL;
+	}
+	ret->filter = (uint64_t *)(((uintptr_t)ret->filter_mem + block - 1) &
+				   ~(uintptr_t)(block - 1));
 	return ret;
 }
 
@@ -64,70 +128,199 @@ deduper_new(size_t buckets) {
  */
 bool
 deduper_tas(deduper_t me, const char *str) {
-	size_t bucket = hash_djb2(str) % me->buckets;
-	for (chainlink_t chainlink = me->chains[bucket];
-	     chainlink != NULL;
-	     chainlink = chainlink->next)
-		if (strcmp(str, chainlink->str) == 0)
-			return true;
 	size_t len = strlen(str);
-	chainlink_t chainlink = malloc(chainlink_size(len));
-	if (chainlink == NULL)
+	uint64_t hash = hash_str(str, len);
+	uint8_t tag = (uint8_t)(hash >> 57);
+	size_t mask = me->ngroup - 1;
+
+	me->tested++;
+	if (me->filter != NULL) {
+		if (deduper_filter_tas(me, hash))
+			return true;
+		me->unique++;
+		return false;
+	}
+
+	for (size_t g = (uint32_t)hash & mask, i = 1; ; g = (g + i++) & mask) {
+		const uint8_t *ctrl = me->ctrl + g * DEDUP_GROUP;
+		dedup_slot_t slots = me->slots + g * DEDUP_GROUP;
+
+		for (size_t n = 0; n < DEDUP_GROUP; n++) {
+			if (ctrl[n] == tag) {
+				if (slots[n].hash == (uint32_t)hash &&
+				    slots[n].len == len &&
+				    memcmp(slots[n].str, str, len) == 0)
+					return true;
+			} else if (ctrl[n] == DEDUP_EMPTY) {
+				goto absent;
+			}
+		}
+	}
+ absent:
+	if (len > UINT32_MAX)
 		abort();
-	memset(chainlink, 0, chainlink_size(len));
-	chainlink->next = me->chains[bucket];
-	strcpy(chainlink->str, str);
-	me->chains[bucket] = chainlink;
+	if (me->count >= me->ngroup * (DEDUP_GROUP - 1))
+		deduper_grow(me);
+	size_t slot = deduper_find(me, (uint32_t)hash, tag);
+	char *copy = arena_alloc(me->keys, len + 1);
+	memcpy(copy, str, len + 1);
+	me->slots[slot] = (struct dedup_slot){copy, (uint32_t)len,
+					      (uint32_t)hash};
+	me->count++;
+	me->unique++;
 	return false;
 }
 
+/* deduper_stats(stats) -- report how a deduper has been used
+ *
+ * for an approximate deduper, false_rate estimates how likely a string
+ * not yet set would now be seen as a duplicate.
+ */
+void
+deduper_stats(deduper_t me, struct deduper_stats *stats) {
+	*stats = (struct deduper_stats){ .tested = me->tested,
+					 .unique = me->unique };
+	if (me->filter == NULL)
+		return;
+	for (size_t b = 0; b < me->nblock; b++) {
+		const uint64_t *block = me->filter + b * DEDUP_BLOCK;
+		unsigned bits = 0;
+		double p = 1.0;
+
+		for (int w = 0; w < DEDUP_BLOCK; w++)
+			bits += (unsigned)__builtin_popcountll(block[w]);
+		for (unsigned n = 0; n < me->nhash; n++)
+			p *= bits / (DEDUP_BLOCK * 64.0);
+		stats->false_rate += p;
+	}
+	stats->false_rate /= (double)me->nblock;
+}
+
 /* deduper_dump(out) -- for debugging, render a deduper's contents to an output
  */
 void
 deduper_dump(deduper_t me, FILE *out) {
-	for (size_t bucket = 0; bucket < me->buckets; bucket++)
-		if (me->chains[bucket] != NULL) {
-			fprintf(out, "[%zu]", bucket);
-			for (chainlink_t chainlink = me->chains[bucket];
-			     chainlink != NULL;
-			     chainlink = chainlink->next)
-				fprintf(out, " \"%s\"", chainlink->str);
-			fprintf(out, ".\n");
-		}
+	if (me->filter != NULL) {
+		fprintf(out, "approximate, %zu blocks, %u bits per string.\n",
+			me->nblock, me->nhash);
+		return;
+	}
+	for (size_t slot = 0; slot < me->ngroup * DEDUP_GROUP; slot++)
+		if (me->ctrl[slot] != DEDUP_EMPTY)
+			fprintf(out, "[%zu] \"%s\".\n",
+				slot, me->slots[slot].str);
 }
 
 /* deduper_destroy() -- release all heap storage used by a deduper
  */
 void
 deduper_destroy(deduper_t *me) {
-	for (size_t bucket = 0; bucket < (*me)->buckets; bucket++) {
-		chainlink_t next = (*me)->chains[bucket];
-		if (next != NULL) {
-		       (*me)->chains[bucket] = NULL;
-			for (chainlink_t chainlink = next;
-			     chainlink != NULL;
-			     chainlink = next) {
-				next = chainlink->next;
-				chainlink->next = NULL;
-				chainlink->str[0] = '\0';
-				free(chainlink);
-			}
-		}
-	}
-	memset(*me, 0, deduper_size((*me)->buckets));
+	if ((*me)->keys != NULL)
+		arena_destroy(&(*me)->keys);
+	free((*me)->ctrl);
+	free((*me)->slots);
+	free((*me)->filter_mem);
+	memset(*me, 0, sizeof **me);
 	free(*me);
 	*me = NULL;
 }
 
-/* hash_djb2() -- compute daniel j. bernstein (djb2) hash #2 over a string
+/* deduper_filter_tas() -- test and set a hash's bits in a bloom filter
+ *
+ * the high half of the hash picks the block, and each bit in it is nine
+ * more bits, mixed from the whole, seven to a word. (double hashing would
+ * be cheaper, but in a block this small, two strings whose two steps start
+ * out alike would set nearly all the same bits.)
  */
-static unsigned long
-hash_djb2(const char *str) {
-	unsigned long hash = 5381;
-	unsigned int c;
+static bool
+deduper_filter_tas(deduper_t me, uint64_t hash) {
+	uint64_t *block = me->filter +
+		(((hash >> 32) * me->nblock) >> 32) * DEDUP_BLOCK;
+	uint64_t mix = hash;
+	bool found = true;
 
-	while ((c = (unsigned char) *str++) != 0)
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	for (unsigned n = 0; n < me->nhash; n++, mix >>= 9) {
+		if (n % 7 == 0)
+			mix = hash = hash_fmix(hash ^ 0x9e3779b97f4a7c15ULL);
+
+		unsigned bit = (unsigned)(mix & 511);
+		uint64_t mask = 1ULL << (bit & 63);
+
+		if ((block[bit >> 6] & mask) == 0) {
+			block[bit >> 6] |= mask;
+			found = false;
+		}
+	}
+	return found;
+}
+
+/* deduper_grow() -- double a deduper's table, moving every slot
+ *
+ * the keys stay where they are in the arena, and their hashes needn't be
+ * computed again.
+ */
+static void
+deduper_grow(deduper_t me) {
+	uint8_t *ctrl = me->ctrl;
+	dedup_slot_t slots = me->slots;
+	size_t nslot = me->ngroup * DEDUP_GROUP;
 
+	me->ngroup *= 2;
+	me->ctrl = malloc(me->ngroup * DEDUP_GROUP);
+	me->slots = malloc(me->ngroup * DEDUP_GROUP * sizeof *me->slots);
+	if (me->ctrl == NULL || me->slots == NULL)
+		abort();
+	memset(me->ctrl, DEDUP_EMPTY, me->ngroup * DEDUP_GROUP);
+	for (size_t n = 0; n < nslot; n++)
+		if (ctrl[n] != DEDUP_EMPTY)
+			me->slots[deduper_find(me, slots[n].hash, ctrl[n])] =
+				slots[n];
+	free(ctrl);
+	free(slots);
+}
+
+/* deduper_find() -- claim the first empty slot for a hash, return its index
+ */
+static size_t
+deduper_find(deduper_t me, uint32_t hash, uint8_t tag) {
+	size_t mask = me->ngroup - 1;
+
+	for (size_t g = hash & mask, i = 1; ; g = (g + i++) & mask)
+		for (size_t n = g * DEDUP_GROUP; n < (g + 1) * DEDUP_GROUP; n++)
+			if (me->ctrl[n] == DEDUP_EMPTY) {
+				me->ctrl[n] = tag;
+				return n;
+			}
+}
+
+/* hash_str() -- compute a 64-bit hash over a counted string
+ *
+ * eight octets at a time, each folded in with a multiply and a shift, and
+ * the whole finished with the splitmix64 finalizer so that the top and
+ * bottom bits (the tag and the group) both depend on every input bit.
+ */
+static uint64_t
+hash_str(const char *str, size_t len) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len, word;
+
+	for (; len >= sizeof word; str += sizeof word, len -= sizeof word) {
+		memcpy(&word, str, sizeof word);
+		hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+		hash ^= hash >> 29;
+	}
+	word = 0;
+	memcpy(&word, str, len);
+	return hash_fmix(hash ^ word);
+}
+
+/* hash_fmix() -- the splitmix64 finalizer
+ */
+static inline uint64_t
+hash_fmix(uint64_t hash) {
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
 	return hash;
 }
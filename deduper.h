@@ -20,8 +20,15 @@
 struct deduper;
 typedef struct deduper *deduper_t;
 
+struct deduper_stats {
+	size_t		tested, unique;
+	double		false_rate;	/* estimated, if approximate */
+};
+
 deduper_t deduper_new(size_t);
+deduper_t deduper_new_approx(size_t, double);
 bool deduper_tas(deduper_t, const char *);
+void deduper_stats(deduper_t, struct deduper_stats *);
 void deduper_dump(deduper_t, FILE *);
 void deduper_destroy(deduper_t *);
 
@@ -43,10 +43,72 @@
 #endif
 #define DEFAULT_VERB 0
 
-/* maximum number of concurrent fetches.
+/* default number of concurrent fetches, for -m, -W, and -x (see -P).
  * must not be greater than any pDNS system's concurrent connection limit.
  */
-#define	MAX_FETCHES 8
+#define	DEFAULT_FETCHES 8
+
+/* largest number of concurrent fetches that -P will accept. */
+#define	MAX_FETCHES 64
+
+/* largest number of retries that -y will accept. */
+#define	MAX_RETRIES 100
+
+/* largest number of time windows that -W will split a lookup into, and
+ * how many results "-W auto" aims to put in each window.
+ */
+#define	MAX_WINDOWS 64
+#define	WINDOW_RESULTS 10000
+
+/* default false duplicate rate for -F, and the most memory it will take,
+ * in megabytes. 4 GiB holds over two billion strings at the default rate,
+ * more than any run of minimal output needs.
+ */
+#define	DEFAULT_FILTER_RATE 0.001
+#define	MAX_FILTER_MB 4096
+
+/* how often -Q or -x reloads the server's rate limits, in seconds. */
+#define	LIMITS_REFRESH 300
+
+/* how many pages -x fetches ahead of the one being written, at most;
+ * only the next one is fetched when -P leaves no room.
+ */
+#define	PAGE_AHEAD 4
+
+/* chunk sizes of the arena that is reset after every line of results,
+ * and of each writer's arena, which is kept until the writer is done.
+ */
+#define	LINE_ARENA_CHUNK 65536
+#define	WRITER_ARENA_CHUNK 4096
+
+/* smallest allocation for a writer's output buffer, which grows by
+ * doubling, and how full it may get before a local source flushes it.
+ */
+#define	OUTBUF_MIN 65536
+#define	OUTBUF_FLUSH 65536
+
+/* memory that a sorter may use before spilling a sorted run to a file,
+ * and the chunk size of the arena its records are kept in.
+ */
+#define	SORT_MEM_MAX (256 * 1024 * 1024)
+#define	SORT_ARENA_CHUNK (1024 * 1024)
+
+/* how many ASINFO queries (-a) may be in flight at once, how many output
+ * lines may wait for their answers before we stop and wait too, and the
+ * chunk size of the arena that remembers the answers.
+ */
+#define	ASINFO_MAX_QUERIES 128
+#define	ASINFO_MAX_HELD 10000
+#define	ASINFO_ARENA_CHUNK 65536
+
+/* the longest IPv4 prefix that ASINFO sources are expected to give, since
+ * longer ones aren't routed. an address waits for an answer already due
+ * for another within that prefix, which is likely to cover both.
+ */
+#define	ASINFO_PREFIX_LEN 24
+
+/* maximum number of rrtypes in one query; each becomes a separate fetch. */
+#define	MAX_RRTYPES 8
 
 #define DNSDBQ_SYSTEM "DNSDBQ_SYSTEM"
 
@@ -66,6 +66,9 @@ static void qparam_debug(const char *, qparam_ct);
 static __attribute__((noreturn)) void usage(const char *, ...);
 static bool parse_long(const char *, long *);
 static void set_timeout(const char *, const char *);
+static void set_fetches(const char *, const char *);
+static void set_windows(const char *, const char *);
+static void set_filter(const char *, const char *);
 static const char *qparam_ready(qparam_t);
 static const char *qparam_option(int, const char *, qparam_t);
 static verb_ct find_verb(const char *);
@@ -73,10 +76,14 @@ static char *select_config(void);
 static void do_batch(FILE *, qparam_ct);
 static const char *batch_options(const char *, qparam_t, qparam_ct);
 static const char *batch_parse(char *, qdesc_t);
-static char *makepath(qdesc_ct);
+static char *makepath(arena_t, qdesc_ct);
 static query_t query_launcher(qdesc_ct, qparam_ct, writer_t);
 static const char *rrtype_correctness(const char *);
-static void launch_fetch(query_t, const char *, pdns_fence_ct);
+static fetch_t launch_fetch(query_t, const char *, pdns_fence_ct);
+static bool summarize_span(query_ct, const char *, pdns_fence_ct,
+			   struct pdns_tuple *);
+static int launch_windows(query_t, const char *, pdns_fence_ct,
+			  const struct pdns_tuple *);
 static void ruminate_json(int, qparam_ct);
 static const char *lookup_ok(void);
 static const char *summarize_ok(void);
@@ -92,13 +99,20 @@ static const char * const conf_files[] = {
 	NULL
 };
 
-const struct presenter pres_text_lookup = { present_text_lookup, true };
-const struct presenter pres_json_lookup = { present_json_lookup, true };
-const struct presenter pres_csv_lookup = { present_csv_lookup, true };
-const struct presenter pres_minimal_lookup = { present_minimal_lookup, false };
-const struct presenter pres_text_summarize = { present_text_summarize, true };
-const struct presenter pres_json_summarize = { present_json_summarize, true };
-const struct presenter pres_csv_summarize = { present_csv_summarize, true };
+const struct presenter pres_text_lookup =
+	{ present_text_lookup, true, true };
+const struct presenter pres_json_lookup =
+	{ present_json_lookup, true, true };
+const struct presenter pres_csv_lookup =
+	{ present_csv_lookup, true, true };
+const struct presenter pres_minimal_lookup =
+	{ present_minimal_lookup, false, false };
+const struct presenter pres_text_summarize =
+	{ present_text_summarize, true, false };
+const struct presenter pres_json_summarize =
+	{ present_json_summarize, true, false };
+const struct presenter pres_csv_summarize =
+	{ present_csv_summarize, true, false };
 
 const struct verb verbs[] = {
 	/* note: element [0] of this array is the DEFAULT_VERB. */
@@ -136,6 +150,7 @@ main(int argc, char *argv[]) {
 	/* global dynamic initialization. */
 	ideal_buffer = 4 * (size_t) sysconf(_SC_PAGESIZE);
 	gettimeofday(&startup_time, NULL);
+	line_arena = arena_new(LINE_ARENA_CHUNK);
 
 	if ((program_name = strrchr(argv[0], '/')) == NULL)
 		program_name = argv[0];
@@ -152,12 +167,15 @@ main(int argc, char *argv[]) {
 	if ((value = getenv(env_timeout)) != NULL)
 		set_timeout(value, env_timeout);
 
+	if ((value = getenv(env_max_fetches)) != NULL)
+		set_fetches(value, env_max_fetches);
+
 	pverb = &verbs[DEFAULT_VERB];
 
 	/* process the command line options. */
 	while ((ch = getopt(argc, argv,
-			    "C:D:R:r:N:n:i:M:u:p:t:b:k:J:V:T:0:o:"
-			    "adfhIjmqSsUv468" QPARAM_GETOPT))
+			    "C:D:R:r:N:n:i:M:u:p:t:b:k:J:V:T:0:o:P:y:W:F:"
+			    "adfhIjmqQSsUvx468" QPARAM_GETOPT))
 	       != -1)
 	{
 		switch (ch) {
@@ -178,7 +196,6 @@ main(int argc, char *argv[]) {
 			if (strncmp(optarg, "countoff", length) == 0) {
 				struct counted *c = countoff(thing);
 				countoff_debug("main", thing, c);
-				DESTROY(c);
 			} else {
 				usage("-0 function unrecognized");
 			}
@@ -340,6 +357,25 @@ main(int argc, char *argv[]) {
 		case 'o':
 			set_timeout(optarg, "-o");
 			break;
+		case 'P':
+			set_fetches(optarg, "-P");
+			break;
+		case 'W':
+			set_windows(optarg, "-W");
+			break;
+		case 'F':
+			set_filter(optarg, "-F");
+			break;
+		case 'y': {
+			long retries;
+
+			if (!parse_long(optarg, &retries) ||
+			    retries < 0 || retries > MAX_RETRIES)
+				usage("-y must be between 0 and %d",
+				      MAX_RETRIES);
+			max_retries = (int)retries;
+			break;
+		    }
 		case 'u':
 			picked_system = strdup(optarg);
 			break;
@@ -460,6 +496,12 @@ main(int argc, char *argv[]) {
 		case 'q':
 			quiet = true;
 			break;
+		case 'Q':
+			pacing = true;
+			break;
+		case 'x':
+			paging = true;
+			break;
 		case 'h':
 			help();
 			my_exit(0);
@@ -493,7 +535,16 @@ main(int argc, char *argv[]) {
 #ifdef CRIPPLED_LIBC
 		usage("the -a option requires a modern functional C library.");
 #else
-		if (!asinfo_domain_exists(asinfo_domain)) {
+		/* a -D with a slash in it names a local pfx2as table. */
+		if (strchr(asinfo_domain, '/') != NULL) {
+			const char *why = asinfo_use_table(asinfo_domain);
+
+			if (why != NULL) {
+				my_logf("ASINFO table (%s): %s",
+					asinfo_domain, why);
+				my_exit(1);
+			}
+		} else if (!asinfo_domain_exists(asinfo_domain)) {
 			my_logf("ASINFO domain (%s) does not exist",
 				asinfo_domain);
 			my_exit(1);
@@ -506,8 +557,20 @@ main(int argc, char *argv[]) {
 		assert(presentation_name == NULL);
 		presentation_name = strdup("text");
 	}
-	if (presentation == pres_minimal)
-		minimal_deduper = deduper_new(minimal_modulus);
+	if (minimal_filter_mb != 0 && presentation != pres_minimal)
+		usage("-F is only for -p minimal");
+	if (presentation == pres_minimal) {
+		if (minimal_filter_mb != 0) {
+			minimal_deduper = deduper_new_approx(
+				minimal_filter_mb * 1024 * 1024,
+				minimal_filter_rate);
+			if (minimal_deduper == NULL)
+				usage("-F %zu megabytes: %s",
+				      minimal_filter_mb, strerror(errno));
+		} else {
+			minimal_deduper = deduper_new(minimal_dedup_size);
+		}
+	}
 
 	if ((msg = qparam_ready(&qp)) != NULL)
 		usage(msg);
@@ -595,6 +658,24 @@ main(int argc, char *argv[]) {
 	/* validate some interrelated options. */
 	if (multiple && batching == batch_none)
 		usage("using -m without -f makes no sense.");
+	if (pacing && batching == batch_none)
+		usage("using -Q without -f makes no sense.");
+	if ((pacing || paging) && psys->limits == NULL)
+		usage("there are no rate limits for this service");
+	if (paging) {
+		if (pverb != &verbs[DEFAULT_VERB])
+			usage("-x only makes sense with the lookup verb");
+		if (psys->encap != encap_saf)
+			usage("-x needs a server that speaks APIv2");
+	}
+	if (time_windows != 0) {
+		if (pverb != &verbs[DEFAULT_VERB])
+			usage("-W only makes sense with the lookup verb");
+		if (psys->encap != encap_saf)
+			usage("-W needs a server that speaks APIv2");
+		if (qp.query_limit != -1 || qp.offset != 0)
+			usage("can't mix -W with -l or -O");
+	}
 	if ((msg = (*pverb->ok)()) != NULL)
 		usage(msg);
 	if ((msg = psys->verb_ok(pverb->name, &qp)) != NULL)
@@ -665,6 +746,8 @@ main(int argc, char *argv[]) {
 		if (qd.mode == ip_mode && qd.rrtype != NULL)
 			usage("can't mix -i with -t");
 
+		if (io_limits_due())
+			psys->limits();
 		writer_t writer = writer_init(qp.output_limit,
 					      ps_stdout, false);
 		(void) query_launcher(&qd, &qp, writer);
@@ -691,9 +774,21 @@ __attribute__((noreturn)) void
 my_exit(int code) {
 	DESTROY(presentation_name);
 
-	/* deduper state if any can be trashed. */
-	if (minimal_deduper != NULL)
+	/* deduper state if any can be trashed, after saying how it went. */
+	if (minimal_deduper != NULL) {
+		struct deduper_stats ds;
+
+		deduper_stats(minimal_deduper, &ds);
+		if (minimal_filter_mb != 0 && !quiet) {
+			my_logf("-p minimal: %zu tested, %zu unique, "
+				"~%.2g false duplicate rate",
+				ds.tested, ds.unique, ds.false_rate);
+		} else {
+			DEBUG(1, true, "-p minimal: %zu tested, %zu unique\n",
+			      ds.tested, ds.unique);
+		}
 		deduper_destroy(&minimal_deduper);
+	}
 
 	/* writers and readers which are still known, must be freed. */
 	unmake_writers();
@@ -710,8 +805,25 @@ my_exit(int code) {
 	/* sort key specifications and computations, are to be freed. */
 	sort_destroy();
 
+	/* the line arena goes after the writers, who might be using it. */
+	if (line_arena != NULL)
+		arena_destroy(&line_arena);
+
 #ifndef CRIPPLED_LIBC
-	/* asinfo logic has an internal DNS resolver context. */
+	/* asinfo logic has an internal DNS resolver context, and a cache
+	 * whose effectiveness is worth knowing.
+	 */
+	if (asinfo_lookup) {
+		struct asinfo_stats as;
+
+		asinfo_stats(&as);
+		if (as.hits + as.misses != 0 && !quiet) {
+			my_logf("-a: %zu cached, %zu looked up; "
+				"%zu prefixes, %zu negatives learned",
+				as.hits, as.misses,
+				as.prefixes, as.negatives);
+		}
+	}
 	asinfo_shutdown();
 #endif
 
@@ -739,12 +851,13 @@ static void
 help(void) {
 	verb_ct v;
 
-	printf("usage: %s [-acdfGghIjmqSsUv468] [-p dns|json|csv|minimal]\n",
+	printf("usage: %s [-acdfGghIjmqQSsUvx468] [-p dns|json|csv|minimal]\n",
 	       program_name);
-	puts("\t[-u SYSTEM] [-V VERB] [-0 FUNCTION=INPUT]\n"
+	puts("\t[-u SYSTEM] [-V VERB] [-0 FUNCTION=INPUT] [-F MB[:RATE]]\n"
 	     "\t[-k (first|last|duration|count|name|type|data)[,...]]\n"
 	     "\t[-l QUERY-LIMIT] [-L OUTPUT-LIMIT]\n"
-	     "\t[-O OFFSET] [-M MAX_COUNT]\n"
+	     "\t[-O OFFSET] [-M MAX_COUNT] [-P FETCHES|auto[:FETCHES]]\n"
+	     "\t[-W WINDOWS|auto[:WINDOWS]] [-y RETRIES]\n"
 	     "\t[-A AFTER] [-B BEFORE]\n"
 	     "\t[-D ASINFO_DOMAIN] [-T (datefix|reverse|chomp|qdetail)[,...] {\n"
 	     "\t\t-f |\n"
@@ -761,7 +874,8 @@ help(void) {
 	     "\tor relative format %%dw%%dd%%dh%%dm%%ds.\n"
 	     "use -a to get ASNs associated with reported IP addresses\n"
 	     "use -c to get complete (strict) time matching for -A and -B.\n"
-	     "for -D, the default is \"%s\"\n"
+	     "for -D, the default is \"%s\"; a path (with a /) names\n"
+	     "\ta local pfx2as table file instead.\n"
 	     "use -d one or more times to ramp up the diagnostic output.\n"
 	     "for -0, the function must be \"countoff\"\n"
 	     "for -f, stdin must contain lines of the following forms:\n"
@@ -772,6 +886,8 @@ help(void) {
 	     "\trdata/raw/HEX-PAIRS[/RRTYPE[,...]]\n"
 	     "\t(output format will depend on -p or -j, framed by '--'.)\n"
 	     "\t(with -ff, framing will be '++ $cmd', '-- $stat ($code)'.\n"
+	     "use -F # with -p minimal to deduplicate in this many megabytes,\n"
+	     "\tletting through false duplicates at RATE (default %g).\n"
 	     "use -g to get graveled results (default is -G, rocks).\n"
 	     "use -h to reliably display this helpful text.\n"
 	     "use -I to see a system-specific account/key summary.\n"
@@ -782,17 +898,26 @@ help(void) {
 	     "use -m with -f for multiple upstream queries in single result.\n"
 	     "use -m with -f -f for multiple upstream queries out of order.\n"
 	     "use -O # to skip this many results in what is returned.\n"
+	     "use -P # to run at most this many fetches at once "
+	     "(default %d),\n"
+	     "\tor -P auto[:#] to adapt to the server's responsiveness.\n"
 	     "use -q for warning reticence.\n"
+	     "use -Q with -f to pace fetches to the server's burst rate.\n"
 	     "use -s to sort in ascending order, "
 	     "or -S for descending order.\n"
 	     "\t-s/-S can be repeated before several -k arguments.\n"
 	     "for -T, transforms are datefix, reverse, chomp, and qdetail.\n"
 	     "use -U to turn off SSL certificate verification.\n"
 	     "use -v to show the program version.\n"
+	     "use -W # to split lookups into this many parallel time windows,\n"
+	     "\tor -W auto[:#] to split them according to their size.\n"
+	     "use -x to page past the server's results limit "
+	     "with parallel offsets.\n"
+	     "use -y # to retry failed or truncated fetches this many times.\n"
 	     "use -4 to force connecting to the server via IPv4.\n"
 	     "use -6 to force connecting to the server via IPv6.\n"
 	     "use -8 to allow 8-bit values in -r and -n arguments.\n",
-	     asinfo_domain);
+	     asinfo_domain, DEFAULT_FILTER_RATE, DEFAULT_FETCHES);
 
 	puts("for -u, system must be one of:");
 #if WANT_PDNS_DNSDB
@@ -928,6 +1053,85 @@ set_timeout(const char *value, const char *source) {
 		usage("%s must be non-negative", source);
 }
 
+/* set_fetches -- ingest a setting for max_fetches and adaptive_fetches
+ *
+ * the value is either a count, or "auto" optionally followed by ":count"
+ * to set the ceiling for adaptive concurrency.
+ * exits through usage() if the value is invalid.
+ */
+static void
+set_fetches(const char *value, const char *source) {
+	const char *count = value;
+	long n;
+
+	adaptive_fetches = false;
+	if (strncasecmp(value, "auto", 4) == 0) {
+		adaptive_fetches = true;
+		if (value[4] == '\0') {
+			max_fetches = MAX_FETCHES;
+			return;
+		}
+		if (value[4] != ':')
+			usage("%s must be a count or auto[:count]", source);
+		count = value + 5;
+	}
+	if (!parse_long(count, &n) || n < 1 || n > MAX_FETCHES)
+		usage("%s count must be between 1 and %d",
+		      source, MAX_FETCHES);
+	max_fetches = (int)n;
+}
+
+/* set_windows -- parse a -W value, which is a count or auto[:count].
+ *
+ * exits through usage() if the value is invalid.
+ */
+static void
+set_windows(const char *value, const char *source) {
+	const char *count = value;
+	long n;
+
+	adaptive_windows = false;
+	if (strncasecmp(value, "auto", 4) == 0) {
+		adaptive_windows = true;
+		if (value[4] == '\0') {
+			time_windows = MAX_WINDOWS;
+			return;
+		}
+		if (value[4] != ':')
+			usage("%s must be a count or auto[:count]", source);
+		count = value + 5;
+	}
+	if (!parse_long(count, &n) || n < 1 || n > MAX_WINDOWS)
+		usage("%s count must be between 1 and %d",
+		      source, MAX_WINDOWS);
+	time_windows = (int)n;
+}
+
+/* set_filter -- parse the -F megabytes[:rate] of approximate deduplication
+ */
+static void
+set_filter(const char *value, const char *source) {
+	const char *colon = strchr(value, ':');
+	char *mb = strndup(value, colon != NULL ?
+				  (size_t)(colon - value) : strlen(value));
+	long n;
+
+	if (!parse_long(mb, &n) || n < 1 || n > MAX_FILTER_MB)
+		usage("%s megabytes must be between 1 and %d",
+		      source, MAX_FILTER_MB);
+	DESTROY(mb);
+	minimal_filter_mb = (size_t)n;
+	if (colon != NULL) {
+		char *end;
+
+		errno = 0;
+		minimal_filter_rate = strtod(colon + 1, &end);
+		if (errno != 0 || end == colon + 1 || *end != '\0' ||
+		    !(minimal_filter_rate > 0.0 && minimal_filter_rate < 1.0))
+			usage("%s rate must be between 0 and 1", source);
+	}
+}
+
 /* qparam_ready -- check and possibly adjust the contents of a qparam.
  */
 static const char *
@@ -1050,10 +1254,16 @@ do_batch(FILE *f, qparam_ct qpp) {
 	char *command = NULL;
 	size_t n = 0;
 
-	/* if doing multiple parallel upstreams, start a writer. */
-	bool one_writer = multiple && batching != batch_verbose;
-	if (one_writer)
+	/* if doing multiple parallel upstreams, start a writer. with -ff,
+	 * queries take turns at it, spooling their input until their turn;
+	 * but if sorting, each query must have a writer (and sort) of its own.
+	 */
+	bool one_writer = multiple &&
+		(batching != batch_verbose || sorting == no_sort);
+	if (one_writer) {
 		writer = writer_init(qp.output_limit, ps_stdout, false);
+		writer->spooling = batching == batch_verbose;
+	}
 
 	while (getline(&command, &n, f) > 0) {
 		const char *msg;
@@ -1081,6 +1291,10 @@ do_batch(FILE *f, qparam_ct qpp) {
 			continue;
 		}
 
+		/* with -Q or -x, reload the server's rate limits now and then. */
+		if (io_limits_due())
+			psys->limits();
+
 		/* if not parallelizing, start a writer here instead. */
 		if (!one_writer)
 			writer = writer_init(qp.output_limit,
@@ -1095,10 +1309,11 @@ do_batch(FILE *f, qparam_ct qpp) {
 			 */
 			query_t query = query_launcher(&qd, &qp, writer);
 
-			/* if merging, drain some jobs; else, drain all jobs.
+			/* if merging, drain until there's room for another
+			 * fetch; else, drain all jobs.
 			 */
 			if (one_writer)
-				io_engine(MAX_FETCHES);
+				io_engine(io_fetch_limit() - 1);
 			else
 				io_engine(0);
 
@@ -1311,74 +1526,63 @@ batch_parse(char *line, qdesc_t qdp) {
 
 /* makepath -- make a RESTful URI that describes these query parameters.
  *
- * Returns a string that must be free()d.
+ * Returns a string allocated from the given arena.
  */
 static char *
-makepath(qdesc_ct qdp) {
+makepath(arena_t arena, qdesc_ct qdp) {
 	/* recondition various options for HTML use. */
-	char *thing = escape(qdp->thing);
-	char *rrtype = escape(qdp->rrtype);
-	char *bailiwick = escape(qdp->bailiwick);
-	char *pfxlen = escape(qdp->pfxlen);
+	char *thing = escape(arena, qdp->thing);
+	char *rrtype = escape(arena, qdp->rrtype);
+	char *bailiwick = escape(arena, qdp->bailiwick);
+	char *pfxlen = escape(arena, qdp->pfxlen);
 
 	char *path = NULL;
 	switch (qdp->mode) {
-		int x;
 	case rrset_mode:
 		if (rrtype != NULL && bailiwick != NULL)
-			x = asprintf(&path, "rrset/name/%s/%s/%s",
-				     thing, rrtype, bailiwick);
+			path = arena_sprintf(arena, "rrset/name/%s/%s/%s",
+					     thing, rrtype, bailiwick);
 		else if (rrtype != NULL)
-			x = asprintf(&path, "rrset/name/%s/%s",
-				     thing, rrtype);
+			path = arena_sprintf(arena, "rrset/name/%s/%s",
+					     thing, rrtype);
 		else if (bailiwick != NULL)
-			x = asprintf(&path, "rrset/name/%s/ANY/%s",
-				     thing, bailiwick);
+			path = arena_sprintf(arena, "rrset/name/%s/ANY/%s",
+					     thing, bailiwick);
 		else
-			x = asprintf(&path, "rrset/name/%s",
-				     thing);
-		if (x < 0)
-			my_panic(true, "asprintf");
+			path = arena_sprintf(arena, "rrset/name/%s",
+					     thing);
 		break;
 	case name_mode:
 		if (rrtype != NULL)
-			x = asprintf(&path, "rdata/name/%s/%s",
-				     thing, rrtype);
+			path = arena_sprintf(arena, "rdata/name/%s/%s",
+					     thing, rrtype);
 		else
-			x = asprintf(&path, "rdata/name/%s",
-				     thing);
-		if (x < 0)
-			my_panic(true, "asprintf");
+			path = arena_sprintf(arena, "rdata/name/%s",
+					     thing);
 		break;
 	case ip_mode:
 		if (pfxlen != NULL)
-			x = asprintf(&path, "rdata/ip/%s,%s",
-				     thing, pfxlen);
+			path = arena_sprintf(arena, "rdata/ip/%s,%s",
+					     thing, pfxlen);
 		else
-			x = asprintf(&path, "rdata/ip/%s",
-				     thing);
-		if (x < 0)
-			my_panic(true, "asprintf");
+			path = arena_sprintf(arena, "rdata/ip/%s",
+					     thing);
 		break;
 	case raw_rrset_mode:
 		if (rrtype != NULL)
-			x = asprintf(&path, "rrset/raw/%s/%s",
-				     thing, rrtype);
+			path = arena_sprintf(arena, "rrset/raw/%s/%s",
+					     thing, rrtype);
 		else
-			x = asprintf(&path, "rrset/raw/%s",
-				     thing);
-		if (x < 0)
-			my_panic(true, "asprintf");
+			path = arena_sprintf(arena, "rrset/raw/%s",
+					     thing);
 		break;
 	case raw_name_mode:
 		if (rrtype != NULL)
-			x = asprintf(&path, "rdata/raw/%s/%s",
-				     thing, rrtype);
+			path = arena_sprintf(arena, "rdata/raw/%s/%s",
+					     thing, rrtype);
 		else
-			x = asprintf(&path, "rdata/raw/%s",
-				     thing);
-		if (x < 0)
-			my_panic(true, "asprintf");
+			path = arena_sprintf(arena, "rdata/raw/%s",
+					     thing);
 		break;
 	case no_mode:
 		/*FALLTHROUGH*/
@@ -1386,11 +1590,6 @@ makepath(qdesc_ct qdp) {
 		abort();
 	}
 
-	DESTROY(thing);
-	DESTROY(rrtype);
-	DESTROY(bailiwick);
-	DESTROY(pfxlen);
-
 	return path;
 }
 
@@ -1406,10 +1605,12 @@ query_launcher(qdesc_ct qdp, qparam_ct qpp, writer_t writer) {
 
 	/* ready player one. */
 	CREATE(query, sizeof(struct query));
-	query->descr = makepath(qdp);
+	query->descr = makepath(writer->arena, qdp);
 	query->mode = qdp->mode;
 	query->qp = *qpp;
 	qpp = NULL;
+	query->writer = writer;
+	writer = NULL;
 
 	/* define the fence. */
 	if (query->qp.after != 0) {
@@ -1431,19 +1632,18 @@ query_launcher(qdesc_ct qdp, qparam_ct qpp, writer_t writer) {
 		}
 	}
 
-	/* branch on rrtype; launch (or queue) nec'y fetches. */
+	/* branch on rrtype; find the path of each nec'y fetch. */
+	char *paths[MAX_RRTYPES];
+	int npaths = 0, nfetches = 0;
 	if (qdp->rrtype == NULL) {
 		/* no rrtype string given, let makepath set it to "any". */
-		char *path = makepath(qdp);
-		launch_fetch(query, path, &fence);
-		DESTROY(path);
+		paths[npaths++] = makepath(query->writer->arena, qdp);
 	} else if ((msg = rrtype_correctness(qdp->rrtype)) != NULL) {
 		my_logf("rrtype incorrect: %s", msg);
 		DESTROY(query);
 		return NULL;
 	} else {
 		/* rrtype string was given, parse comma separated list. */
-		int nfetches = 0;
 		struct tokstr *ts = tokstr_string(qdp->rrtype);
 		for (char *rrtype;
 		     (rrtype = tokstr_next(ts, ",")) != NULL;
@@ -1456,19 +1656,39 @@ query_launcher(qdesc_ct qdp, qparam_ct qpp, writer_t writer) {
 				.bailiwick = qdp->bailiwick,
 				.pfxlen = qdp->pfxlen
 			};
-			char *path = makepath(&qd);
-			launch_fetch(query, path, &fence);
-			nfetches++;
-			DESTROY(path);
+			assert(npaths < MAX_RRTYPES);
+			paths[npaths++] = makepath(query->writer->arena,
+						   &qd);
 		}
 		tokstr_last(&ts);
-		if (nfetches > 1)
-			query->multitype = true;
 	}
 
+	/* with -W, summarize every path before launching anything, since
+	 * a fetch that finished while its query was still being launched
+	 * would end the query early.
+	 */
+	struct pdns_tuple spans[MAX_RRTYPES];
+	bool windowed = time_windows != 0 &&
+		query->qp.query_limit == -1 && query->qp.offset == 0;
+	for (int i = 0; i < npaths; i++)
+		if (!windowed || !summarize_span(query, paths[i], &fence,
+						 &spans[i]))
+			memset(&spans[i], 0, sizeof spans[i]);
+
+	/* launch (or queue) the fetches. */
+	for (int i = 0; i < npaths; i++) {
+		if (spans[i].num_results > 0) {
+			nfetches += launch_windows(query, paths[i], &fence,
+						   &spans[i]);
+		} else {
+			(void) launch_fetch(query, paths[i], &fence);
+			nfetches++;
+		}
+	}
+	if (nfetches > 1)
+		query->multitype = true;
+
 	/* finish query initialization, link it up, and return it. */
-	query->writer = writer;
-	writer = NULL;
 	query->next = query->writer->queries;
 	query->writer->queries = query;
 	return query;
@@ -1478,7 +1698,7 @@ query_launcher(qdesc_ct qdp, qparam_ct qpp, writer_t writer) {
  */
 static const char *
 rrtype_correctness(const char *input) {
-	char **rrtypeset = calloc(MAX_FETCHES, sizeof(char *));
+	char **rrtypeset = calloc(MAX_RRTYPES, sizeof(char *));
 	const char *ret = NULL;
 	int nrrtypeset = 0;
 	bool some = false, any = false,
@@ -1491,7 +1711,7 @@ rrtype_correctness(const char *input) {
 		for (char *p = rrtype; *p != '\0'; p++)
 			if (isupper((int)*p))
 				*p = (char) tolower((int)*p);
-		if (nrrtypeset == MAX_FETCHES) {
+		if (nrrtypeset == MAX_RRTYPES) {
 			ret = "too many rrtypes specified";
 			goto done;
 		}
@@ -1538,16 +1758,158 @@ rrtype_correctness(const char *input) {
 }
 
 /* launch_fetch -- actually launch a query job, given a path and time fences.
+ *
+ * with -x, this is the first page, and the I/O engine fetches the rest.
  */
-static void
+static fetch_t
 launch_fetch(query_t query, const char *path, pdns_fence_ct fp) {
-	char *url = psys->url(path, NULL, &query->qp, fp, false);
+	struct qparam qp = query->qp;
+	long page_size = io_page_size();
+
+	if (page_size > 0 &&
+	    (qp.query_limit <= 0 || qp.query_limit > page_size))
+		qp.query_limit = page_size;
+	char *url = psys->url(path, NULL, &qp, fp, false);
 	if (url == NULL)
 		my_exit(1);
 
 	DEBUG(1, true, "url [%s]\n", url);
 
-	create_fetch(query, url);
+	fetch_t fetch = create_fetch(query, url);
+	fetch->path = strdup(path);
+	fetch->fence = *fp;
+	fetch->offset = qp.offset;
+	fetch->limit = qp.query_limit;
+	return fetch;
+}
+
+/* summarize_span -- ask the server to summarize what a lookup of this path
+ * within this fence would return, to learn its time span and size. on
+ * success, the span's times and num_results are left in *spanp.
+ */
+static bool
+summarize_span(query_ct query, const char *path, pdns_fence_ct fp,
+	       struct pdns_tuple *spanp)
+{
+	verb_ct verb = pverb;
+	query_t probe = NULL;
+	writer_t writer;
+	bool ok = false;
+	char *url;
+
+	/* the summarize fetch is a meta query, but with a verb in its URL. */
+	pverb = find_verb("summarize");
+	url = psys->url(path, NULL, &query->qp, fp, false);
+	pverb = verb;
+	if (url == NULL)
+		return false;
+	DEBUG(1, true, "span url [%s]\n", url);
+
+	writer = writer_init(qparam_empty.output_limit, NULL, true);
+	CREATE(probe, sizeof(struct query));
+	probe->writer = writer;
+	probe->descr = arena_strdup(writer->arena, path);
+	writer->queries = probe;
+	(void) create_fetch(probe, url);
+	io_await(probe);
+
+	/* find the summary among the SAF lines gathered into ps_buf. */
+	for (char *line = writer->ps_buf, *nl;
+	     line != NULL && !ok &&
+		     (nl = memchr(line, '\n', writer->ps_len -
+				  (size_t)(line - writer->ps_buf))) != NULL;
+	     line = nl + 1)
+	{
+		struct pdns_tuple tup;
+
+		if (tuple_make(&tup, line, (size_t)(nl - line)) == NULL &&
+		    TUP_HAS(&tup, TUP_OBJ|TUP_NUM_RESULTS))
+		{
+			spanp->time_first = tup.time_first;
+			spanp->time_last = tup.time_last;
+			spanp->zone_first = tup.zone_first;
+			spanp->zone_last = tup.zone_last;
+			spanp->num_results = tup.num_results;
+			ok = true;
+		}
+		arena_reset(line_arena);
+	}
+	if (ok) {
+		DEBUG(1, true, "span(%s): %lu..%lu, %lld results\n",
+		      path, (unsigned long)spanp->time_first,
+		      (unsigned long)spanp->time_last,
+		      (long long)spanp->num_results);
+	} else {
+		DEBUG(1, true, "span(%s) not summarized\n", path);
+	}
+
+	/* the summary was consumed here, not by a ps_user. */
+	DESTROY(writer->ps_buf);
+	writer->ps_len = 0;
+	writer_fini(writer);
+	return ok;
+}
+
+/* launch_windows -- launch a lookup as several fetches over disjoint time
+ * windows, returning how many.
+ *
+ * the windows partition time_first, so every tuple belongs to just one of
+ * them and none need merging. in case the server's time_first_after and
+ * time_first_before are inclusive, each fetch asks for a second more on
+ * either side, and pdns_blob() drops anything outside its window.
+ */
+static int
+launch_windows(query_t query, const char *path, pdns_fence_ct fp,
+	       const struct pdns_tuple *spanp)
+{
+	u_long lo, hi;
+	long n;
+
+	/* time_first lies between the earliest first and the latest last. */
+	lo = spanp->time_first;
+	if (spanp->zone_first != 0 && (lo == 0 || spanp->zone_first < lo))
+		lo = spanp->zone_first;
+	hi = spanp->time_last > spanp->zone_last
+		? spanp->time_last : spanp->zone_last;
+	if (lo == 0 || hi < lo) {
+		(void) launch_fetch(query, path, fp);
+		return 1;
+	}
+
+	n = time_windows;
+	if (adaptive_windows) {
+		long want = (long)((spanp->num_results + WINDOW_RESULTS - 1) /
+				   WINDOW_RESULTS);
+		if (want < n)
+			n = want;
+	}
+	if ((u_long)n > hi - lo + 1)
+		n = (long)(hi - lo + 1);
+	if (n <= 1) {
+		(void) launch_fetch(query, path, fp);
+		return 1;
+	}
+	DEBUG(1, true, "%ld windows over %lu..%lu for %lld results\n",
+	      n, (unsigned long)lo, (unsigned long)hi,
+	      (long long)spanp->num_results);
+
+	for (long i = 0; i < n; i++) {
+		u_long wlo = lo + (hi - lo + 1) * (u_long)i / (u_long)n,
+			whi = lo + (hi - lo + 1) * (u_long)(i + 1) / (u_long)n;
+		struct pdns_fence wf = *fp;
+		fetch_t fetch;
+
+		/* the first and last windows are open-ended. */
+		if (i > 0 && wlo - 1 > wf.first_after)
+			wf.first_after = wlo - 1;
+		if (i < n - 1 &&
+		    (wf.first_before == 0 || whi + 1 < wf.first_before))
+			wf.first_before = whi + 1;
+		fetch = launch_fetch(query, path, &wf);
+		fetch->window_lo = i > 0 ? wlo : 0;
+		fetch->window_hi = i < n - 1 ? whi : 0;
+	}
+	return (int)n;
 }
 
 /* ruminate_json -- process a json file from the filesys rather than the API.
@@ -19,6 +19,7 @@
 
 #include <stdarg.h>
 #include "defs.h"
+#include "arena.h"
 #include "deduper.h"
 #include "sort.h"
 #include "time.h"
@@ -38,12 +39,13 @@ extern const struct verb verbs[];
 EXTERN	const char id_swclient[]	INIT("dnsdbq");
 EXTERN	const char id_version[]		INIT("2.6.8");
 EXTERN	const char *program_name	INIT(NULL);
-EXTERN	const char path_sort[]		INIT("/usr/bin/sort");
 EXTERN	const char json_header[]	INIT("Accept: application/json");
 EXTERN	const char jsonl_header[]	INIT("Accept: application/x-ndjson");
 EXTERN	const char env_time_fmt[]	INIT("DNSDBQ_TIME_FORMAT");
 EXTERN	const char env_config_file[]	INIT("DNSDBQ_CONFIG_FILE");
 EXTERN	const char env_timeout[]	INIT("DNSDBQ_TIMEOUT");
+EXTERN	const char env_max_fetches[]	INIT("DNSDBQ_MAX_FETCHES");
+EXTERN	const char env_asinfo_server[]	INIT("DNSDBQ_ASINFO_SERVER");
 EXTERN	const char status_noerror[]	INIT("NOERROR");
 EXTERN	const char status_error[]	INIT("ERROR");
 EXTERN	const char *asinfo_domain	INIT("asn.routeviews.org");
@@ -63,6 +65,7 @@ EXTERN	bool psys_specified		INIT(false);
 EXTERN	int transforms			INIT(0);
 EXTERN	long max_count			INIT(0L);
 EXTERN	sort_e sorting			INIT(no_sort);
+EXTERN	arena_t line_arena		INIT(NULL);
 EXTERN	batch_e batching		INIT(batch_none);
 EXTERN	present_e presentation		INIT(pres_none);
 EXTERN	char *presentation_name		INIT(NULL);
@@ -71,13 +74,25 @@ EXTERN	struct timeval startup_time	INIT({});
 EXTERN	int exit_code			INIT(0);
 EXTERN	long curl_ipresolve		INIT(CURL_IPRESOLVE_WHATEVER);
 EXTERN	long curl_timeout		INIT(0L);
+EXTERN	int max_fetches			INIT(DEFAULT_FETCHES);
+EXTERN	bool adaptive_fetches		INIT(false);
+EXTERN	int max_retries			INIT(0);
+EXTERN	bool pacing			INIT(false);
+EXTERN	bool paging			INIT(false);
+EXTERN	int time_windows		INIT(0);
+EXTERN	bool adaptive_windows		INIT(false);
 EXTERN	deduper_t minimal_deduper	INIT(NULL);
 
-/* deduplication table size. trades memory efficiency (an array of this many
- * pointers will be allocated under '-p minimal' conditions) against run time
- * efficiency (the string's hash will be modulo this size).
+/* initial deduplication table size, under '-p minimal' conditions. the
+ * table grows as needed, so this only saves a few early doublings.
  */
-EXTERN	const size_t minimal_modulus	INIT(10000);
+EXTERN	const size_t minimal_dedup_size	INIT(10000);
+
+/* if not zero, '-p minimal' deduplicates approximately, in this many
+ * megabytes, letting through a false duplicate at about this rate (-F).
+ */
+EXTERN	size_t minimal_filter_mb	INIT(0);
+EXTERN	double minimal_filter_rate	INIT(DEFAULT_FILTER_RATE);
 
 #undef INIT
 #undef EXTERN
@@ -0,0 +1,777 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* the grammar is RFC 8259's, with the same extra rules as jansson's
+ * decoder: strings must be valid UTF-8, may not contain \u0000, and may
+ * not contain unpaired surrogate escapes; integers must fit a long long.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jscan.h"
+
+/* how deeply values may nest, counting the outermost as 1; this is
+ * jansson's JSON_PARSER_MAX_DEPTH.
+ */
+#define	JSCAN_DEPTH 2048
+
+/* strings are found with a structural index of the text, built 64 octets
+ * at a time as two bitmasks: where the quotes are, and where anything
+ * needing a closer look is (a backslash, a control character, or a
+ * non-ASCII octet). a string with none of the latter before its closing
+ * quote is consumed by a bit scan or two; any other string is finished
+ * octet by octet. the masks are built with AVX2 or SSE2, whichever the CPU
+ * has; without either (or with -DJSCAN_SIMD=0), every string is scanned
+ * octet by octet.
+ */
+#if !defined(JSCAN_SIMD) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define	JSCAN_SIMD 1
+#endif
+
+#if JSCAN_SIMD
+#include <immintrin.h>
+
+#define	JSCAN_BLOCK 64
+
+typedef void (*jscan_block_t)(const char *, uint64_t *, uint64_t *);
+
+static void block_sse2(const char *, uint64_t *, uint64_t *);
+static void block_avx2(const char *, uint64_t *, uint64_t *);
+static const char *jscan_indexed(struct jscan *, const char *);
+
+static jscan_block_t jscan_block = NULL;
+static bool jscan_picked = false;
+#endif
+
+static bool jscan_fail(struct jscan *, const char *);
+static bool jscan_literal(struct jscan *, const char *, size_t);
+static bool integer_value(const char *, size_t, long long *);
+static bool real_overflow(const char *, size_t);
+static size_t utf8_len(const unsigned char *, const unsigned char *);
+static long hex4(const char *);
+
+static inline void
+jscan_ws(struct jscan *js) {
+	while (js->ptr < js->end &&
+	       (*js->ptr == ' ' || *js->ptr == '\n' ||
+		*js->ptr == '\r' || *js->ptr == '\t'))
+		js->ptr++;
+}
+
+/* jscan_init -- start scanning a counted JSON text.
+ */
+void
+jscan_init(struct jscan *js, const char *buf, size_t len) {
+	js->ptr = buf;
+	js->end = buf + len;
+	js->err = NULL;
+	js->first = true;
+	js->depth = 0;
+	js->base = buf;
+	js->blk = NULL;
+#if JSCAN_SIMD
+	if (!jscan_picked) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			jscan_block = block_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			jscan_block = block_sse2;
+		jscan_picked = true;
+	}
+#endif
+}
+
+/* jscan_fail -- remember the first error and stop scanning.
+ */
+static bool
+jscan_fail(struct jscan *js, const char *err) {
+	if (js->err == NULL)
+		js->err = err;
+	js->ptr = js->end;
+	return false;
+}
+
+/* jscan_peek -- say what kind of value comes next, without consuming it.
+ */
+jtype_e
+jscan_peek(struct jscan *js) {
+	if (js->err != NULL)
+		return jt_error;
+	jscan_ws(js);
+	if (js->ptr == js->end) {
+		jscan_fail(js, "unexpected end of JSON text");
+		return jt_error;
+	}
+	if (js->depth >= JSCAN_DEPTH) {
+		jscan_fail(js, "JSON nested too deeply");
+		return jt_error;
+	}
+	switch (*js->ptr) {
+	case '{':
+		return jt_object;
+	case '[':
+		return jt_array;
+	case '"':
+		return jt_string;
+	case '-': case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		return jt_number;
+	case 't':
+		return jt_true;
+	case 'f':
+		return jt_false;
+	case 'n':
+		return jt_null;
+	default:
+		jscan_fail(js, "invalid token in JSON text");
+		return jt_error;
+	}
+}
+
+/* jscan_object -- enter an object; its members follow via jscan_member().
+ */
+bool
+jscan_object(struct jscan *js) {
+	if (jscan_peek(js) != jt_object)
+		return jscan_fail(js, "expected a JSON object");
+	js->ptr++;
+	js->first = true;
+	js->depth++;
+	return true;
+}
+
+/* jscan_array -- enter an array; its elements follow via jscan_element().
+ */
+bool
+jscan_array(struct jscan *js) {
+	if (jscan_peek(js) != jt_array)
+		return jscan_fail(js, "expected a JSON array");
+	js->ptr++;
+	js->first = true;
+	js->depth++;
+	return true;
+}
+
+/* jscan_member -- scan the next member's key, leaving its value next.
+ *
+ * returns false at the end of the object (or on error, see js->err).
+ */
+bool
+jscan_member(struct jscan *js, struct jspan *key) {
+	if (js->err != NULL)
+		return false;
+	jscan_ws(js);
+	if (js->ptr < js->end && *js->ptr == '}') {
+		js->ptr++;
+		js->first = false;
+		js->depth--;
+		return false;
+	}
+	if (!js->first) {
+		if (js->ptr == js->end || *js->ptr != ',')
+			return jscan_fail(js, "expected ',' or '}'");
+		js->ptr++;
+		jscan_ws(js);
+	}
+	js->first = false;
+	if (js->ptr == js->end || *js->ptr != '"')
+		return jscan_fail(js, "expected an object key");
+	if (!jscan_string(js, key))
+		return false;
+	jscan_ws(js);
+	if (js->ptr == js->end || *js->ptr != ':')
+		return jscan_fail(js, "expected ':'");
+	js->ptr++;
+	return true;
+}
+
+/* jscan_element -- step to the next array element, leaving it next.
+ *
+ * returns false at the end of the array (or on error, see js->err).
+ */
+bool
+jscan_element(struct jscan *js) {
+	if (js->err != NULL)
+		return false;
+	jscan_ws(js);
+	if (js->ptr < js->end && *js->ptr == ']') {
+		js->ptr++;
+		js->first = false;
+		js->depth--;
+		return false;
+	}
+	if (!js->first) {
+		if (js->ptr == js->end || *js->ptr != ',')
+			return jscan_fail(js, "expected ',' or ']'");
+		js->ptr++;
+	}
+	js->first = false;
+	return true;
+}
+
+/* jscan_string -- scan a string, validating its escapes and encoding.
+ */
+bool
+jscan_string(struct jscan *js, struct jspan *span) {
+	const unsigned char *p, *end = (const unsigned char *)js->end;
+	bool escaped = false;
+
+	if (jscan_peek(js) != jt_string)
+		return jscan_fail(js, "expected a JSON string");
+	p = (const unsigned char *)js->ptr + 1;
+#if JSCAN_SIMD
+	if (jscan_block != NULL) {
+		const char *q = jscan_indexed(js, (const char *)p);
+
+		if (q < (const char *)end && *q == '"') {
+			p = (const unsigned char *)q;
+			goto done;
+		}
+		/* finish from the first octet that needs a closer look. */
+		p = (const unsigned char *)q;
+	}
+#endif
+	for (;;) {
+		/* the common case: a run of plain ASCII. */
+		while (p < end && *p >= 0x20 && *p < 0x80 &&
+		       *p != '"' && *p != '\\')
+			p++;
+		if (p == end)
+			return jscan_fail(js, "unterminated string");
+		if (*p == '"')
+			break;
+		if (*p == '\\') {
+			escaped = true;
+			if (end - p < 2)
+				return jscan_fail(js, "unterminated string");
+			switch (p[1]) {
+			case '"': case '\\': case '/': case 'b':
+			case 'f': case 'n': case 'r': case 't':
+				p += 2;
+				break;
+			case 'u': {
+				long u, v;
+
+				if (end - p < 6 ||
+				    (u = hex4((const char *)p + 2)) < 0)
+					return jscan_fail(js,
+						"invalid \\u escape");
+				if (u == 0)
+					return jscan_fail(js,
+						"\\u0000 is not allowed");
+				if (u >= 0xDC00 && u <= 0xDFFF)
+					return jscan_fail(js,
+						"unpaired surrogate escape");
+				p += 6;
+				if (u >= 0xD800 && u <= 0xDBFF) {
+					if (end - p < 6 || p[0] != '\\' ||
+					    p[1] != 'u' ||
+					    (v = hex4((const char *)p + 2))
+					    < 0xDC00 || v > 0xDFFF)
+						return jscan_fail(js,
+						  "unpaired surrogate escape");
+					p += 6;
+				}
+				break;
+			    }
+			default:
+				return jscan_fail(js, "invalid escape");
+			}
+		} else if (*p < 0x20) {
+			return jscan_fail(js, "control character in string");
+		} else {
+			size_t n = utf8_len(p, end);
+
+			if (n == 0)
+				return jscan_fail(js, "invalid UTF-8 in string");
+			p += n;
+		}
+	}
+#if JSCAN_SIMD
+ done:
+#endif
+	span->ptr = js->ptr + 1;
+	span->len = (size_t)((const char *)p - span->ptr);
+	span->escaped = escaped;
+	js->ptr = (const char *)p + 1;
+	return true;
+}
+
+#if JSCAN_SIMD
+/* jscan_indexed -- find a string's closing quote by the structural index.
+ *
+ * returns the closing quote if the string is plain ASCII with no escapes,
+ * else where the octet-by-octet scan should take over, which is js->end
+ * if the string runs off the end of the buffer.
+ */
+static const char *
+jscan_indexed(struct jscan *js, const char *p) {
+	for (;;) {
+		const char *blk = js->base +
+			((size_t)(p - js->base) & ~(size_t)(JSCAN_BLOCK - 1));
+		unsigned off = (unsigned)(p - blk);
+		uint64_t quotes, attn;
+
+		if (blk >= js->end)
+			return js->end;
+		if (blk != js->blk) {
+			if (js->end - blk >= JSCAN_BLOCK) {
+				(*jscan_block)(blk, &js->quotes, &js->attn);
+			} else {
+				/* pad a short last block with blanks. */
+				char pad[JSCAN_BLOCK];
+
+				memset(pad, ' ', sizeof pad);
+				memcpy(pad, blk, (size_t)(js->end - blk));
+				(*jscan_block)(pad, &js->quotes, &js->attn);
+			}
+			js->blk = blk;
+		}
+		quotes = js->quotes >> off;
+		attn = js->attn >> off;
+		if (quotes != 0) {
+			/* anything needing a look before the quote? */
+			uint64_t before = (quotes & (~quotes + 1)) - 1;
+
+			if ((attn & before) != 0)
+				return p + __builtin_ctzll(attn);
+			return p + __builtin_ctzll(quotes);
+		}
+		if (attn != 0)
+			return p + __builtin_ctzll(attn);
+		p = blk + JSCAN_BLOCK;
+	}
+}
+
+/* block_sse2 -- index one block, 16 octets at a time.
+ *
+ * a signed compare against 0x20 catches both the control characters and
+ * the non-ASCII octets, which are negative.
+ */
+__attribute__((target("sse2")))
+static void
+block_sse2(const char *p, uint64_t *quotesp, uint64_t *attnp) {
+	const __m128i quote = _mm_set1_epi8('"'),
+		bslash = _mm_set1_epi8('\\'),
+		space = _mm_set1_epi8(0x20);
+	uint64_t quotes = 0, attn = 0;
+
+	for (int i = 0; i < JSCAN_BLOCK; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)
+					    (const void *)(p + i));
+		uint32_t q = (uint32_t)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, quote));
+		uint32_t a = (uint32_t)_mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(v, bslash),
+				     _mm_cmplt_epi8(v, space)));
+
+		quotes |= (uint64_t)q << i;
+		attn |= (uint64_t)a << i;
+	}
+	*quotesp = quotes;
+	*attnp = attn;
+}
+
+/* block_avx2 -- index one block, 32 octets at a time.
+ */
+__attribute__((target("avx2")))
+static void
+block_avx2(const char *p, uint64_t *quotesp, uint64_t *attnp) {
+	const __m256i quote = _mm256_set1_epi8('"'),
+		bslash = _mm256_set1_epi8('\\'),
+		space = _mm256_set1_epi8(0x20);
+	uint64_t quotes = 0, attn = 0;
+
+	for (int i = 0; i < JSCAN_BLOCK; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)
+					       (const void *)(p + i));
+		uint32_t q = (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, quote));
+		uint32_t a = (uint32_t)_mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, bslash),
+					_mm256_cmpgt_epi8(space, v)));
+
+		quotes |= (uint64_t)q << i;
+		attn |= (uint64_t)a << i;
+	}
+	*quotesp = quotes;
+	*attnp = attn;
+}
+#endif
+
+/* jscan_number -- scan a number; say whether it's integral (no . or e).
+ */
+bool
+jscan_number(struct jscan *js, struct jspan *span, bool *integral) {
+	const char *p;
+
+	if (jscan_peek(js) != jt_number)
+		return jscan_fail(js, "expected a JSON number");
+	p = js->ptr;
+	*integral = true;
+	if (*p == '-')
+		p++;
+	if (p < js->end && *p == '0') {
+		p++;
+	} else if (p < js->end && *p >= '1' && *p <= '9') {
+		while (p < js->end && *p >= '0' && *p <= '9')
+			p++;
+	} else {
+		return jscan_fail(js, "invalid number");
+	}
+	if (p < js->end && *p == '.') {
+		*integral = false;
+		p++;
+		if (p == js->end || *p < '0' || *p > '9')
+			return jscan_fail(js, "invalid number");
+		while (p < js->end && *p >= '0' && *p <= '9')
+			p++;
+	}
+	if (p < js->end && (*p == 'e' || *p == 'E')) {
+		*integral = false;
+		p++;
+		if (p < js->end && (*p == '+' || *p == '-'))
+			p++;
+		if (p == js->end || *p < '0' || *p > '9')
+			return jscan_fail(js, "invalid number");
+		while (p < js->end && *p >= '0' && *p <= '9')
+			p++;
+	}
+	span->ptr = js->ptr;
+	span->len = (size_t)(p - js->ptr);
+	span->escaped = false;
+	if (*integral) {
+		long long val;
+
+		if (!integer_value(span->ptr, span->len, &val))
+			return jscan_fail(js, "integer out of range");
+	} else if (real_overflow(span->ptr, span->len)) {
+		return jscan_fail(js, "real number overflow");
+	}
+	js->ptr = p;
+	return true;
+}
+
+/* real_overflow -- would this real number be out of a double's range?
+ */
+static bool
+real_overflow(const char *ptr, size_t len) {
+	char buf[64], *str = buf;
+	bool ret;
+	double val;
+
+	if (len >= sizeof buf && (str = malloc(len + 1)) == NULL)
+		return true;
+	memcpy(str, ptr, len);
+	str[len] = '\0';
+	errno = 0;
+	val = strtod(str, NULL);
+	ret = errno == ERANGE && (val == HUGE_VAL || val == -HUGE_VAL);
+	if (str != buf)
+		free(str);
+	return ret;
+}
+
+/* jscan_integer -- scan an integer.
+ *
+ * returns false, with nothing consumed and no error recorded, if the next
+ * value is something other than an integer, so the caller can complain.
+ */
+bool
+jscan_integer(struct jscan *js, long long *valp) {
+	const char *save = js->ptr;
+	struct jspan span;
+	bool integral;
+
+	if (jscan_peek(js) != jt_number)
+		return false;
+	if (!jscan_number(js, &span, &integral))
+		return false;
+	if (!integral) {
+		js->ptr = save;
+		return false;
+	}
+	(void) integer_value(span.ptr, span.len, valp);
+	return true;
+}
+
+/* integer_value -- convert a scanned integer; false if out of range.
+ */
+static bool
+integer_value(const char *ptr, size_t len, long long *valp) {
+	unsigned long long val = 0, max = LLONG_MAX;
+	size_t i = 0;
+
+	if (ptr[0] == '-') {
+		max++;
+		i++;
+	}
+	for (; i < len; i++) {
+		unsigned digit = (unsigned)(ptr[i] - '0');
+
+		if (val > (max - digit) / 10)
+			return false;
+		val = val * 10 + digit;
+	}
+	if (ptr[0] == '-')
+		*valp = val == max ? LLONG_MIN : -(long long)val;
+	else
+		*valp = (long long)val;
+	return true;
+}
+
+/* jscan_literal -- scan one of the bare words, true/false/null.
+ */
+static bool
+jscan_literal(struct jscan *js, const char *word, size_t len) {
+	if ((size_t)(js->end - js->ptr) < len ||
+	    memcmp(js->ptr, word, len) != 0)
+		return jscan_fail(js, "invalid token in JSON text");
+	js->ptr += len;
+	return true;
+}
+
+/* jscan_skip -- scan past one value of any kind, validating all of it.
+ *
+ * the span, if wanted, covers the whole value including any delimiters.
+ */
+bool
+jscan_skip(struct jscan *js, struct jspan *span) {
+	/* one bit per level opened here: 1 if an object. */
+	uint64_t objects[JSCAN_DEPTH / 64];
+	unsigned depth = 0;
+	const char *start;
+	struct jspan s;
+	bool integral;
+
+	if (js->err != NULL)
+		return false;
+	jscan_ws(js);
+	start = js->ptr;
+	for (;;) {
+		bool more;
+
+		switch (jscan_peek(js)) {
+		case jt_object:
+		case jt_array:
+			/* jscan_peek() keeps js->depth, and so this, in bounds. */
+			if (*js->ptr == '{')
+				objects[depth / 64] |= 1ULL << depth % 64;
+			else
+				objects[depth / 64] &= ~(1ULL << depth % 64);
+			depth++;
+			js->depth++;
+			js->ptr++;
+			js->first = true;
+			break;
+		case jt_string:
+			(void) jscan_string(js, &s);
+			break;
+		case jt_number:
+			(void) jscan_number(js, &s, &integral);
+			break;
+		case jt_true:
+			(void) jscan_literal(js, "true", 4);
+			break;
+		case jt_false:
+			(void) jscan_literal(js, "false", 5);
+			break;
+		case jt_null:
+			(void) jscan_literal(js, "null", 4);
+			break;
+		case jt_error:
+			/* FALLTHROUGH */
+		default:
+			return false;
+		}
+		/* step to the next value, closing any levels that end. */
+		more = false;
+		while (depth > 0 && js->err == NULL) {
+			unsigned top = depth - 1;
+
+			if ((objects[top / 64] >> top % 64 & 1) != 0)
+				more = jscan_member(js, &s);
+			else
+				more = jscan_element(js);
+			if (more)
+				break;
+			depth--;
+		}
+		if (!more)
+			break;
+	}
+	if (js->err != NULL)
+		return false;
+	if (span != NULL) {
+		span->ptr = start;
+		span->len = (size_t)(js->ptr - start);
+		span->escaped = false;
+	}
+	return true;
+}
+
+/* jscan_end -- the text must hold nothing more than trailing whitespace.
+ */
+bool
+jscan_end(struct jscan *js) {
+	if (js->err != NULL)
+		return false;
+	jscan_ws(js);
+	if (js->ptr != js->end)
+		return jscan_fail(js, "end of JSON text expected");
+	return true;
+}
+
+/* jspan_unescape -- copy a scanned string out as a C string.
+ *
+ * the output can be no longer than the span, plus a NUL. returns a pointer
+ * just past that NUL, which is where another string could be put.
+ */
+char *
+jspan_unescape(char *dst, struct jspan span) {
+	const char *p = span.ptr, *end = span.ptr + span.len;
+
+	if (!span.escaped) {
+		memcpy(dst, p, span.len);
+		dst[span.len] = '\0';
+		return dst + span.len + 1;
+	}
+	while (p < end) {
+		const char *bs = memchr(p, '\\', (size_t)(end - p));
+		long u;
+
+		if (bs == NULL)
+			bs = end;
+		memcpy(dst, p, (size_t)(bs - p));
+		dst += bs - p;
+		if (bs == end)
+			break;
+		p = bs + 2;
+		switch (bs[1]) {
+		case 'b': *dst++ = '\b'; break;
+		case 'f': *dst++ = '\f'; break;
+		case 'n': *dst++ = '\n'; break;
+		case 'r': *dst++ = '\r'; break;
+		case 't': *dst++ = '\t'; break;
+		case 'u':
+			/* jscan_string() checked all this, so just decode. */
+			u = hex4(p);
+			p += 4;
+			if (u >= 0xD800 && u <= 0xDBFF) {
+				u = 0x10000 + ((u - 0xD800) << 10) +
+					(hex4(p + 2) - 0xDC00);
+				p += 6;
+			}
+			if (u < 0x80) {
+				*dst++ = (char)u;
+			} else if (u < 0x800) {
+				*dst++ = (char)(0xC0 | (u >> 6));
+				*dst++ = (char)(0x80 | (u & 0x3F));
+			} else if (u < 0x10000) {
+				*dst++ = (char)(0xE0 | (u >> 12));
+				*dst++ = (char)(0x80 | ((u >> 6) & 0x3F));
+				*dst++ = (char)(0x80 | (u & 0x3F));
+			} else {
+				*dst++ = (char)(0xF0 | (u >> 18));
+				*dst++ = (char)(0x80 | ((u >> 12) & 0x3F));
+				*dst++ = (char)(0x80 | ((u >> 6) & 0x3F));
+				*dst++ = (char)(0x80 | (u & 0x3F));
+			}
+			break;
+		default:
+			/* '"', '\\', and '/' stand for themselves. */
+			*dst++ = bs[1];
+			break;
+		}
+	}
+	*dst++ = '\0';
+	return dst;
+}
+
+/* jspan_eq -- does a scanned string equal a C string?
+ */
+bool
+jspan_eq(struct jspan span, const char *str) {
+	char buf[64];
+
+	if (!span.escaped)
+		return strncmp(span.ptr, str, span.len) == 0 &&
+			str[span.len] == '\0';
+	/* a key spelled with escapes is rare, and never long. */
+	if (span.len >= sizeof buf)
+		return false;
+	(void) jspan_unescape(buf, span);
+	return strcmp(buf, str) == 0;
+}
+
+/* utf8_len -- length of the valid UTF-8 sequence at p, or 0 if invalid.
+ */
+static size_t
+utf8_len(const unsigned char *p, const unsigned char *end) {
+	unsigned long cp;
+	size_t n;
+
+	if (*p < 0xC2)
+		return 0;	/* stray continuation, or overlong */
+	else if (*p < 0xE0)
+		n = 2, cp = *p & 0x1Fu;
+	else if (*p < 0xF0)
+		n = 3, cp = *p & 0x0Fu;
+	else if (*p < 0xF5)
+		n = 4, cp = *p & 0x07u;
+	else
+		return 0;
+	if ((size_t)(end - p) < n)
+		return 0;
+	for (size_t i = 1; i < n; i++) {
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (p[i] & 0x3Fu);
+	}
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+		return 0;
+	return n;
+}
+
+/* hex4 -- value of four hex digits, or -1.
+ */
+static long
+hex4(const char *p) {
+	long val = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int ch = p[i];
+
+		val <<= 4;
+		if (ch >= '0' && ch <= '9')
+			val |= ch - '0';
+		else if (ch >= 'a' && ch <= 'f')
+			val |= ch - 'a' + 10;
+		else if (ch >= 'A' && ch <= 'F')
+			val |= ch - 'A' + 10;
+		else
+			return -1;
+	}
+	return val;
+}
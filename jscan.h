@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __JSCAN_H_INCLUDED
+#define __JSCAN_H_INCLUDED 1
+
+#include <stdint.h>
+
+/* jscan is a pull scanner for one JSON text held in a counted buffer.
+ * the caller walks the structure it cares about and skips the rest;
+ * nothing is allocated and nothing is copied. strings and numbers come
+ * back as spans of the input buffer, which must outlive them. everything
+ * scanned or skipped is validated, so a text that jscan accepts is one
+ * that json_loadb() would also accept. that includes its limit on nesting:
+ * no value may be inside more than 2047 objects and arrays.
+ *
+ *	struct jscan js;
+ *	struct jspan key;
+ *
+ *	jscan_init(&js, buf, len);
+ *	if (jscan_object(&js))
+ *		while (jscan_member(&js, &key))
+ *			if (jspan_eq(key, "name")) ... else jscan_skip(&js, NULL);
+ *	if (!jscan_end(&js))
+ *		complain(js.err);
+ *
+ * once anything fails, every later call returns false and js.err says why.
+ */
+
+typedef enum {
+	jt_error = 0, jt_object, jt_array, jt_string, jt_number,
+	jt_true, jt_false, jt_null
+} jtype_e;
+
+/* a string's span is its contents, without the quotes; jspan_unescape()
+ * turns it into a C string. other spans cover the whole value.
+ */
+struct jspan {
+	const char	*ptr;
+	size_t		len;
+	bool		escaped;	/* string contains backslash escapes */
+};
+
+struct jscan {
+	const char	*ptr, *end;
+	const char	*err;		/* static message, once anything fails */
+	bool		first;		/* no member/element yet at this level */
+	unsigned	depth;		/* objects and arrays open */
+	/* structural index of the 64-octet block at .blk, see jscan.c. */
+	const char	*base, *blk;
+	uint64_t	quotes, attn;
+};
+
+void jscan_init(struct jscan *, const char *, size_t);
+jtype_e jscan_peek(struct jscan *);
+bool jscan_object(struct jscan *);
+bool jscan_array(struct jscan *);
+bool jscan_member(struct jscan *, struct jspan *);
+bool jscan_element(struct jscan *);
+bool jscan_string(struct jscan *, struct jspan *);
+bool jscan_number(struct jscan *, struct jspan *, bool *);
+bool jscan_integer(struct jscan *, long long *);
+bool jscan_skip(struct jscan *, struct jspan *);
+bool jscan_end(struct jscan *);
+char *jspan_unescape(char *, struct jspan);
+bool jspan_eq(struct jspan, const char *);
+
+#endif /*__JSCAN_H_INCLUDED*/
@@ -18,31 +18,127 @@
 #define _BSD_SOURCE
 #define _DEFAULT_SOURCE
 
-#include <sys/wait.h>
-
 #include <assert.h>
 #include <errno.h>
-#include <signal.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "defs.h"
 #include "netio.h"
 #include "pdns.h"
 #include "globals.h"
+#include "spool.h"
 #include "time.h"
 
-static void io_drain(void);
+static void io_drain(int *);
+static void fetch_start(fetch_t);
+static void fetch_stop(fetch_t);
+static void fetch_hold(fetch_t);
+static int fetch_room(void);
+static void io_unhold(void);
 static void fetch_reap(fetch_t);
+static bool fetch_retry(fetch_t, CURLcode);
+static bool fetch_retryable(fetch_ct);
+static bool retry_rcode(long);
+static bool retry_result(CURLcode);
+static void fetch_launch(fetch_t);
+static void fetch_delay(fetch_t, long long);
+static long long pace_take(void);
+static void io_delayed(int *);
+static CURL *easy_get(void);
+static void easy_put(CURL *);
 static void fetch_done(fetch_t);
 static void fetch_unlink(fetch_t);
 static void last_fetch(fetch_t);
+static void fetch_complete(fetch_t, CURLcode);
+static void fetch_defer(fetch_t, CURLcode);
+static void page_ahead(fetch_t);
+static fetch_t page_make(fetch_ct);
+static void page_drop(fetch_t);
+static void page_promote(fetch_t);
+static void writer_grant(writer_t, query_t);
+static void writer_wait(writer_t, query_t);
+static void writer_turn(writer_t);
+static void fetch_replay(fetch_t);
+static void writer_release(writer_t, size_t);
+static bool io_wait(int *);
+static void io_adapt(fetch_t, CURLcode);
+static void io_stats(fetch_t);
+static void io_fds_grow(void);
+static int io_socket(CURL *, curl_socket_t, int, void *, void *);
+static int io_timer(CURLM *, long, void *);
+static long long io_now(void);
+
+/* initial size of a fetch's input buffer, which grows as needed. */
+#define	FETCH_BUF_MIN 16384
+
+/* retry backoff: the first retry waits about RETRY_BASE_MS, and each
+ * subsequent one waits twice as long, up to RETRY_MAX_MS, with jitter.
+ */
+#define	RETRY_BASE_MS 1000
+#define	RETRY_MAX_MS 60000
+
+/* largest pacing bucket we keep; bigger bursts are scaled down to this. */
+#define	PACE_RING_MAX 4096
+/* how much longer than the server's burst window our pacing window is. */
+#define	PACE_SLACK_PCT 5
+
+/* longest we will sleep in poll(2) even if libcurl has no timer for us. */
+#define	IO_MAX_WAIT 1000
+
+/* adaptive concurrency treats the API as congested when the smoothed time
+ * to first byte exceeds this multiple of the best recently seen, plus slack.
+ */
+#define	ADAPT_LATENCY_FACTOR 2
+#define	ADAPT_LATENCY_SLACK 20
 
 static writer_t writers = NULL;
 static CURLM *multi = NULL;
+static CURLSH *share = NULL;
 static bool curl_cleanup_needed = false;
-static query_t paused[MAX_FETCHES];
-static int npaused = 0;
+/* sockets libcurl wants watched, and a scratch copy for poll(2) results. */
+static struct pollfd *io_fds = NULL, *io_ready = NULL;
+static nfds_t io_nfds = 0, io_maxfds = 0;
+/* when libcurl's timer expires (in io_now() terms), or -1 if there is none. */
+static long long io_deadline = -1;
+/* adaptive concurrency state; see io_adapt(). latencies are milliseconds. */
+static int fetch_window = 0, fetch_credit = 0, fetch_cooldown = 0;
+static long long latency_floor = -1, latency_avg = -1;
+/* whether fetches have been started or abandoned since libcurl last
+ * counted them.
+ */
+static bool fetches_changed = false;
+/* fetches whose transfers are done but which await their query's turn. */
+static int ndeferred = 0;
+/* fetches waiting to start (for a retry, or for pacing), and how many. */
+static fetch_t delayed = NULL;
+static int ndelayed = 0;
+/* fetches held for a free slot under io_fetch_limit(), and how many; and
+ * how many fetches libcurl has.
+ */
+static fetch_t on_hold = NULL;
+static int nheld = 0, nrunning = 0;
+/* token bucket pacing fetch starts; see io_pace(). pace_ring holds when
+ * each token was last spent, oldest at pace_next. limits_refreshed is when
+ * the server's rate limits were last (re)loaded, or -1.
+ */
+static long long *pace_ring = NULL, pace_window = 0, limits_refreshed = -1;
+static long pace_size = 0, pace_next = 0;
+/* -x paging: how many results a page asks for, and the largest offset the
+ * server allows (0 if unlimited); see io_paging(). no paging if page_size
+ * is zero.
+ */
+static long page_size = 0, page_offset_max = 0;
+/* idle easy handles, configured for everything except the fetch itself,
+ * and the request headers they all share.
+ */
+static CURL **easy_pool = NULL;
+static int neasy_pool = 0;
+static struct curl_slist *easy_hdrs = NULL;
+/* connection statistics, reported by unmake_curl() under -d. */
+static long stat_fetches = 0, stat_connects = 0, stat_http2 = 0;
 
 const char saf_begin[] = "begin";
 const char saf_ongoing[] = "ongoing";
@@ -60,21 +156,71 @@ void
 make_curl(void) {
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 	curl_cleanup_needed = true;
+	/* for retry jitter; needn't be unpredictable, just uncorrelated. */
+	srandom((unsigned)getpid() ^ (unsigned)io_now());
 	multi = curl_multi_init();
 	if (multi == NULL) {
 		my_logf("curl_multi_init() failed");
 		my_exit(1);
 	}
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, io_socket);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, io_timer);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,43,0)
+	/* all our fetches go to one server, so let them share a connection
+	 * if it speaks HTTP/2.
+	 */
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+
+	/* share DNS answers, TLS sessions, and open connections among all
+	 * easy handles, including any made outside the multi handle.
+	 */
+	share = curl_share_init();
+	if (share == NULL) {
+		my_logf("curl_share_init() failed");
+		my_exit(1);
+	}
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,57,0)
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
 }
 
 /* unmake_curl -- clean up and discard libcurl's global state.
  */
 void
 unmake_curl(void) {
+	if (stat_fetches != 0) {
+		DEBUG(1, true, "%ld fetches, %ld new connections, "
+		      "%ld over HTTP/2\n",
+		      stat_fetches, stat_connects, stat_http2);
+		stat_fetches = stat_connects = stat_http2 = 0;
+	}
+	while (neasy_pool > 0)
+		curl_easy_cleanup(easy_pool[--neasy_pool]);
+	DESTROY(easy_pool);
 	if (multi != NULL) {
 		curl_multi_cleanup(multi);
 		multi = NULL;
 	}
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
+	DESTROY(io_fds);
+	DESTROY(io_ready);
+	if (easy_hdrs != NULL) {
+		curl_slist_free_all(easy_hdrs);
+		easy_hdrs = NULL;
+	}
+	io_nfds = io_maxfds = 0;
+	io_deadline = -1;
+	io_pace(0, 0);
 	if (curl_cleanup_needed) {
 		curl_global_cleanup();
 		curl_cleanup_needed = false;
@@ -86,90 +232,232 @@ unmake_curl(void) {
 fetch_t
 create_fetch(query_t query, char *url) {
 	fetch_t fetch = NULL;
-	CURLMcode res;
 
 	DEBUG(2, true, "fetch(%s)\n", url);
 	CREATE(fetch, sizeof *fetch);
 	fetch->query = query;
 	query = NULL;
-	fetch->easy = curl_easy_init();
-	if (fetch->easy == NULL) {
-		/* an error will have been output by libcurl in this case. */
-		DESTROY(fetch);
-		DESTROY(url);
-		my_exit(1);
-	}
 	fetch->url = url;
 	url = NULL;
+
+	/* linked-list insert. */
+	fetch->next = fetch->query->fetches;
+	fetch->query->fetches = fetch;
+
+	fetch_launch(fetch);
+	return fetch;
+}
+
+/* fetch_launch -- start a fetch now, or later if pacing says to wait, or
+ * once there's room if io_fetch_limit() fetches are in flight already.
+ */
+static void
+fetch_launch(fetch_t fetch) {
+	long long wait = 0;
+
+	if (fetch_room() <= 0) {
+		fetch_hold(fetch);
+		return;
+	}
+	if (!fetch->query->unmetered)
+		wait = pace_take();
+	if (wait > 0)
+		fetch_delay(fetch, wait);
+	else
+		fetch_start(fetch);
+}
+
+/* fetch_start -- give a fetch an easy handle and hand it to libcurl.
+ */
+static void
+fetch_start(fetch_t fetch) {
+	CURLMcode res;
+
+	fetch->easy = easy_get();
 	curl_easy_setopt(fetch->easy, CURLOPT_URL, fetch->url);
+	curl_easy_setopt(fetch->easy, CURLOPT_WRITEDATA, fetch);
+	curl_easy_setopt(fetch->easy, CURLOPT_PRIVATE, fetch);
+
+	res = curl_multi_add_handle(multi, fetch->easy);
+	if (res != CURLM_OK) {
+		my_logf("curl_multi_add_handle() failed: %s",
+			curl_multi_strerror(res));
+		my_exit(1);
+	}
+	nrunning++;
+	fetches_changed = true;
+}
+
+/* fetch_stop -- take a fetch's easy handle back from libcurl, if it has one.
+ */
+static void
+fetch_stop(fetch_t fetch) {
+	if (fetch->easy == NULL)
+		return;
+	curl_multi_remove_handle(multi, fetch->easy);
+	easy_put(fetch->easy);
+	fetch->easy = NULL;
+	nrunning--;
+}
+
+/* fetch_hold -- queue a fetch to be launched when there's room for it.
+ */
+static void
+fetch_hold(fetch_t fetch) {
+	fetch_t *fp;
+
+	/* append, so that held fetches start in the order they came. */
+	for (fp = &on_hold; *fp != NULL; fp = &(*fp)->hold_next)
+		NULL;
+	DEBUG(2, true, "hold (%d) %s\n", nheld, fetch->query->descr);
+	fetch->held = true;
+	fetch->hold_next = NULL;
+	*fp = fetch;
+	nheld++;
+}
+
+/* fetch_room -- how many more fetches may be launched, right now.
+ *
+ * a fetch waiting for a retry or for pacing will start by itself, so it
+ * counts as being in flight; one done and waiting for its turn to write
+ * doesn't, or the fetches that it waits on could never start.
+ */
+static int
+fetch_room(void) {
+	return io_fetch_limit() - (nrunning + ndelayed);
+}
+
+/* io_unhold -- launch held fetches, oldest first, while there's room.
+ */
+static void
+io_unhold(void) {
+	while (on_hold != NULL && fetch_room() > 0) {
+		fetch_t fetch = on_hold;
+
+		on_hold = fetch->hold_next;
+		fetch->hold_next = NULL;
+		fetch->held = false;
+		nheld--;
+		fetch_launch(fetch);
+	}
+}
+
+/* easy_get -- take an idle easy handle from the pool, or make a new one.
+ *
+ * everything that's the same for every fetch is set here, once per handle.
+ */
+static CURL *
+easy_get(void) {
+	CURL *easy;
+
+	if (neasy_pool > 0)
+		return easy_pool[--neasy_pool];
+
+	easy = curl_easy_init();
+	if (easy == NULL) {
+		/* an error will have been output by libcurl in this case. */
+		my_exit(1);
+	}
 	if (donotverify) {
-		curl_easy_setopt(fetch->easy, CURLOPT_SSL_VERIFYPEER, 0L);
-		curl_easy_setopt(fetch->easy, CURLOPT_SSL_VERIFYHOST, 0L);
+		curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+		curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
 	}
 
 	/* if user specified a prefence for IPv4 or IPv6, use it. */
 	if (curl_ipresolve != CURL_IPRESOLVE_WHATEVER)
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_IPRESOLVE, curl_ipresolve);
+		curl_easy_setopt(easy, CURLOPT_IPRESOLVE, curl_ipresolve);
 
 	/* if user specified a timeout, use for connection and transactions. */
 	if (curl_timeout != 0L) {
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_CONNECTTIMEOUT, curl_timeout);
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_TIMEOUT, curl_timeout);
+		curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, curl_timeout);
+		curl_easy_setopt(easy, CURLOPT_TIMEOUT, curl_timeout);
 	}
 	if (psys->auth != NULL)
-	    psys->auth(fetch);
+		psys->auth(easy);
 
 	/* if user specified a cookie file, tell libcurl about it. */
 	if (cookie_file != NULL)
-		curl_easy_setopt(fetch->easy, CURLOPT_COOKIEFILE, cookie_file);
-
-	if (psys->encap == encap_saf)
-		fetch->hdrs = curl_slist_append(fetch->hdrs, jsonl_header);
-	else
-		fetch->hdrs = curl_slist_append(fetch->hdrs, json_header);
-	curl_easy_setopt(fetch->easy, CURLOPT_HTTPHEADER, fetch->hdrs);
-	curl_easy_setopt(fetch->easy, CURLOPT_WRITEFUNCTION, writer_func);
-	curl_easy_setopt(fetch->easy, CURLOPT_WRITEDATA, fetch);
-	curl_easy_setopt(fetch->easy, CURLOPT_PRIVATE, fetch);
+		curl_easy_setopt(easy, CURLOPT_COOKIEFILE, cookie_file);
+
+	/* the header list is built on first use and shared thereafter. */
+	if (easy_hdrs == NULL) {
+		if (psys->encap == encap_saf)
+			easy_hdrs = curl_slist_append(NULL, jsonl_header);
+		else
+			easy_hdrs = curl_slist_append(NULL, json_header);
+		if (psys->headers != NULL)
+			easy_hdrs = psys->headers(easy_hdrs);
+	}
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, easy_hdrs);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writer_func);
+	curl_easy_setopt(easy, CURLOPT_SHARE, share);
 #ifdef CURL_AT_LEAST_VERSION
 /* If CURL_AT_LEAST_VERSION is not defined then the curl is probably too old */
 #if CURL_AT_LEAST_VERSION(7,42,0)
 	/* do not allow curl to swallow /./ and /../ in our URLs */
-	curl_easy_setopt(fetch->easy, CURLOPT_PATH_AS_IS, 1L);
+	curl_easy_setopt(easy, CURLOPT_PATH_AS_IS, 1L);
+#endif
+#if CURL_AT_LEAST_VERSION(7,43,0)
+	/* wait for a connection that can multiplex, rather than opening
+	 * another one, while HTTP/2 negotiation is in progress.
+	 */
+	curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+#endif
+#if CURL_AT_LEAST_VERSION(7,47,0)
+	curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+			 (long)CURL_HTTP_VERSION_2TLS);
 #endif
 #endif /* CURL_AT_LEAST_VERSION */
 	if (debug_level >= 3)
-		curl_easy_setopt(fetch->easy, CURLOPT_VERBOSE, 1L);
-
-	/* linked-list insert. */
-	fetch->next = fetch->query->fetches;
-	fetch->query->fetches = fetch;
+		curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+	return easy;
+}
 
-	res = curl_multi_add_handle(multi, fetch->easy);
-	if (res != CURLM_OK) {
-		my_logf("curl_multi_add_handle() failed: %s",
-			curl_multi_strerror(res));
-		my_exit(1);
+/* easy_put -- return an easy handle to the pool, or free it if that's full.
+ */
+static void
+easy_put(CURL *easy) {
+	if (easy_pool == NULL) {
+		easy_pool = calloc(MAX_FETCHES, sizeof *easy_pool);
+		if (easy_pool == NULL)
+			my_panic(true, "calloc");
 	}
-	return fetch;
+	if (neasy_pool == MAX_FETCHES) {
+		curl_easy_cleanup(easy);
+		return;
+	}
+	/* don't leave pointers to a dead fetch in an idle handle. */
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, NULL);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, NULL);
+	easy_pool[neasy_pool++] = easy;
 }
 
 /* fetch_reap -- reap one fetch.
  */
 static void
 fetch_reap(fetch_t fetch) {
-	if (fetch->easy != NULL) {
-		curl_multi_remove_handle(multi, fetch->easy);
-		curl_easy_cleanup(fetch->easy);
-		fetch->easy = NULL;
+	fetch_stop(fetch);
+	if (fetch->spool != NULL)
+		spool_destroy(&fetch->spool);
+	if (fetch->deferred)
+		ndeferred--;
+	if (fetch->start_at != 0) {
+		fetch_t *fp;
+
+		for (fp = &delayed; *fp != fetch; fp = &(*fp)->delay_next)
+			assert(*fp != NULL);
+		*fp = fetch->delay_next;
+		ndelayed--;
 	}
-	if (fetch->hdrs != NULL) {
-		curl_slist_free_all(fetch->hdrs);
-		fetch->hdrs = NULL;
+	if (fetch->held) {
+		fetch_t *fp;
+
+		for (fp = &on_hold; *fp != fetch; fp = &(*fp)->hold_next)
+			assert(*fp != NULL);
+		*fp = fetch->hold_next;
+		nheld--;
 	}
+	DESTROY(fetch->path);
 	DESTROY(fetch->saf_msg);
 	DESTROY(fetch->url);
 	DESTROY(fetch->buf);
@@ -204,7 +492,7 @@ fetch_unlink(fetch_t fetch) {
 	fetch->query = NULL;
 }
 
-/* writer_init -- instantiate a writer, which may involve forking a "sort".
+/* writer_init -- instantiate a writer, with a sorter if sorting.
  */
 writer_t
 writer_init(long output_limit, ps_user_t ps_user, bool meta_query) {
@@ -214,29 +502,16 @@ writer_init(long output_limit, ps_user_t ps_user, bool meta_query) {
 	writer->output_limit = output_limit;
 	writer->ps_user = ps_user;
 	writer->meta_query = meta_query;
+	writer->arena = arena_new(WRITER_ARENA_CHUNK);
+	writer->out = outbuf_new(STDOUT_FILENO);
 
-	if (sorting != no_sort) {
-		/* sorting involves a subprocess (POSIX sort(1) command),
-		 * which will by definition not output anything until
-		 * after it receives EOF. this means we can pipe both
-		 * to its stdin and from its stdout, without risk of
-		 * deadlock. it also means a full store-and-forward of
-		 * the result, which increases latency to the first
-		 * output for our user.
-		 */
-		int p1[2], p2[2];
-
-		if (pipe(p1) < 0 || pipe(p2) < 0)
-			my_panic(true, "pipe");
-		if ((writer->sort_pid = fork()) < 0)
-			my_panic(true, "fork");
-		if (writer->sort_pid == 0)
-			exec_sort(p1, p2);
-		close(p1[0]);
-		writer->sort_stdin = fdopen(p1[1], "w");
-		writer->sort_stdout = fdopen(p2[0], "r");
-		close(p2[1]);
-	}
+	/* sorting holds everything until the writer is done, which
+	 * means a full store-and-forward of the result, and so more
+	 * latency to the first output for our user.
+	 */
+	if (sorting != no_sort && !meta_query)
+		writer->sorter = sorter_new(output_limit > 0 ?
+					    (size_t)output_limit : 0);
 
 	writer->next = writers;
 	writers = writer;
@@ -245,7 +520,7 @@ writer_init(long output_limit, ps_user_t ps_user, bool meta_query) {
 
 void
 ps_stdout(writer_t writer) {
-	fwrite(writer->ps_buf, 1, writer->ps_len, stdout);
+	outbuf_write(writer->out, writer->ps_buf, writer->ps_len);
 }
 
 /* query_status -- install a status code and description in a query.
@@ -267,9 +542,7 @@ query_status(query_t query, const char *status, const char *message) {
  *
  * This function's signature must conform to write_callback() in
  * CURLOPT_WRITEFUNCTION.
- * Returns the number of bytes actually taken care of or returns
- * CURL_WRITEFUNC_PAUSE to pause this query's connection until
- * curl_easy_pause(..., CURLPAUSE_CONT) is called.
+ * Returns the number of bytes actually taken care of.
  */
 size_t
 writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
@@ -277,47 +550,66 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 	query_t query = fetch->query;
 	writer_t writer = query->writer;
 	qparam_ct qp = &query->qp;
-	size_t bytes = size * nmemb;
-	char *nl;
+	size_t bytes = size * nmemb, scan;
+	char *nl, *line;
 
 	DEBUG(3, true, "writer_func(%d, %d): %d\n",
 	      (int)size, (int)nmemb, (int)bytes);
 
-	/* if we're in asynchronous batch mode, only one query can reach
-	 * the writer at a time. fetches within a query can interleave. */
-	if (batching == batch_verbose) {
-		if (multiple) {
-			if (writer->active == NULL) {
-				/* grab the token. */
-				writer->active = query;
-				DEBUG(2, true, "active (%d) %s\n",
-				      npaused, query->descr);
-			} else if (writer->active != query) {
-				/* pause the query. */
-				paused[npaused++] = query;
-				DEBUG(2, true, "pause (%d) %s\n",
-				      npaused, query->descr);
-				return CURL_WRITEFUNC_PAUSE;
-			}
-		}
-		if (!query->hdr_sent) {
-			printf("++ %s\n", query->descr);
-			query->hdr_sent = true;
+	/* a page can't be written until the page before it has been. */
+	if (fetch->page_wait) {
+		if (fetch->spool == NULL)
+			fetch->spool = spool_new();
+		spool_write(fetch->spool, ptr, bytes);
+		return bytes;
+	}
+
+	/* if queries are taking turns, only one query can reach the
+	 * writer at a time; the others spool their input until their turn.
+	 * fetches within a query can interleave.
+	 */
+	if (writer->spooling) {
+		if (writer->active == NULL)
+			writer_grant(writer, query);
+		if (writer->active != query) {
+			if (fetch->spool == NULL)
+				fetch->spool = spool_new();
+			spool_write(fetch->spool, ptr, bytes);
+			writer_wait(writer, query);
+			return bytes;
 		}
 	}
+	if (batching == batch_verbose && !writer->meta_query &&
+	    !query->hdr_sent)
+	{
+		outbuf_puts(writer->out, "++ ");
+		outbuf_puts(writer->out, query->descr);
+		outbuf_putc(writer->out, '\n');
+		query->hdr_sent = true;
+	}
 
-	fetch->buf = realloc(fetch->buf, fetch->len + bytes);
+	/* append to whatever partial line is left over from last time,
+	 * growing geometrically. that partial line has no newline in it.
+	 */
+	if (fetch->len + bytes > fetch->size) {
+		fetch->size = fetch->size == 0 ? FETCH_BUF_MIN : fetch->size;
+		while (fetch->len + bytes > fetch->size)
+			fetch->size *= 2;
+		fetch->buf = realloc(fetch->buf, fetch->size);
+		if (fetch->buf == NULL)
+			my_panic(true, "realloc");
+	}
 	memcpy(fetch->buf + fetch->len, ptr, bytes);
+	scan = fetch->len;
 	fetch->len += bytes;
 
 	/* when the fetch is a live web result, emit
 	 * !2xx errors and info payloads as reports.
 	 */
-	if (fetch->easy != NULL) {
-		if (fetch->rcode == 0)
-			curl_easy_getinfo(fetch->easy,
-					  CURLINFO_RESPONSE_CODE,
-					  &fetch->rcode);
+	if (fetch->easy != NULL && fetch->rcode == 0)
+		curl_easy_getinfo(fetch->easy, CURLINFO_RESPONSE_CODE,
+				  &fetch->rcode);
+	if (fetch->rcode != 0) {
 		if (fetch->rcode != HTTP_OK) {
 			char *message = strndup(fetch->buf, fetch->len);
 
@@ -326,19 +618,22 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 			if (eol != NULL)
 				*eol = '\0';
 
-			/* only remember the first response status. */
-			if (query->status == NULL)
-				query_status(query,
-					     psys->status(fetch),
-					     message);
-			if (!quiet) {
-				char *url;
-
-				curl_easy_getinfo(fetch->easy,
-						  CURLINFO_EFFECTIVE_URL,
-						  &url);
-				my_logf("warning: libcurl %ld [%s] %s",
-					fetch->rcode, url, message);
+			if (retry_rcode(fetch->rcode) &&
+			    fetch_retryable(fetch))
+			{
+				/* fetch_retry() will try again later. */
+				DEBUG(1, true, "will retry %ld [%s] %s\n",
+				      fetch->rcode, fetch->url, message);
+			} else {
+				/* only remember the first response status. */
+				if (query->status == NULL)
+					query_status(query,
+						     psys->status(fetch),
+						     message);
+				if (!quiet)
+					my_logf("warning: libcurl %ld [%s] %s",
+						fetch->rcode, fetch->url,
+						message);
 			}
 			DESTROY(message);
 			fetch->buf[0] = '\0';
@@ -347,10 +642,12 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 		}
 	}
 
-	/* deblock. */
-	while ((nl = memchr(fetch->buf, '\n', fetch->len)) != NULL) {
-		size_t pre_len = (size_t)(nl - fetch->buf),
-			post_len = (fetch->len - pre_len) - 1;
+	/* deblock, handing each complete line over in place. */
+	line = fetch->buf;
+	while ((nl = memchr(fetch->buf + scan, '\n',
+			    fetch->len - scan)) != NULL)
+	{
+		size_t pre_len = (size_t)(nl - line);
 
 		if (sorting == no_sort && writer->output_limit > 0 &&
 		    writer->count >= writer->output_limit)
@@ -368,10 +665,16 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 			writer->ps_buf = realloc(writer->ps_buf,
 						 writer->ps_len + pre_len + 1);
 			memcpy(writer->ps_buf + writer->ps_len,
-			       fetch->buf, pre_len + 1);
+			       line, pre_len + 1);
 			writer->ps_len += pre_len + 1;
 		} else {
-			query->writer->count += pdns_blob(fetch, pre_len);
+			int n = pdns_blob(fetch, line, pre_len);
+			arena_reset(line_arena);
+
+			query->writer->count += n;
+			fetch->delivered += n;
+			if (writer->held != NULL)
+				writer_release(writer, ASINFO_MAX_HELD);
 
 			if (psys->encap == encap_saf)
 				switch (fetch->saf_cond) {
@@ -391,10 +694,31 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 					break;
 				}
 		}
-		memmove(fetch->buf, nl + 1, post_len);
-		fetch->len = post_len;
+		line = nl + 1;
+		scan = (size_t)(line - fetch->buf);
+	}
+
+	/* move what's left of the last partial line to the front. */
+	if (line != fetch->buf) {
+		fetch->len -= (size_t)(line - fetch->buf);
+		memmove(fetch->buf, line, fetch->len);
 	}
 
+#ifndef CRIPPLED_LIBC
+	/* a local source never waits in io_wait(), so look for answers
+	 * to held lines here.
+	 */
+	if (writer->held != NULL) {
+		asinfo_poll();
+		writer_release(writer, ASINFO_MAX_HELD);
+	}
+#endif
+
+	/* what was presented ends with a whole line. a live web result
+	 * goes out as it comes; a local one can wait for a fuller buffer.
+	 */
+	if (fetch->easy != NULL || writer->out->len >= OUTBUF_FLUSH)
+		outbuf_flush(writer->out);
 	return bytes;
 }
 
@@ -423,37 +747,165 @@ last_fetch(fetch_t fetch) {
 			my_logf("API status: %s (%s)",
 				query->status, query->message);
 	} else if (batching == batch_verbose) {
-		/* if this was an actively written query, unpause another. */
 		writer_t writer = query->writer;
-
-		if (multiple) {
+		char *ps = NULL;
+		int len;
+
+		len = asprintf(&ps, "-- %s (%s)\n",
+			       or_else(query->status, status_noerror),
+			       or_else(query->message,
+				       or_else(fetch->saf_msg, "no error")));
+		if (len < 0)
+			my_panic(true, "asprintf");
+		if (writer->spooling) {
+			/* this query's turn is over; the writer lives on. */
 			assert(writer->active == query);
 			writer->active = NULL;
+			writer_release(writer, 0);
+			outbuf_write(writer->out, ps, (size_t)len);
+			DESTROY(ps);
+		} else {
+			assert(writer->ps_buf == NULL && writer->ps_len == 0);
+			writer->ps_buf = ps;
+			writer->ps_len = (size_t)len;
 		}
-		assert(writer->ps_buf == NULL && writer->ps_len == 0);
-		writer->ps_len = (size_t)
-			asprintf(&writer->ps_buf, "-- %s (%s)\n",
-				 or_else(query->status, status_noerror),
-				 or_else(query->message,
-					 or_else(fetch->saf_msg, "no error")));
-		if (npaused > 0) {
-			query_t unpause;
-			fetch_t ufetch;
-			int i;
-
-			/* unpause the next query's fetches. */
-			unpause = paused[0];
-			npaused--;
-			for (i = 0; i < npaused; i++)
-				paused[i] = paused[i + 1];
-			for (ufetch = unpause->fetches;
-			     ufetch != NULL;
-			     ufetch = ufetch->next) {
-				DEBUG(2, true, "unpause (%d) %s\n",
-				      npaused, unpause->descr);
-				curl_easy_pause(ufetch->easy, CURLPAUSE_CONT);
-			}
+	}
+}
+
+/* writer_grant -- give a query the turn to write.
+ */
+static void
+writer_grant(writer_t writer, query_t query) {
+	DEBUG(2, true, "turn (%d deferred) %s\n", ndeferred, query->descr);
+	assert(writer->active == NULL);
+	writer->active = query;
+	/* output limits and headers are per query, not per writer. */
+	writer->output_limit = query->qp.output_limit;
+	writer->count = 0;
+	writer->csv_headerp = false;
+}
+
+/* writer_wait -- make a query wait for its turn, if it isn't already.
+ */
+static void
+writer_wait(writer_t writer, query_t query) {
+	if (query->waiting)
+		return;
+	DEBUG(2, true, "wait %s\n", query->descr);
+	query->waiting = true;
+	query->wait_next = NULL;
+	if (writer->waiting_last == NULL)
+		writer->waiting = query;
+	else
+		writer->waiting_last->wait_next = query;
+	writer->waiting_last = query;
+}
+
+/* writer_turn -- pass the turn along to waiting queries, replaying their
+ * spooled input, until one of them is still running or none are waiting.
+ */
+static void
+writer_turn(writer_t writer) {
+	while (writer->active == NULL && writer->waiting != NULL) {
+		query_t query = writer->waiting;
+		fetch_t fetch;
+
+		writer->waiting = query->wait_next;
+		if (writer->waiting == NULL)
+			writer->waiting_last = NULL;
+		query->waiting = false;
+		query->wait_next = NULL;
+		writer_grant(writer, query);
+
+		/* completing a fetch can add, promote, or drop pages of it,
+		 * so look for the next one to replay from the top each time.
+		 * pages waiting for the page before them are left alone.
+		 */
+		for (;;) {
+			for (fetch = query->fetches; fetch != NULL;
+			     fetch = fetch->next)
+				if (!fetch->page_wait &&
+				    (fetch->spool != NULL || fetch->deferred))
+					break;
+			if (fetch == NULL)
+				break;
+			fetch_replay(fetch);
+			/* this may end the query's turn. */
+			if (fetch->deferred)
+				fetch_complete(fetch, fetch->result);
+		}
+	}
+}
+
+/* fetch_replay -- hand a fetch's spooled input to the writer, in order.
+ */
+static void
+fetch_replay(fetch_t fetch) {
+	char buf[FETCH_BUF_MIN];
+	size_t len;
+
+	if (fetch->spool == NULL)
+		return;
+	while ((len = spool_read(fetch->spool, buf, sizeof buf)) > 0)
+		(void) writer_func(buf, 1, len, fetch);
+	spool_destroy(&fetch->spool);
+}
+
+/* writer_hold -- hold a line back until its ASINFO lookups are done.
+ *
+ * with -a, a line having any lookup in flight is held, as is every line
+ * after it, and presented by writer_release() once its turn comes.
+ */
+void
+writer_hold(writer_t writer, query_t query, const asinfo_t *lookups,
+	    size_t nlookup, const char *line, size_t len)
+{
+	struct held *held = malloc(sizeof *held +
+				   nlookup * sizeof *lookups + len);
+
+	if (held == NULL)
+		my_panic(true, "malloc");
+	held->next = NULL;
+	held->query = query;
+	held->nlookup = nlookup;
+	memcpy(held->lookups, lookups, nlookup * sizeof *lookups);
+	held->line = (char *)&held->lookups[nlookup];
+	memcpy(held->line, line, len);
+	held->len = len;
+	if (writer->held_last == NULL)
+		writer->held = held;
+	else
+		writer->held_last->next = held;
+	writer->held_last = held;
+	writer->nheld++;
+}
+
+/* writer_release -- present held lines whose ASINFO lookups are done, in
+ * order, waiting for lookups as long as more than keep lines are held.
+ */
+static void
+writer_release(writer_t writer, size_t keep) {
+	struct held *held;
+
+	while ((held = writer->held) != NULL) {
+#ifndef CRIPPLED_LIBC
+		for (size_t i = 0; i < held->nlookup; i++) {
+			if (asinfo_done(held->lookups[i]))
+				continue;
+			if (writer->nheld <= keep)
+				return;
+			asinfo_wait(held->lookups[i]);
 		}
+#endif
+		writer->held = held->next;
+		if (writer->held == NULL)
+			writer->held_last = NULL;
+		writer->nheld--;
+		pdns_present(held->query, held->line, held->len);
+		arena_reset(line_arena);
+		free(held);
+		if (writer->out->len >= OUTBUF_FLUSH)
+			outbuf_flush(writer->out);
 	}
 }
 
@@ -478,6 +930,9 @@ writer_fini(writer_t writer) {
 		prev->next = writer->next;
 	}
 
+	/* held lines know their queries, so they go before the queries do. */
+	writer_release(writer, 0);
+
 	/* finish and close any fetches still cooking. */
 	while (writer->queries != NULL) {
 		query_t query = writer->queries,
@@ -506,128 +961,40 @@ writer_fini(writer_t writer) {
 		assert((query->status != NULL) == (query->message != NULL));
 		DESTROY(query->status);
 		DESTROY(query->message);
-		DESTROY(query->descr);
 		DESTROY(query);
 		writer->queries = query_next;
 	}
 
 	/* drain the sort if there is one. */
-	if (writer->sort_pid != 0) {
-		int status, count;
-		char *line = NULL;
-		size_t n = 0;
-
-		/* when sorting, there has been no output yet. gather the
-		 * intermediate representation from the POSIX sort stdout,
-		 * skip over the sort keys we added earlier, and process.
-		 */
-		fclose(writer->sort_stdin);
-		DEBUG(1, true, "closed sort_stdin, wrote %d objs\n",
-			 writer->count);
-		count = 0;
-		while (getline(&line, &n, writer->sort_stdout) > 0) {
-			/* if we're above the limit, ignore remaining output.
-			 * this is nec'y to avoid SIGPIPE from sort if we were
-			 * to close its stdout pipe without emptying it first.
-			 */
-			if (writer->output_limit > 0 &&
-			    count >= writer->output_limit)
-			{
-				if (!writer->sort_killed) {
-					kill(writer->sort_pid, SIGTERM);
-					writer->sort_killed = true;
-				}
-				continue;
-			}
-
-			char *nl;
-			if ((nl = strchr(line, '\n')) == NULL) {
-				my_logf("warning: no \\n found in '%s'", line);
-				continue;
-			}
-			size_t llen = (unsigned)(nl - line);
-			DEBUG(2, true, "sort1: '%*.*s'\n", llen, llen, line);
-			char *linep = line;
-			/* skip sort key: first */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no SP found in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: last */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no second SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: duration */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no third SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: count */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no fourth SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: rrname */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no fifth SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: rrtype */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no sixth SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			/* skip sort key: rdata */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				my_logf("warning: no seventh SP in '%*.*s'",
-					llen, llen, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-
-			/* recover the json */
-			size_t len = (unsigned)(nl - linep);
-			DEBUG(2, true, "sort2: '%*.*s'\n", len, len, linep);
-			struct pdns_tuple tup;
-			const char *msg = tuple_make(&tup, linep, len);
-			if (msg != NULL) {
-				my_logf("warning: tuple_make: %s", msg);
-				continue;
-			}
+	if (writer->sorter != NULL) {
+		struct pdns_tuple tup;
+		int count = 0;
+
+		DEBUG(1, true, "sorting %d objs\n", writer->count);
+		while ((writer->output_limit <= 0 ||
+			count < writer->output_limit) &&
+		       sorter_next(writer->sorter, &tup))
+		{
 			/* after the sort, we don't know what query
 			 * caused any given tuple.
 			 */
+			arena_json(line_arena);
 			(*presenter->output)(&tup, NULL, writer);
-			tuple_unmake(&tup);
+			arena_json(NULL);
+			arena_reset(line_arena);
+			if (writer->out->len >= OUTBUF_FLUSH)
+				outbuf_flush(writer->out);
 			count++;
 		}
-		DESTROY(line);
-		fclose(writer->sort_stdout);
-		DEBUG(1, true, "closed sort_stdout, read %d objs (lim %ld)\n",
+		DEBUG(1, true, "sorted, presented %d objs (lim %ld)\n",
 		      count, writer->output_limit);
-		if (waitpid(writer->sort_pid, &status, 0) < 0) {
-			perror("waitpid");
-		} else {
-			if (!writer->sort_killed && status != 0)
-				my_logf("warning: sort exit status is %u",
-					(unsigned)status);
-		}
+		sorter_destroy(&writer->sorter);
 	}
 
-	/* burp out the stored postscript, if any, and destroy it. */
+	/* burp out the stored postscript, if any, and destroy it. it may
+	 * write through stdio, so what was presented has to go first.
+	 */
+	outbuf_flush(writer->out);
 	if (writer->ps_len > 0) {
 		assert(writer->ps_user != NULL);
 		writer->ps_user(writer);
@@ -635,6 +1002,8 @@ writer_fini(writer_t writer) {
 		writer->ps_len = 0;
 	}
 
+	outbuf_destroy(&writer->out);
+	arena_destroy(&writer->arena);
 	DESTROY(writer);
 }
 
@@ -645,47 +1014,316 @@ unmake_writers(void) {
 }
 
 /* io_engine -- let libcurl run until there are few enough outstanding jobs.
+ *
+ * transfers are driven by curl_multi_socket_action(), so we only wake up
+ * when one of libcurl's sockets is ready or one of its timers has expired.
  */
 void
 io_engine(int jobs) {
-	int still, repeats, numfds;
+	int still;
 
 	DEBUG(2, true, "io_engine(%d)\n", jobs);
 
-	/* let libcurl run while there are too many jobs remaining. */
+	/* let libcurl start any new transfers and handle any expired timers. */
+	io_unhold();
 	still = 0;
-	repeats = 0;
-	while (curl_multi_perform(multi, &still) == CURLM_OK && still > jobs) {
-		DEBUG(3, true, "...waiting (still %d)\n", still);
-		numfds = 0;
-		if (curl_multi_wait(multi, NULL, 0, 0, &numfds) != CURLM_OK)
+	if (curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still)
+	    != CURLM_OK)
+		return;
+	io_drain(&still);
+
+	/* let libcurl run while there are too many jobs remaining. fetches
+	 * that are done but waiting for their turn to write still count,
+	 * so that the amount of spooled input stays bounded, and so do
+	 * fetches waiting to be retried or paced, or held for room.
+	 */
+	while ((still > 0 || ndelayed > 0) &&
+	       still + ndeferred + ndelayed + nheld > jobs)
+	{
+		DEBUG(3, true, "...waiting (still %d, deferred %d, "
+		      "delayed %d, held %d)\n",
+		      still, ndeferred, ndelayed, nheld);
+		if (!io_wait(&still))
 			break;
-		if (numfds == 0) {
-			/* curl_multi_wait() can return 0 fds for no reason. */
-			if (++repeats > 1) {
-				struct timespec req, rem;
-
-				req = (struct timespec){
-					.tv_sec = 0,
-					.tv_nsec = 100*1000*1000  // 100ms
-				};
-				while (nanosleep(&req, &rem) == EINTR) {
-					/* as required by nanosleep(3). */
-					req = rem;
-				}
+		io_drain(&still);
+	}
+	io_drain(&still);
+}
+
+/* io_await -- run libcurl until one query's fetches are all done. other
+ * fetches carry on meanwhile, and any that finish are handled as usual.
+ */
+void
+io_await(query_ct query) {
+	int still = 0;
+
+	io_unhold();
+	if (curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still)
+	    != CURLM_OK)
+		return;
+	io_drain(&still);
+	while (query->fetches != NULL) {
+		if (!io_wait(&still))
+			break;
+		io_drain(&still);
+	}
+}
+
+/* io_fetch_limit -- how many fetches should be in flight at once, right now.
+ */
+int
+io_fetch_limit(void) {
+	if (!adaptive_fetches)
+		return max_fetches;
+	if (fetch_window == 0)
+		fetch_window = DEFAULT_FETCHES < max_fetches
+			? DEFAULT_FETCHES
+			: max_fetches;
+	return fetch_window;
+}
+
+/* io_adapt -- adjust adaptive concurrency after a fetch completes.
+ *
+ * this is AIMD: the window grows by one fetch after a window's worth of
+ * healthy completions, and is halved when the server says it's overloaded
+ * (429, 503, timeout) or when time to first byte climbs well above the best
+ * we've seen. after a decrease, we wait for the fetches that were already
+ * in flight to finish before deciding to decrease again.
+ */
+static void
+io_adapt(fetch_t fetch, CURLcode result) {
+	bool congested;
+	double ttfb = 0.0;
+
+	if (!adaptive_fetches || fetch->query->writer->meta_query)
+		return;
+	(void) io_fetch_limit();
+	congested = fetch->rcode == HTTP_TOO_MANY ||
+		fetch->rcode == HTTP_UNAVAILABLE ||
+		result == CURLE_OPERATION_TIMEDOUT;
+	if (!congested && result == CURLE_OK &&
+	    curl_easy_getinfo(fetch->easy, CURLINFO_STARTTRANSFER_TIME,
+			      &ttfb) == CURLE_OK)
+	{
+		long long ms = (long long)(ttfb * 1000.0);
+
+		if (latency_avg < 0)
+			latency_avg = ms;
+		else
+			latency_avg = (7 * latency_avg + ms) / 8;
+		/* let the floor drift up, so a permanently slower server
+		 * doesn't pin us at a window of one.
+		 */
+		if (latency_floor < 0 || ms < latency_floor)
+			latency_floor = ms;
+		else
+			latency_floor += (latency_avg - latency_floor) / 64;
+		if (latency_avg > ADAPT_LATENCY_FACTOR * latency_floor +
+		    ADAPT_LATENCY_SLACK)
+			congested = true;
+	}
+	if (fetch_cooldown > 0)
+		fetch_cooldown--;
+	if (congested) {
+		fetch_credit = 0;
+		if (fetch_cooldown == 0) {
+			fetch_cooldown = fetch_window;
+			if (fetch_window > 1)
+				fetch_window /= 2;
+			DEBUG(1, true, "fetch window down to %d "
+			      "(rcode %ld, ttfb %lldms, floor %lldms)\n",
+			      fetch_window, fetch->rcode,
+			      latency_avg, latency_floor);
+		}
+	} else if (++fetch_credit >= fetch_window) {
+		fetch_credit = 0;
+		if (fetch_window < max_fetches) {
+			fetch_window++;
+			DEBUG(2, true, "fetch window up to %d\n",
+			      fetch_window);
+		}
+	}
+}
+
+/* io_stats -- account for a completed fetch's use of connections.
+ */
+static void
+io_stats(fetch_t fetch) {
+	long connects = 0;
+
+	stat_fetches++;
+	if (curl_easy_getinfo(fetch->easy, CURLINFO_NUM_CONNECTS,
+			      &connects) == CURLE_OK)
+		stat_connects += connects;
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,50,0)
+	{
+		long version = 0;
+
+		if (curl_easy_getinfo(fetch->easy, CURLINFO_HTTP_VERSION,
+				      &version) == CURLE_OK &&
+		    version == CURL_HTTP_VERSION_2_0)
+			stat_http2++;
+	}
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+}
+
+/* io_wait -- sleep until a socket or timer needs attention, then service it.
+ *
+ * returns false if libcurl has reported a fatal error, else true.
+ */
+static bool
+io_wait(int *still) {
+	long long timeout = IO_MAX_WAIT;
+	nfds_t i, nready, nfds = io_nfds;
+	int n;
+
+	if (io_deadline >= 0)
+		timeout = io_deadline - io_now();
+	for (fetch_ct fetch = delayed; fetch != NULL;
+	     fetch = fetch->delay_next)
+		if (fetch->start_at - io_now() < timeout)
+			timeout = fetch->start_at - io_now();
+#ifndef CRIPPLED_LIBC
+	/* with -a, ASINFO answers are watched for after libcurl's sockets. */
+	if (asinfo_fd() >= 0) {
+		if (io_nfds == io_maxfds)
+			io_fds_grow();
+		io_fds[nfds++] = (struct pollfd){ .fd = asinfo_fd(),
+						  .events = POLLIN };
+		if (asinfo_timeout() < timeout)
+			timeout = asinfo_timeout();
+	}
+#endif
+	if (timeout < 0)
+		timeout = 0;
+	else if (timeout > IO_MAX_WAIT)
+		timeout = IO_MAX_WAIT;
+	n = poll(io_fds, nfds, (int)timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return true;
+		my_panic(true, "poll");
+	}
+
+#ifndef CRIPPLED_LIBC
+	/* present whatever lines the answers that came in have released. */
+	if (nfds > io_nfds) {
+		asinfo_poll();
+		for (writer_t writer = writers; writer != NULL;
+		     writer = writer->next)
+			if (writer->held != NULL) {
+				writer_release(writer, ASINFO_MAX_HELD);
+				outbuf_flush(writer->out);
 			}
-		} else {
-			repeats = 0;
+	}
+#endif
+
+	/* libcurl's callbacks can change io_fds[], so work from a copy. */
+	nready = 0;
+	for (i = 0; i < io_nfds && n > 0; i++)
+		if (io_fds[i].revents != 0) {
+			io_ready[nready++] = io_fds[i];
+			n--;
 		}
-		io_drain();
+	for (i = 0; i < nready; i++) {
+		int mask = 0;
+
+		if ((io_ready[i].revents & (POLLIN|POLLHUP)) != 0)
+			mask |= CURL_CSELECT_IN;
+		if ((io_ready[i].revents & POLLOUT) != 0)
+			mask |= CURL_CSELECT_OUT;
+		if ((io_ready[i].revents & (POLLERR|POLLNVAL)) != 0)
+			mask |= CURL_CSELECT_ERR;
+		if (curl_multi_socket_action(multi, io_ready[i].fd,
+					     mask, still) != CURLM_OK)
+			return false;
+	}
+
+	/* if libcurl's timer has expired, tell it so. */
+	if (io_deadline >= 0 && io_deadline <= io_now()) {
+		io_deadline = -1;
+		if (curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT,
+					     0, still) != CURLM_OK)
+			return false;
 	}
-	io_drain();
+
+	/* start any delayed fetches whose time has come. */
+	if (delayed != NULL)
+		io_delayed(still);
+	return true;
+}
+
+/* io_fds_grow -- make room for more sockets to be watched.
+ */
+static void
+io_fds_grow(void) {
+	io_maxfds = io_maxfds == 0 ? 8 : io_maxfds * 2;
+	io_fds = realloc(io_fds, io_maxfds * sizeof *io_fds);
+	io_ready = realloc(io_ready, io_maxfds * sizeof *io_ready);
+	if (io_fds == NULL || io_ready == NULL)
+		my_panic(true, "realloc");
+}
+
+/* io_socket -- libcurl's CURLMOPT_SOCKETFUNCTION; (un)watch one socket.
+ */
+static int
+io_socket(CURL *easy __attribute__((unused)),
+	  curl_socket_t s, int what,
+	  void *userp __attribute__((unused)),
+	  void *socketp __attribute__((unused)))
+{
+	nfds_t i;
+
+	for (i = 0; i < io_nfds && io_fds[i].fd != s; i++) { }
+	if (what == CURL_POLL_REMOVE) {
+		if (i < io_nfds)
+			io_fds[i] = io_fds[--io_nfds];
+		return 0;
+	}
+	if (i == io_nfds) {
+		if (io_nfds == io_maxfds)
+			io_fds_grow();
+		io_fds[io_nfds++].fd = s;
+	}
+	io_fds[i].events = 0;
+	if ((what & CURL_POLL_IN) != 0)
+		io_fds[i].events |= POLLIN;
+	if ((what & CURL_POLL_OUT) != 0)
+		io_fds[i].events |= POLLOUT;
+	io_fds[i].revents = 0;
+	return 0;
+}
+
+/* io_timer -- libcurl's CURLMOPT_TIMERFUNCTION; (re)arm or disarm our timer.
+ */
+static int
+io_timer(CURLM *m __attribute__((unused)), long timeout_ms,
+	 void *userp __attribute__((unused)))
+{
+	if (timeout_ms < 0)
+		io_deadline = -1;
+	else
+		io_deadline = io_now() + timeout_ms;
+	return 0;
 }
 
-/* io_drain -- drain the response code reports.
+/* io_now -- current time in milliseconds, on a clock that never steps back.
+ */
+static long long
+io_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* io_drain -- drain the response code reports. finishing a fetch can start
+ * or abandon others (-x pages), so *running is brought up to date if so.
  */
 static void
-io_drain(void) {
+io_drain(int *running) {
 	struct CURLMsg *cm;
 	int still = 0;
 
@@ -701,6 +1339,8 @@ io_drain(void) {
 		query = fetch->query;
 
 		if (cm->msg == CURLMSG_DONE) {
+			writer_t writer = query->writer;
+
 			if (fetch->rcode == 0)
 				curl_easy_getinfo(fetch->easy,
 						  CURLINFO_RESPONSE_CODE,
@@ -708,69 +1348,495 @@ io_drain(void) {
 
 			DEBUG(2, true, "io_drain(%s) DONE rcode=%d\n",
 			      query->descr, fetch->rcode);
-			if (psys->encap == encap_saf) {
-				if (fetch->saf_cond == sc_begin ||
-				    fetch->saf_cond == sc_ongoing)
-				{
-					/* stream ended without a terminating
-					 * SAF value, so override stale value
-					 * we received before the problem.
-					 */
-					fetch->saf_cond = sc_missing;
-					fetch->saf_msg = strdup(
-						"Data transfer failed "
-						"-- No SAF terminator "
-						"at end of stream");
-					query_status(query,
-						     status_error,
-						     fetch->saf_msg);
+			io_adapt(fetch, cm->data.result);
+			io_stats(fetch);
+
+			/* a page that's waiting has written nothing, so it can
+			 * be retried at once; otherwise it waits its turn, and
+			 * the slot it had can go to the pages after it.
+			 */
+			if (fetch->page_wait) {
+				if (!fetch_retry(fetch, cm->data.result)) {
+					fetch_defer(fetch, cm->data.result);
+					if (fetch_room() - nheld > 0)
+						page_ahead(fetch);
 				}
-				DEBUG(2, true, "... saf_cond %d saf_msg %s\n",
-				      fetch->saf_cond,
-				      or_else(fetch->saf_msg, ""));
-			}
-			if (cm->data.result == CURLE_COULDNT_RESOLVE_HOST) {
-				my_logf("libcurl failed since "
-					"could not resolve host");
-				exit_code = 1;
-			} else if (cm->data.result == CURLE_COULDNT_CONNECT) {
-				my_logf("libcurl failed since "
-					"could not connect");
-				exit_code = 1;
-			} else if (cm->data.result != CURLE_OK &&
-				   !fetch->stopped)
-			{
-				my_logf("libcurl failed with "
-					"curl error %d (%s)",
-					cm->data.result,
-					curl_easy_strerror(cm->data.result));
-				exit_code = 1;
+				continue;
 			}
 
-			/* record emptiness as status if nothing else. */
-			if (psys->encap == encap_saf &&
-			    query->writer != NULL &&
-			    !query->writer->meta_query &&
-			    query->writer->count == 0 &&
-			    query->status == NULL)
-			{
-				query_status(query,
-					     status_noerror,
-					     "no results found for query.");
+			/* if it's not this query's turn, hold the result. */
+			if (writer->spooling) {
+				if (writer->active == NULL)
+					writer_grant(writer, query);
+				if (writer->active != query) {
+					fetch_defer(fetch, cm->data.result);
+					writer_wait(writer, query);
+					continue;
+				}
 			}
-
-			fetch_done(fetch);
-			fetch_unlink(fetch);
-			fetch_reap(fetch);
+			fetch_complete(fetch, cm->data.result);
+			if (writer->spooling)
+				writer_turn(writer);
 		}
 		DEBUG(3, true, "...info read (still %d)\n", still);
 	}
+
+	/* those that finished made room for any that were held. */
+	io_unhold();
+
+	/* let libcurl recount the fetches that are running. */
+	if (fetches_changed) {
+		fetches_changed = false;
+		(void) curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT,
+						0, running);
+	}
+}
+
+/* fetch_defer -- a fetch's transfer is done but it's not its turn to write.
+ *
+ * the easy handle is released now, and the rest waits for writer_turn(),
+ * or for page_promote() if this is a page waiting for the one before it.
+ */
+static void
+fetch_defer(fetch_t fetch, CURLcode result) {
+	DEBUG(2, true, "defer (%d) %s\n", ndeferred, fetch->query->descr);
+	fetch->deferred = true;
+	fetch->result = result;
+	ndeferred++;
+	fetch_stop(fetch);
+}
+
+/* fetch_complete -- finish a fetch whose transfer is done, and reap it.
+ */
+static void
+fetch_complete(fetch_t fetch, CURLcode result) {
+	query_t query = fetch->query;
+	fetch_t page_next;
+
+	if (fetch_retry(fetch, result))
+		return;
+
+	if (psys->encap == encap_saf) {
+		if (fetch->saf_cond == sc_begin ||
+		    fetch->saf_cond == sc_ongoing)
+		{
+			/* stream ended without a terminating
+			 * SAF value, so override stale value
+			 * we received before the problem.
+			 */
+			fetch->saf_cond = sc_missing;
+			fetch->saf_msg = strdup(
+				"Data transfer failed "
+				"-- No SAF terminator "
+				"at end of stream");
+			query_status(query,
+				     status_error,
+				     fetch->saf_msg);
+		}
+		DEBUG(2, true, "... saf_cond %d saf_msg %s\n",
+		      fetch->saf_cond,
+		      or_else(fetch->saf_msg, ""));
+	}
+	if (result == CURLE_COULDNT_RESOLVE_HOST) {
+		my_logf("libcurl failed since "
+			"could not resolve host");
+		exit_code = 1;
+	} else if (result == CURLE_COULDNT_CONNECT) {
+		my_logf("libcurl failed since "
+			"could not connect");
+		exit_code = 1;
+	} else if (result != CURLE_OK && !fetch->stopped) {
+		my_logf("libcurl failed with "
+			"curl error %d (%s)",
+			result, curl_easy_strerror(result));
+		exit_code = 1;
+	}
+
+	/* record emptiness as status if nothing else. */
+	if (psys->encap == encap_saf &&
+	    query->writer != NULL &&
+	    !query->writer->meta_query &&
+	    query->writer->count == 0 &&
+	    query->status == NULL)
+	{
+		query_status(query,
+			     status_noerror,
+			     "no results found for query.");
+	}
+
+	/* a limited page means there are more; anything else was the last.
+	 * either way, do it before fetch_done() decides if the query is.
+	 */
+	if (fetch->saf_cond == sc_limited)
+		page_ahead(fetch);
+	else
+		page_drop(fetch);
+	page_next = fetch->page_next;
+
+	fetch_done(fetch);
+	fetch_unlink(fetch);
+	fetch_reap(fetch);
+	if (page_next != NULL)
+		page_promote(page_next);
+}
+
+/* page_ahead -- with -x, keep up to PAGE_AHEAD pages in flight after this
+ * one, as long as the query's limit and the server's offset_max allow.
+ *
+ * the next page is always needed, but those after it are only fetched
+ * into slots that io_fetch_limit() leaves free, counting this one's and
+ * not those that held fetches are waiting for.
+ */
+static void
+page_ahead(fetch_t fetch) {
+	int ahead = 0, spare = fetch->easy != NULL ? 1 : 0;
+	fetch_t tail = fetch;
+
+	if (page_size == 0 || fetch->limit <= 0)
+		return;
+	while (tail->page_next != NULL) {
+		tail = tail->page_next;
+		ahead++;
+	}
+	while (ahead < PAGE_AHEAD &&
+	       (ahead == 0 || fetch_room() - nheld + spare > 0))
+	{
+		fetch_t page = page_make(tail);
+
+		if (page == NULL)
+			break;
+		tail->page_next = page;
+		tail = page;
+		ahead++;
+	}
+}
+
+/* page_make -- launch the page of a lookup that follows a given one, or
+ * return NULL if there should be no such page.
+ */
+static fetch_t
+page_make(fetch_ct prev) {
+	query_t query = prev->query;
+	struct qparam qp = query->qp;
+	long offset = prev->offset + prev->limit, limit = page_size;
+	fetch_t fetch;
+	char *url;
+
+	if (query->qp.query_limit > 0) {
+		long left = query->qp.offset + query->qp.query_limit - offset;
+
+		if (left <= 0)
+			return NULL;
+		if (left < limit)
+			limit = left;
+	}
+	if (page_offset_max > 0 && offset > page_offset_max) {
+		DEBUG(1, true, "offset %ld is past offset_max %ld\n",
+		      offset, page_offset_max);
+		return NULL;
+	}
+	qp.offset = offset;
+	qp.query_limit = limit;
+	url = psys->url(prev->path, NULL, &qp, &prev->fence, false);
+	if (url == NULL)
+		my_exit(1);
+	DEBUG(1, true, "page url [%s]\n", url);
+
+	fetch = create_fetch(query, url);
+	fetch->path = strdup(prev->path);
+	fetch->fence = prev->fence;
+	fetch->offset = offset;
+	fetch->limit = limit;
+	fetch->window_lo = prev->window_lo;
+	fetch->window_hi = prev->window_hi;
+	fetch->page_wait = true;
+	return fetch;
+}
+
+/* page_drop -- discard the pages after this one, which was the last.
+ */
+static void
+page_drop(fetch_t fetch) {
+	while (fetch->page_next != NULL) {
+		fetch_t page = fetch->page_next;
+
+		DEBUG(2, true, "drop page at offset %ld\n", page->offset);
+		if (page->easy != NULL)
+			fetches_changed = true;
+		fetch->page_next = page->page_next;
+		fetch_unlink(page);
+		fetch_reap(page);
+	}
+}
+
+/* page_promote -- the page before this one has been written, so write
+ * whatever this one has spooled, and finish it if its transfer is done.
+ */
+static void
+page_promote(fetch_t fetch) {
+	fetch->page_wait = false;
+	fetch_replay(fetch);
+	if (fetch->deferred)
+		fetch_complete(fetch, fetch->result);
+}
+
+/* fetch_retry -- if a finished fetch failed in a retryable way, retry it.
+ *
+ * a SAF lookup is resumed after the tuples it already delivered, using
+ * an offset; other fetches are retried only if nothing was delivered.
+ * returns true if a retry has been scheduled.
+ */
+static bool
+fetch_retry(fetch_t fetch, CURLcode result) {
+	bool truncated;
+	long long delay;
+	int shift;
+
+	if (!fetch_retryable(fetch))
+		return false;
+	truncated = psys->encap == encap_saf && result == CURLE_OK &&
+		(fetch->saf_cond == sc_begin || fetch->saf_cond == sc_ongoing);
+	if (!truncated && !retry_rcode(fetch->rcode) && !retry_result(result))
+		return false;
+	if (fetch->delivered != 0 &&
+	    (psys->encap != encap_saf || strcmp(pverb->name, "lookup") != 0))
+		return false;
+	if (fetch->limit > 0 && fetch->delivered >= fetch->limit)
+		return false;
+
+	/* exponential backoff with jitter, unless the server asks for more. */
+	shift = fetch->attempts < 16 ? fetch->attempts : 16;
+	delay = (long long)RETRY_BASE_MS << shift;
+	if (delay > RETRY_MAX_MS)
+		delay = RETRY_MAX_MS;
+	delay = delay / 2 + random() % (delay / 2 + 1);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,66,0)
+	if (fetch->easy != NULL) {
+		curl_off_t retry_after = 0;
+
+		if (curl_easy_getinfo(fetch->easy, CURLINFO_RETRY_AFTER,
+				      &retry_after) == CURLE_OK &&
+		    retry_after * 1000 > delay)
+			delay = (long long)retry_after * 1000;
+	}
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+	fetch->attempts++;
+	DEBUG(1, true, "retry %d of %d in %lldms after %ld delivered "
+	      "(rcode %ld, curl %d, saf_cond %d) [%s]\n",
+	      fetch->attempts, max_retries, delay, fetch->delivered,
+	      fetch->rcode, result, fetch->saf_cond, fetch->url);
+
+	/* forget the failed attempt, including any partial line. */
+	fetch_stop(fetch);
+	if (fetch->deferred) {
+		fetch->deferred = false;
+		ndeferred--;
+	}
+	if (fetch->spool != NULL)
+		spool_destroy(&fetch->spool);
+	fetch->len = 0;
+	fetch->rcode = 0;
+	fetch->saf_cond = sc_init;
+	DESTROY(fetch->saf_msg);
+
+	fetch_delay(fetch, delay);
+	return true;
+}
+
+/* fetch_retryable -- could this fetch be retried if it were to fail now?
+ */
+static bool
+fetch_retryable(fetch_ct fetch) {
+	return fetch->path != NULL && !fetch->stopped &&
+		fetch->attempts < max_retries;
+}
+
+/* retry_rcode -- is this HTTP status worth retrying after a while?
+ */
+static bool
+retry_rcode(long rcode) {
+	return rcode == HTTP_TOO_MANY || rcode == HTTP_BAD_GATEWAY ||
+		rcode == HTTP_UNAVAILABLE || rcode == HTTP_GATEWAY_TIMEOUT;
+}
+
+/* retry_result -- is this libcurl failure worth retrying after a while?
+ */
+static bool
+retry_result(CURLcode result) {
+	return result == CURLE_COULDNT_CONNECT ||
+		result == CURLE_OPERATION_TIMEDOUT ||
+		result == CURLE_PARTIAL_FILE ||
+		result == CURLE_SEND_ERROR ||
+		result == CURLE_RECV_ERROR ||
+		result == CURLE_GOT_NOTHING;
+}
+
+/* fetch_delay -- hold a fetch back for this many milliseconds.
+ */
+static void
+fetch_delay(fetch_t fetch, long long delay) {
+	fetch_t *fp;
+
+	/* append, so that paced fetches start in the order they came. */
+	for (fp = &delayed; *fp != NULL; fp = &(*fp)->delay_next)
+		NULL;
+	fetch->start_at = io_now() + delay;
+	fetch->delay_next = NULL;
+	*fp = fetch;
+	ndelayed++;
+}
+
+/* io_delayed -- start any delayed fetches whose time has come, if the
+ * pacing bucket allows; a retry resumes after what was delivered.
+ */
+static void
+io_delayed(int *still) {
+	long long now = io_now();
+	bool started = false;
+	fetch_t *fp = &delayed;
+
+	while (*fp != NULL) {
+		fetch_t fetch = *fp;
+		long long wait;
+
+		if (fetch->start_at > now) {
+			fp = &fetch->delay_next;
+			continue;
+		}
+		if (!fetch->query->unmetered && (wait = pace_take()) > 0)
+		{
+			fetch->start_at = now + wait;
+			fp = &fetch->delay_next;
+			continue;
+		}
+		*fp = fetch->delay_next;
+		fetch->delay_next = NULL;
+		fetch->start_at = 0;
+		ndelayed--;
+
+		if (fetch->attempts > 0) {
+			struct qparam qp = fetch->query->qp;
+
+			qp.offset = fetch->offset + fetch->delivered;
+			qp.query_limit = fetch->limit;
+			if (qp.query_limit > 0)
+				qp.query_limit -= fetch->delivered;
+			DESTROY(fetch->url);
+			fetch->url = psys->url(fetch->path, NULL, &qp,
+					       &fetch->fence, false);
+			if (fetch->url == NULL)
+				my_exit(1);
+			DEBUG(1, true, "retry url [%s]\n", fetch->url);
+		}
+		fetch_start(fetch);
+		started = true;
+	}
+
+	/* let libcurl count the newly started fetches as running. */
+	if (started)
+		(void) curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT,
+						0, still);
+}
+
+/* io_pace -- (re)configure the token bucket that paces fetch starts
+ * to burst_size per burst_window seconds. each token comes back a full
+ * window after it is spent, so no window ever sees more than burst_size
+ * starts. a non-positive size or window turns pacing off.
+ */
+void
+io_pace(long burst_size, long burst_window) {
+	long long *ring = NULL, window = 0, now = io_now();
+	long size = 0, keep = 0;
+
+	if (burst_size > 0 && burst_window > 0) {
+		size = burst_size < PACE_RING_MAX ? burst_size : PACE_RING_MAX;
+		window = (long long)burst_window * 1000 * size / burst_size;
+		/* the server's clock starts when a request arrives, not when
+		 * we send it, so leave some room for latency jitter.
+		 */
+		window += window * PACE_SLACK_PCT / 100;
+		ring = malloc((size_t)size * sizeof *ring);
+		if (ring == NULL)
+			my_panic(true, "malloc");
+
+		/* the newest spends carry over; other tokens are unspent. */
+		keep = pace_size < size ? pace_size : size;
+		for (long i = 0; i < size - keep; i++)
+			ring[i] = now - window;
+		for (long i = 0; i < keep; i++)
+			ring[size - keep + i] = pace_ring[(pace_next + pace_size -
+							   keep + i) % pace_size];
+		DEBUG(1, true, "pace: %ld per %lldms\n", size, window);
+	}
+	DESTROY(pace_ring);
+	pace_ring = ring;
+	pace_window = window;
+	pace_size = size;
+	pace_next = 0;
+}
+
+/* io_paging -- (re)configure -x paging: a lookup that the server limits to
+ * results_max results is continued by fetches of that many results at
+ * successive offsets, up to offset_max if that's positive. a non-positive
+ * results_max turns paging off.
+ */
+void
+io_paging(long results_max, long offset_max) {
+	page_size = results_max > 0 ? results_max : 0;
+	page_offset_max = offset_max > 0 ? offset_max : 0;
+	DEBUG(1, true, "paging: %ld per page, offset_max %ld\n",
+	      page_size, page_offset_max);
+}
+
+/* io_page_size -- how many results each page of a lookup should ask for,
+ * or zero if lookups aren't being paged.
+ */
+long
+io_page_size(void) {
+	return page_size;
+}
+
+/* io_limits_due -- is it time to (re)load the server's rate limits? true
+ * at most once per LIMITS_REFRESH seconds, and only if pacing or paging
+ * was asked for.
+ */
+bool
+io_limits_due(void) {
+	long long now = io_now();
+
+	if (!pacing && !paging)
+		return false;
+	if (limits_refreshed >= 0 &&
+	    now - limits_refreshed < LIMITS_REFRESH * 1000)
+		return false;
+	limits_refreshed = now;
+	return true;
+}
+
+/* pace_take -- take a token from the pacing bucket. returns zero if one
+ * was taken, else how many milliseconds until one will be available.
+ */
+static long long
+pace_take(void) {
+	long long now, wait;
+
+	if (pace_size == 0)
+		return 0;
+	now = io_now();
+	wait = pace_ring[pace_next] + pace_window - now;
+	if (wait > 0)
+		return wait;
+	pace_ring[pace_next] = now;
+	pace_next = (pace_next + 1) % pace_size;
+	return 0;
 }
 
-/* escape -- HTML-encode a string, returns a string which must be free()'d.
+/* escape -- HTML-encode a string, returning a copy in the given arena.
  */
 char *
-escape(const char *str) {
+escape(arena_t arena, const char *str) {
 	char *escaped, *ret;
 
 	if (str == NULL)
@@ -780,7 +1846,7 @@ escape(const char *str) {
 		my_logf("curl_escape(%s) failed", str);
 		my_exit(1);
 	}
-	ret = strdup(escaped);
+	ret = arena_strdup(arena, escaped);
 	curl_free(escaped);
 	escaped = NULL;
 	return ret;
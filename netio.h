@@ -20,6 +20,10 @@
 #include <stdbool.h>
 #include <curl/curl.h>
 
+#include "arena.h"
+#include "asinfo.h"
+#include "outbuf.h"
+
 /* encapsulation protocol.  ruminate, DNBDB APIv1 and CIRCL use encap_cof. */
 typedef enum { encap_cof = 0, encap_saf } encap_e;
 
@@ -49,21 +53,55 @@ struct qparam {
 typedef struct qparam *qparam_t;
 typedef const struct qparam *qparam_ct;
 
+/* time fencing parameters, derived from a query's qparam. */
+struct pdns_fence {
+	u_long	first_after, first_before, last_after, last_before;
+};
+typedef const struct pdns_fence *pdns_fence_ct;
+
 /* one API fetch; several may be needed for complex (multitype) queries. */
 struct fetch {
 	struct fetch	*next;
 	struct query	*query;
 	CURL		*easy;
-	struct curl_slist  *hdrs;
 	char		*url;
-	char		*buf;
-	size_t		len;
+	/* for retries: what to ask for, and how it has gone so far. */
+	char		*path;
+	struct pdns_fence  fence;
+	long		delivered;
+	int		attempts;
+	/* the &offset= and &limit= it asks for; a limit of -1 is the
+	 * server's default.
+	 */
+	long		offset, limit;
+	/* with -x, the next page of this lookup. a page waits, spooling its
+	 * input, until the page before it has been written.
+	 */
+	struct fetch	*page_next;
+	bool		page_wait;
+	/* when a delayed fetch may start, for a retry or for pacing. */
+	long long	start_at;
+	struct fetch	*delay_next;
+	/* a fetch held until fewer than io_fetch_limit() are in flight. */
+	bool		held;
+	struct fetch	*hold_next;
+	/* with -W, the time_first span this fetch keeps: [lo, hi), 0 = open. */
+	u_long		window_lo, window_hi;
+	char		*buf;	/* partial input line, then next block */
+	size_t		len;	/* bytes in buf */
+	size_t		size;	/* bytes allocated for buf */
 	long		rcode;
 	bool		stopped;
 	saf_cond_e	saf_cond;
 	char		*saf_msg;
+	/* input received while our query waits for its turn to write. */
+	struct spool	*spool;
+	/* transfer finished while waiting; result is held until our turn. */
+	bool		deferred;
+	CURLcode	result;
 };
 typedef struct fetch *fetch_t;
+typedef const struct fetch *fetch_ct;
 
 /* one query; one per invocation (or per batch line.) */
 struct query {
@@ -72,32 +110,61 @@ struct query {
 	struct writer	*writer;
 	struct qparam	qp;
 	char		*descr;
+	/* the "_dnsdbq" object for -T qdetail, see pdns_blob(). */
+	char		*qdetail;
 	mode_e		mode;
 	bool		multitype;
+	/* not charged against -Q pacing, such as a rate_limit fetch. */
+	bool		unmetered;
 	/* invariant: (status == NULL) == (writer == NULL) */
 	char		*status;
 	char		*message;
 	bool		hdr_sent;
+	/* waiting for a turn to write; see writer->spooling. */
+	bool		waiting;
+	struct query	*wait_next;
 };
 typedef struct query *query_t;
 typedef const struct query *query_ct;
 
 typedef void (*ps_user_t)(struct writer *);
 
+/* with -a, an output line held back until its ASINFO lookups are done,
+ * so that lines still come out in the order they came in.
+ */
+struct held {
+	struct held	*next;
+	struct query	*query;
+	char		*line;
+	size_t		len;
+	size_t		nlookup;
+	asinfo_t	lookups[];
+};
+
 /* one output stream, having one or several queries merging into it. */
 struct writer {
 	struct writer	*next;
 	struct query	*queries;
+	/* if spooling, queries take turns writing. the active query
+	 * writes directly, others spool their input until their turn,
+	 * which comes in the order they started waiting.
+	 */
+	bool		spooling;
 	struct query	*active;
-	FILE		*sort_stdin;
-	FILE		*sort_stdout;
-	pid_t		sort_pid;
-	bool		sort_killed;
+	struct query	*waiting, *waiting_last;
+	struct sorter	*sorter;
 	bool		csv_headerp;
 	bool		meta_query;
 	char		*ps_buf;
 	size_t		ps_len;
 	ps_user_t	ps_user;
+	/* its queries' strings, such as .descr and .qdetail. */
+	arena_t		arena;
+	/* its presented output, flushed between lines. */
+	outbuf_t	out;
+	/* lines held for ASINFO answers, oldest first; see writer_hold(). */
+	struct held	*held, *held_last;
+	size_t		nheld;
 	long		output_limit;
 	int		count;
 };
@@ -110,9 +177,17 @@ writer_t writer_init(long, ps_user_t, bool);
 void ps_stdout(writer_t);
 void query_status(query_t, const char *, const char *);
 size_t writer_func(char *ptr, size_t size, size_t nmemb, void *blob);
+void writer_hold(writer_t, query_t, const asinfo_t *, size_t,
+		 const char *, size_t);
 void writer_fini(writer_t);
 void unmake_writers(void);
 void io_engine(int);
-char *escape(const char *);
+void io_await(query_ct);
+int io_fetch_limit(void);
+void io_pace(long, long);
+void io_paging(long, long);
+long io_page_size(void);
+bool io_limits_due(void);
+char *escape(arena_t, const char *);
 
 #endif /*NETIO_H_INCLUDED*/
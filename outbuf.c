@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "outbuf.h"
+#include "time.h"
+#include "globals.h"
+
+/* outbuf_new(fd) -- create an empty outbuf that writes to this descriptor
+ */
+outbuf_t
+outbuf_new(int fd) {
+	outbuf_t ob = NULL;
+
+	CREATE(ob, sizeof *ob);
+	ob->fd = fd;
+	return ob;
+}
+
+/* outbuf_reserve(len) -- make room in an outbuf for this many more octets
+ *
+ * the buffer grows rather than flushing, since what it holds so far may
+ * end in a partial line.
+ */
+void
+outbuf_reserve(outbuf_t ob, size_t len) {
+	size_t size = ob->size == 0 ? OUTBUF_MIN : ob->size;
+
+	while (size - ob->len < len)
+		size *= 2;
+	if (size != ob->size) {
+		ob->buf = realloc(ob->buf, size);
+		if (ob->buf == NULL)
+			my_panic(true, "realloc");
+		ob->size = size;
+	}
+}
+
+/* outbuf_puts(str) -- append a C string to an outbuf, without its NUL
+ */
+void
+outbuf_puts(outbuf_t ob, const char *str) {
+	outbuf_write(ob, str, strlen(str));
+}
+
+/* outbuf_putll(val) -- append a signed integer in decimal to an outbuf
+ */
+void
+outbuf_putll(outbuf_t ob, long long val) {
+	char digits[sizeof "-9223372036854775808"], *p = digits + sizeof digits;
+	unsigned long long u = (unsigned long long)val;
+
+	if (val < 0)
+		u = -u;
+	do {
+		*--p = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (val < 0)
+		*--p = '-';
+	outbuf_write(ob, p, (size_t)(digits + sizeof digits - p));
+}
+
+/* outbuf_time(x, iso8601fmt) -- append a timestamp, as time_fmt() formats it
+ */
+void
+outbuf_time(outbuf_t ob, u_long x, bool iso8601fmt) {
+	if (ob->size - ob->len < TIME_FMT_MAX)
+		outbuf_reserve(ob, TIME_FMT_MAX);
+	ob->len += time_fmt(ob->buf + ob->len, x, iso8601fmt, &ob->times);
+}
+
+/* outbuf_flush() -- write out and empty an outbuf
+ *
+ * anything written to stdout through stdio goes first, so that the two
+ * keep their order when they share a descriptor.
+ */
+void
+outbuf_flush(outbuf_t ob) {
+	size_t off = 0;
+
+	if (ob->len == 0)
+		return;
+	if (ob->fd == STDOUT_FILENO)
+		fflush(stdout);
+	while (off < ob->len) {
+		ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			my_panic(true, "write");
+		}
+		off += (size_t)n;
+	}
+	ob->len = 0;
+}
+
+/* outbuf_destroy() -- flush an outbuf and release it
+ */
+void
+outbuf_destroy(outbuf_t *obp) {
+	outbuf_flush(*obp);
+	DESTROY((*obp)->buf);
+	DESTROY(*obp);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __OUTBUF_H_INCLUDED
+#define __OUTBUF_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "time.h"
+
+/* an outbuf gathers output in memory and hands it to write(2) in large
+ * pieces. it is only written out by outbuf_flush(), so as long as that is
+ * called between lines, output from several outbufs sharing one file
+ * descriptor interleaves by whole lines. the struct is public so that
+ * the small appends can be inlined.
+ */
+struct outbuf {
+	char		*buf;
+	size_t		len, size;
+	int		fd;
+	struct time_cache  times;	/* for outbuf_time() */
+};
+typedef struct outbuf *outbuf_t;
+
+outbuf_t outbuf_new(int);
+void outbuf_reserve(outbuf_t, size_t);
+void outbuf_puts(outbuf_t, const char *);
+void outbuf_putll(outbuf_t, long long);
+void outbuf_time(outbuf_t, u_long, bool);
+void outbuf_flush(outbuf_t);
+void outbuf_destroy(outbuf_t *);
+
+/* outbuf_write -- append some octets to an outbuf
+ */
+static inline void
+outbuf_write(outbuf_t ob, const char *ptr, size_t len) {
+	if (ob->size - ob->len < len)
+		outbuf_reserve(ob, len);
+	memcpy(ob->buf + ob->len, ptr, len);
+	ob->len += len;
+}
+
+/* outbuf_putc -- append one octet to an outbuf
+ */
+static inline void
+outbuf_putc(outbuf_t ob, char ch) {
+	if (ob->len == ob->size)
+		outbuf_reserve(ob, 1);
+	ob->buf[ob->len++] = ch;
+}
+
+#endif /*__OUTBUF_H_INCLUDED*/
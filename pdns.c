@@ -32,105 +32,137 @@
 #include "tokstr.h"
 #include "globals.h"
 
-static void present_text_line(const char *, const char *, const char *);
-static void present_csv_line(pdns_tuple_ct, const char *);
-static void present_minimal_thing(const char *thing);
-static void present_json(pdns_tuple_ct, query_ct, bool);
-static json_t *annotate_json(pdns_tuple_ct, query_ct, bool);
-static json_t *annotation_json(query_ct query, json_t *annoRD);
+/* the members that splice_json() can change, in the order that it adds
+ * any that weren't there.
+ */
+enum splice_e {
+	sp_zone_first = 0, sp_zone_last, sp_time_first, sp_time_last,
+	sp_rrname, sp_dnsdbq, sp_count
+};
+static const char * const splice_names[sp_count] = {
+	"zone_time_first", "zone_time_last", "time_first", "time_last",
+	"rrname", "_dnsdbq"
+};
+
+static void present_text_line(outbuf_t, const char *, const char *,
+			      const char *);
+static void present_csv_line(outbuf_t, pdns_tuple_ct, const char *);
+static void present_csv_time(outbuf_t, pdns_tuple_ct, unsigned, u_long);
+static void present_csv_quoted(outbuf_t, const char *);
+static void present_minimal_thing(outbuf_t, const char *thing);
+static void present_json(pdns_tuple_ct, query_ct, writer_t, bool);
+static void splice_json(outbuf_t, pdns_tuple_ct, query_ct, json_t *);
+static void splice_value(outbuf_t, enum splice_e, pdns_tuple_ct, query_ct,
+			 json_t *);
+static void json_quote(outbuf_t, const char *);
+static int json_outbuf(const char *, size_t, void *);
+static json_t *annotate_rdata(pdns_tuple_ct);
+static char *qdetail_json(query_ct);
+static json_t *annotation_json(query_ct query);
 static json_t *annotate_one(json_t *, const char *, const char *, json_t *);
 #ifndef CRIPPLED_LIBC
 static json_t *annotate_asinfo(const char *, const char *);
 #endif
+static unsigned cof_member(struct jspan);
+static const char *tuple_cof_scan(pdns_tuple_t, struct jscan *, char **);
 static struct counted *countoff_r(const char *, int);
+static bool pdns_asinfo(query_t, pdns_tuple_ct, const char *, size_t);
+static void pdns_output(query_t, pdns_tuple_ct);
 
 /* present_text_lookup -- render one pdns tuple in "dig" style ascii text.
  */
 void
 present_text_lookup(pdns_tuple_ct tup,
 		    query_ct query __attribute__ ((unused)),
-		    writer_t writer __attribute__ ((unused)))
+		    writer_t writer)
 {
+	outbuf_t out = writer->out;
 	bool pflag, ppflag;
 	const char *prefix;
 
 	ppflag = false;
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL && tup->obj.time_last != NULL) {
+	if (TUP_HAS(tup, TUP_TIME_FIRST|TUP_TIME_LAST)) {
 		char duration[50];
 
 		if (ns_format_ttl(tup->time_last - tup->time_first + 1, //non-0
 				  duration, sizeof duration) < 0)
 			strcpy(duration, "?");
-		printf(";; record times: %s",
-			time_str(tup->time_first, iso8601));
-		printf(" .. %s (%s)\n",
-			time_str(tup->time_last, iso8601),
-			duration);
+		outbuf_puts(out, ";; record times: ");
+		outbuf_time(out, tup->time_first, iso8601);
+		outbuf_puts(out, " .. ");
+		outbuf_time(out, tup->time_last, iso8601);
+		outbuf_puts(out, " (");
+		outbuf_puts(out, duration);
+		outbuf_puts(out, ")\n");
 		ppflag = true;
 	}
-	if (tup->obj.zone_first != NULL && tup->obj.zone_last != NULL) {
+	if (TUP_HAS(tup, TUP_ZONE_FIRST|TUP_ZONE_LAST)) {
 		char duration[50];
 
 		if (ns_format_ttl(tup->zone_last - tup->zone_first, // no +1
 				  duration, sizeof duration) < 0)
 			strcpy(duration, "?");
-		printf(";;   zone times: %s",
-			time_str(tup->zone_first, iso8601));
-		printf(" .. %s (%s)\n",
-			time_str(tup->zone_last, iso8601),
-			duration);
+		outbuf_puts(out, ";;   zone times: ");
+		outbuf_time(out, tup->zone_first, iso8601);
+		outbuf_puts(out, " .. ");
+		outbuf_time(out, tup->zone_last, iso8601);
+		outbuf_puts(out, " (");
+		outbuf_puts(out, duration);
+		outbuf_puts(out, ")\n");
 		ppflag = true;
 	}
 
 	/* Count and Bailiwick. */
 	prefix = ";;";
 	pflag = false;
-	if (tup->obj.count != NULL) {
-		printf("%s count: %lld", prefix, (long long)tup->count);
+	if ((tup->fields & TUP_COUNT) != 0) {
+		outbuf_puts(out, prefix);
+		outbuf_puts(out, " count: ");
+		outbuf_putll(out, (long long)tup->count);
 		prefix = ";";
 		pflag = true;
 		ppflag = true;
 	}
-	if (tup->obj.bailiwick != NULL) {
-		printf("%s bailiwick: %s", prefix, tup->bailiwick);
+	if ((tup->fields & TUP_BAILIWICK) != 0) {
+		outbuf_puts(out, prefix);
+		outbuf_puts(out, " bailiwick: ");
+		outbuf_puts(out, tup->bailiwick);
 		prefix = NULL;
 		pflag = true;
 		ppflag = true;
 	}
 	if (pflag)
-		putchar('\n');
+		outbuf_putc(out, '\n');
 
 	/* Records. */
-	if (json_is_array(tup->obj.rdata)) {
-		size_t index;
-		json_t *rr;
-
-		json_array_foreach(tup->obj.rdata, index, rr) {
-			const char *rdata = NULL;
+	if ((tup->fields & TUP_RDATA_ARRAY) != 0) {
+		for (size_t i = 0; i < tup->nrdata; i++) {
+			const char *rdata = tup->rdatas[i];
 
-			if (json_is_string(rr))
-				rdata = json_string_value(rr);
-			else
+			if (rdata == NULL)
 				rdata = "[bad value]";
-			present_text_line(tup->rrname, tup->rrtype, rdata);
+			present_text_line(out, tup->rrname, tup->rrtype,
+					  rdata);
 			ppflag = true;
 		}
 	} else {
-		present_text_line(tup->rrname, tup->rrtype, tup->rdata);
+		present_text_line(out, tup->rrname, tup->rrtype, tup->rdata);
 		ppflag = true;
 	}
 
 	/* Cleanup. */
 	if (ppflag)
-		putchar('\n');
+		outbuf_putc(out, '\n');
 }
 
 /* present_text_line -- render one RR in "dig" style ascii text.
  */
 static void
-present_text_line(const char *rrname, const char *rrtype, const char *rdata) {
+present_text_line(outbuf_t out, const char *rrname, const char *rrtype,
+		  const char *rdata)
+{
 	char *asnum = NULL, *cidr = NULL, *comment = NULL, *result = NULL;
 
 #ifndef CRIPPLED_LIBC
@@ -158,12 +190,17 @@ present_text_line(const char *rrname, const char *rrtype, const char *rdata) {
 		free(asnum);
 		free(cidr);
 	}
-	printf("%s  %s  %s", rrname, rrtype, rdata);
+	outbuf_puts(out, rrname);
+	outbuf_puts(out, "  ");
+	outbuf_puts(out, rrtype);
+	outbuf_puts(out, "  ");
+	outbuf_puts(out, rdata);
 	if (comment != NULL) {
-		printf("  ; %s", comment);
+		outbuf_puts(out, "  ; ");
+		outbuf_puts(out, comment);
 		free(comment);
 	}
-	putchar('\n');
+	outbuf_putc(out, '\n');
 }
 
 /* present_text_summ -- render summarize object in "dig" style ascii text.
@@ -171,39 +208,43 @@ present_text_line(const char *rrname, const char *rrtype, const char *rdata) {
 void
 present_text_summarize(pdns_tuple_ct tup,
 		       query_ct query __attribute__ ((unused)),
-		       writer_t writer __attribute__ ((unused)))
+		       writer_t writer)
 {
+	outbuf_t out = writer->out;
 	const char *prefix;
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL && tup->obj.time_last != NULL) {
-		printf(";; record times: %s",
-		       time_str(tup->time_first, iso8601));
-		printf(" .. %s\n",
-		       time_str(tup->time_last, iso8601));
+	if (TUP_HAS(tup, TUP_TIME_FIRST|TUP_TIME_LAST)) {
+		outbuf_puts(out, ";; record times: ");
+		outbuf_time(out, tup->time_first, iso8601);
+		outbuf_puts(out, " .. ");
+		outbuf_time(out, tup->time_last, iso8601);
+		outbuf_putc(out, '\n');
 	}
-	if (tup->obj.zone_first != NULL && tup->obj.zone_last != NULL) {
-		printf(";;   zone times: %s",
-		       time_str(tup->zone_first, iso8601));
-		printf(" .. %s\n",
-		       time_str(tup->zone_last, iso8601));
-		putchar('\n');
+	if (TUP_HAS(tup, TUP_ZONE_FIRST|TUP_ZONE_LAST)) {
+		outbuf_puts(out, ";;   zone times: ");
+		outbuf_time(out, tup->zone_first, iso8601);
+		outbuf_puts(out, " .. ");
+		outbuf_time(out, tup->zone_last, iso8601);
+		outbuf_puts(out, "\n\n");
 	}
 
 	/* Count and Num_Results. */
 	prefix = ";;";
-	if (tup->obj.count != NULL) {
-		printf("%s count: %lld",
-		       prefix, (long long)tup->count);
+	if ((tup->fields & TUP_COUNT) != 0) {
+		outbuf_puts(out, prefix);
+		outbuf_puts(out, " count: ");
+		outbuf_putll(out, (long long)tup->count);
 		prefix = ";";
 	}
-	if (tup->obj.num_results != NULL) {
-		printf("%s num_results: %lld",
-		       prefix, (long long)tup->num_results);
+	if ((tup->fields & TUP_NUM_RESULTS) != 0) {
+		outbuf_puts(out, prefix);
+		outbuf_puts(out, " num_results: ");
+		outbuf_putll(out, (long long)tup->num_results);
 		prefix = NULL;
 	}
 
-	putchar('\n');
+	outbuf_putc(out, '\n');
 }
 
 /* pprint_json -- pretty-print a JSON buffer after validation.
@@ -234,9 +275,9 @@ pprint_json(const char *buf, size_t len, FILE *outf) {
 void
 present_json_lookup(pdns_tuple_ct tup,
 		    query_ct query __attribute__ ((unused)),
-		    writer_t writer __attribute__ ((unused)))
+		    writer_t writer)
 {
-	present_json(tup, query, true);
+	present_json(tup, query, writer, true);
 }
 
 /* present_json_summarize -- render one DNSDB tuple as newline-separated JSON.
@@ -244,114 +285,252 @@ present_json_lookup(pdns_tuple_ct tup,
 void
 present_json_summarize(pdns_tuple_ct tup,
 		       query_ct query __attribute__ ((unused)),
-		       writer_t writer __attribute__ ((unused)))
+		       writer_t writer)
 {
-	present_json(tup, query, false);
+	present_json(tup, query, writer, false);
 }
 
 /* present_json -- shared renderer for DNSDB JSON tuples (lookup and summarize)
+ *
+ * with no transforms or annotations to apply, the COF's own bytes are
+ * written as they came, since tuple_make() has already validated them.
+ * this skips a parse and a re-serialization per tuple, and differs from
+ * the jansson rendering only in whitespace, escapes, and number spelling.
+ * otherwise the changes are spliced in; see splice_json().
  */
 static void
-present_json(pdns_tuple_ct tup, query_ct query, bool rd) {
-	json_t *copy = annotate_json(tup, query, rd);
+present_json(pdns_tuple_ct tup, query_ct query, writer_t writer, bool rd) {
+	json_t *annoRD = NULL;
 
-	if (copy != NULL) {
-		json_dumpf(copy, stdout, JSON_INDENT(0) | JSON_COMPACT);
-		json_decref(copy);
-	} else {
-		json_dumpf(tup->obj.cof_obj, stdout,
-			   JSON_INDENT(0) | JSON_COMPACT);
+	if (tup->cof.ptr == NULL)
+		return;
+	if (rd && asinfo_lookup)
+		annoRD = annotate_rdata(tup);
+	if (transforms == 0 && annoRD == NULL)
+		outbuf_write(writer->out, tup->cof.ptr, tup->cof.len);
+	else
+		splice_json(writer->out, tup, query, annoRD);
+	outbuf_putc(writer->out, '\n');
+	if (annoRD != NULL)
+		json_decref(annoRD);
+}
+
+/* splice_json -- write a tuple's COF with transforms and annotations applied.
+ *
+ * a member that changes has its value replaced where it stands, and one
+ * that wasn't there is appended; everything else is copied through as
+ * it came. the result is what loading the COF into jansson and setting
+ * the new members would produce, without the per-tuple copy.
+ */
+static void
+splice_json(outbuf_t out, pdns_tuple_ct tup, query_ct query, json_t *annoRD) {
+	bool want[sp_count] = {}, done[sp_count] = {};
+	const char *copied;
+	struct jspan key, val;
+	struct jscan js;
+	size_t nmember = 0;
+
+	if ((transforms & TRANS_DATEFIX) != 0) {
+		if (TUP_HAS(tup, TUP_ZONE_FIRST|TUP_ZONE_LAST))
+			want[sp_zone_first] = want[sp_zone_last] = true;
+		if (TUP_HAS(tup, TUP_TIME_FIRST|TUP_TIME_LAST))
+			want[sp_time_first] = want[sp_time_last] = true;
 	}
-	putchar('\n');
+	if ((transforms & (TRANS_REVERSE|TRANS_CHOMP)) != 0 &&
+	    tup->rrname != NULL)
+		want[sp_rrname] = true;
+	if (annoRD != NULL ||
+	    (query != NULL && query->qdetail != NULL &&
+	     (transforms & TRANS_QDETAIL) != 0))
+		want[sp_dnsdbq] = true;
+
+	/* the COF was validated by tuple_make(), so this can't fail. */
+	jscan_init(&js, tup->cof.ptr, tup->cof.len);
+	(void) jscan_object(&js);
+	copied = tup->cof.ptr;
+	while (jscan_member(&js, &key)) {
+		int sp;
+
+		(void) jscan_skip(&js, &val);
+		nmember++;
+		for (sp = 0; sp < sp_count; sp++)
+			if (want[sp] && jspan_eq(key, splice_names[sp]))
+				break;
+		if (sp == sp_count)
+			continue;
+		outbuf_write(out, copied, (size_t)(val.ptr - copied));
+		splice_value(out, (enum splice_e)sp, tup, query, annoRD);
+		copied = val.ptr + val.len;
+		done[sp] = true;
+	}
+	assert(js.err == NULL);
+
+	/* the closing brace is just behind the scanner. */
+	outbuf_write(out, copied, (size_t)(js.ptr - 1 - copied));
+	for (int sp = 0; sp < sp_count; sp++) {
+		if (!want[sp] || done[sp])
+			continue;
+		if (nmember++ != 0)
+			outbuf_putc(out, ',');
+		outbuf_putc(out, '"');
+		outbuf_puts(out, splice_names[sp]);
+		outbuf_puts(out, "\":");
+		splice_value(out, (enum splice_e)sp, tup, query, annoRD);
+	}
+	outbuf_putc(out, '}');
 }
 
-/* annotate_json -- create a temporary copy of a tuple; apply transforms.
+/* splice_value -- write the new value of one spliced member.
  */
-static json_t *
-annotate_json(pdns_tuple_ct tup, query_ct query, bool rd) {
-	json_t *annoRD = NULL, *annoTF = NULL, *annoTL = NULL,
-		*annoZF = NULL, *annoZL = NULL;
+static void
+splice_value(outbuf_t out, enum splice_e sp, pdns_tuple_ct tup,
+	     query_ct query, json_t *annoRD)
+{
+	const char *qdetail = NULL;
 
-	/* annotate zone first/last? */
-	if ((transforms & TRANS_DATEFIX) != 0 &&
-	    tup->obj.zone_first != NULL && tup->obj.zone_last != NULL)
-	{
-		annoZF = json_string_nocheck(time_str(tup->zone_first,
-						      iso8601));
-		annoZL = json_string_nocheck(time_str(tup->zone_last,
-						      iso8601));
+	switch (sp) {
+	case sp_zone_first:
+		outbuf_putc(out, '"');
+		outbuf_time(out, tup->zone_first, iso8601);
+		outbuf_putc(out, '"');
+		break;
+	case sp_zone_last:
+		outbuf_putc(out, '"');
+		outbuf_time(out, tup->zone_last, iso8601);
+		outbuf_putc(out, '"');
+		break;
+	case sp_time_first:
+		outbuf_putc(out, '"');
+		outbuf_time(out, tup->time_first, iso8601);
+		outbuf_putc(out, '"');
+		break;
+	case sp_time_last:
+		outbuf_putc(out, '"');
+		outbuf_time(out, tup->time_last, iso8601);
+		outbuf_putc(out, '"');
+		break;
+	case sp_rrname:
+		json_quote(out, tup->rrname);
+		break;
+	case sp_dnsdbq:
+		if (query != NULL && (transforms & TRANS_QDETAIL) != 0)
+			qdetail = query->qdetail;
+		if (annoRD == NULL) {
+			outbuf_puts(out, qdetail);
+			break;
+		}
+		/* the query's members, then this tuple's "anno". */
+		if (qdetail != NULL) {
+			outbuf_write(out, qdetail, strlen(qdetail) - 1);
+			outbuf_putc(out, ',');
+		} else {
+			outbuf_putc(out, '{');
+		}
+		outbuf_puts(out, "\"anno\":");
+		(void) json_dump_callback(annoRD, json_outbuf, out,
+					  JSON_COMPACT);
+		outbuf_putc(out, '}');
+		break;
+	case sp_count:
+		/* FALLTHROUGH */
+	default:
+		abort();
 	}
+}
 
-	/* annotate time first/last? */
-	if ((transforms & TRANS_DATEFIX) != 0 &&
-	    tup->obj.time_first != NULL && tup->obj.time_last != NULL)
-	{
-		annoTF = json_string_nocheck(time_str(tup->time_first,
-						      iso8601));
-		annoTL = json_string_nocheck(time_str(tup->time_last,
-						      iso8601));
+/* json_quote -- write a C string as a JSON string, escaped as jansson does.
+ */
+static void
+json_quote(outbuf_t out, const char *str) {
+	static const char hex[] = "0123456789abcdef";
+
+	outbuf_putc(out, '"');
+	for (const char *p = str; *p != '\0'; p++) {
+		unsigned char ch = (unsigned char)*p;
+
+		switch (ch) {
+		case '"':	outbuf_puts(out, "\\\""); break;
+		case '\\':	outbuf_puts(out, "\\\\"); break;
+		case '\b':	outbuf_puts(out, "\\b"); break;
+		case '\f':	outbuf_puts(out, "\\f"); break;
+		case '\n':	outbuf_puts(out, "\\n"); break;
+		case '\r':	outbuf_puts(out, "\\r"); break;
+		case '\t':	outbuf_puts(out, "\\t"); break;
+		default:
+			if (ch < 0x20) {
+				outbuf_puts(out, "\\u00");
+				outbuf_putc(out, hex[ch >> 4]);
+				outbuf_putc(out, hex[ch & 0xf]);
+			} else {
+				outbuf_putc(out, (char)ch);
+			}
+		}
 	}
+	outbuf_putc(out, '"');
+}
 
-	/* annotate rdata? */
-	if (rd) {
-		if (json_is_array(tup->obj.rdata)) {
-			size_t index;
-			json_t *rr;
+/* json_outbuf -- json_dump_callback() sink that appends to an outbuf.
+ */
+static int
+json_outbuf(const char *buffer, size_t size, void *data) {
+	outbuf_write((outbuf_t)data, buffer, size);
+	return 0;
+}
 
-			json_array_foreach(tup->obj.rdata, index, rr) {
-				const char *rdata = json_string_value(rr);
-				json_t *asinfo = NULL;
-#ifndef CRIPPLED_LIBC
-				asinfo = annotate_asinfo(tup->rrtype, rdata);
-#endif
-				if (asinfo != NULL)
-					annoRD = annotate_one(annoRD, rdata,
-							      "asinfo", asinfo);
-			}
-		} else {
+/* annotate_rdata -- look up annotations for a tuple's rdata, for -a.
+ *
+ * returns NULL if there were none, else an object keyed by rdata.
+ */
+static json_t *
+annotate_rdata(pdns_tuple_ct tup) {
+	json_t *annoRD = NULL;
+
+	if ((tup->fields & TUP_RDATA_ARRAY) != 0) {
+		for (size_t i = 0; i < tup->nrdata; i++) {
+			const char *rdata = tup->rdatas[i];
 			json_t *asinfo = NULL;
 #ifndef CRIPPLED_LIBC
-			asinfo = annotate_asinfo(tup->rrtype, tup->rdata);
+			asinfo = annotate_asinfo(tup->rrtype, rdata);
 #endif
 			if (asinfo != NULL)
-				annoRD = annotate_one(annoRD, tup->rdata,
+				annoRD = annotate_one(annoRD, rdata,
 						      "asinfo", asinfo);
 		}
-	} //rd?
-
-	/* anything annotated? */
-	if ((annoZF != NULL && annoZL != NULL) ||
-	    (annoTF != NULL && annoTL != NULL) ||
-	    (transforms & (TRANS_REVERSE|TRANS_CHOMP|TRANS_QDETAIL)) != 0 ||
-	    annoRD != NULL)
-	{
-		json_t *copy = json_deep_copy(tup->obj.cof_obj);
+	} else {
+		json_t *asinfo = NULL;
+#ifndef CRIPPLED_LIBC
+		asinfo = annotate_asinfo(tup->rrtype, tup->rdata);
+#endif
+		if (asinfo != NULL)
+			annoRD = annotate_one(annoRD, tup->rdata,
+					      "asinfo", asinfo);
+	}
+	return annoRD;
+}
 
-		if (annoZF != NULL || annoZL != NULL) {
-			json_object_set_new_nocheck(copy, "zone_time_first",
-						    annoZF);
-			json_object_set_new_nocheck(copy, "zone_time_last",
-						    annoZL);
-		}
-		if (annoTF != NULL || annoTL != NULL) {
-			json_object_set_new_nocheck(copy, "time_first",
-						    annoTF);
-			json_object_set_new_nocheck(copy, "time_last",
-						    annoTL);
-		}
-		if ((transforms & (TRANS_REVERSE|TRANS_CHOMP)) != 0)
-			json_object_set_new_nocheck(copy, "rrname",
-						    json_string(tup->rrname));
-
-		if ((transforms & TRANS_QDETAIL) != 0 || annoRD != NULL) {
-			json_t *obj = annotation_json(query, annoRD);
-			if (obj != NULL)
-				json_object_set_new_nocheck(copy, "_dnsdbq",
-							    obj);
-		}
-		return copy;
+/* qdetail_json -- serialize a query's "_dnsdbq" members, for -T qdetail.
+ *
+ * these are the same for every tuple of the query, so this is done once,
+ * by pdns_blob(), and the result is kept in query->qdetail. all of it is
+ * allocated from the writer's arena, and lasts as long as the query.
+ */
+static char *
+qdetail_json(query_ct query) {
+	json_t *obj;
+	char *ret;
+
+	arena_json(query->writer->arena);
+	obj = annotation_json(query);
+	if (obj == NULL) {
+		ret = NULL;
+	} else {
+		ret = json_dumps(obj, JSON_COMPACT);
+		json_decref(obj);
+		if (ret == NULL)
+			my_panic(false, "json_dumps");
 	}
-	return NULL;
+	arena_json(NULL);
+	return ret;
 }
 
 static inline void
@@ -361,7 +540,7 @@ instantiate_json(json_t **objptr) {
 }
 
 static json_t *
-annotation_json(query_ct query, json_t *annoRD) {
+annotation_json(query_ct query) {
 	json_t *obj = NULL;
 
 	if (query != NULL && (transforms & TRANS_QDETAIL) != 0) {
@@ -390,10 +569,6 @@ annotation_json(query_ct query, json_t *annoRD) {
 		json_object_set_new_nocheck(obj, "complete",
 					    json_boolean(query->qp.complete));
 	}
-	if (annoRD != NULL) {
-		instantiate_json(&obj);
-		json_object_set_new_nocheck(obj, "anno", annoRD);
-	}
 	return obj;
 }
 
@@ -451,70 +626,58 @@ present_csv_lookup(pdns_tuple_ct tup,
 		   writer_t writer)
 {
 	if (!writer->csv_headerp) {
-		printf("time_first,time_last,zone_first,zone_last,"
-		       "count,bailiwick,"
-		       "rrname,rrtype,rdata");
+		outbuf_puts(writer->out,
+			    "time_first,time_last,zone_first,zone_last,"
+			    "count,bailiwick,"
+			    "rrname,rrtype,rdata");
 		if (asinfo_lookup)
-			fputs(",asnum,cidr", stdout);
-		putchar('\n');
+			outbuf_puts(writer->out, ",asnum,cidr");
+		outbuf_putc(writer->out, '\n');
 		writer->csv_headerp = true;
 	}
 
-	if (json_is_array(tup->obj.rdata)) {
-		size_t index;
-		json_t *rr;
-
-		json_array_foreach(tup->obj.rdata, index, rr) {
-			const char *rdata = NULL;
+	if ((tup->fields & TUP_RDATA_ARRAY) != 0) {
+		for (size_t i = 0; i < tup->nrdata; i++) {
+			const char *rdata = tup->rdatas[i];
 
-			if (json_is_string(rr))
-				rdata = json_string_value(rr);
-			else
+			if (rdata == NULL)
 				rdata = "[bad value]";
-			present_csv_line(tup, rdata);
+			present_csv_line(writer->out, tup, rdata);
 		}
 	} else {
-		present_csv_line(tup, tup->rdata);
+		present_csv_line(writer->out, tup, tup->rdata);
 	}
 }
 
 /* present_csv_line -- display a CSV for one rdatum out of an rrset.
  */
 static void
-present_csv_line(pdns_tuple_ct tup, const char *rdata) {
+present_csv_line(outbuf_t out, pdns_tuple_ct tup, const char *rdata) {
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL)
-		printf("\"%s\"", time_str(tup->time_first, iso8601));
-	putchar(',');
-	if (tup->obj.time_last != NULL)
-		printf("\"%s\"", time_str(tup->time_last, iso8601));
-	putchar(',');
-	if (tup->obj.zone_first != NULL)
-		printf("\"%s\"", time_str(tup->zone_first, iso8601));
-	putchar(',');
-	if (tup->obj.zone_last != NULL)
-		printf("\"%s\"", time_str(tup->zone_last, iso8601));
-	putchar(',');
+	present_csv_time(out, tup, TUP_TIME_FIRST, tup->time_first);
+	present_csv_time(out, tup, TUP_TIME_LAST, tup->time_last);
+	present_csv_time(out, tup, TUP_ZONE_FIRST, tup->zone_first);
+	present_csv_time(out, tup, TUP_ZONE_LAST, tup->zone_last);
 
 	/* Count and bailiwick. */
-	if (tup->obj.count != NULL)
-		printf("%lld", (long long) tup->count);
-	putchar(',');
-	if (tup->obj.bailiwick != NULL)
-		printf("\"%s\"", tup->bailiwick);
-	putchar(',');
+	if ((tup->fields & TUP_COUNT) != 0)
+		outbuf_putll(out, (long long) tup->count);
+	outbuf_putc(out, ',');
+	if ((tup->fields & TUP_BAILIWICK) != 0)
+		present_csv_quoted(out, tup->bailiwick);
+	outbuf_putc(out, ',');
 
 	/* Records. */
-	if (tup->obj.rrname != NULL)
-		printf("\"%s\"", tup->rrname);
-	putchar(',');
-	if (tup->obj.rrtype != NULL)
-		printf("\"%s\"", tup->rrtype);
-	putchar(',');
-	if (tup->obj.rdata != NULL)
-		printf("\"%s\"", rdata);
-	if (asinfo_lookup && tup->obj.rrtype != NULL &&
-	    tup->obj.rdata != NULL) {
+	if ((tup->fields & TUP_RRNAME) != 0)
+		present_csv_quoted(out, tup->rrname);
+	outbuf_putc(out, ',');
+	if ((tup->fields & TUP_RRTYPE) != 0)
+		present_csv_quoted(out, tup->rrtype);
+	outbuf_putc(out, ',');
+	if ((tup->fields & TUP_RDATA) != 0)
+		present_csv_quoted(out, rdata);
+	if (asinfo_lookup && (tup->fields & TUP_RRTYPE) != 0 &&
+	    (tup->fields & TUP_RDATA) != 0) {
 		char *asnum = NULL, *cidr = NULL, *result = NULL;
 
 #ifndef CRIPPLED_LIBC
@@ -525,18 +688,39 @@ present_csv_line(pdns_tuple_ct tup, const char *rdata) {
 			cidr = result;
 			result = NULL;
 		}
-		putchar(',');
+		outbuf_putc(out, ',');
 		if (asnum != NULL) {
-			printf("\"%s\"", asnum);
+			present_csv_quoted(out, asnum);
 			free(asnum);
 		}
-		putchar(',');
+		outbuf_putc(out, ',');
 		if (cidr != NULL) {
-			printf("\"%s\"", cidr);
+			present_csv_quoted(out, cidr);
 			free(cidr);
 		}
 	}
-	putchar('\n');
+	outbuf_putc(out, '\n');
+}
+
+/* present_csv_time -- display one CSV timestamp, if present, and its comma.
+ */
+static void
+present_csv_time(outbuf_t out, pdns_tuple_ct tup, unsigned field, u_long t) {
+	if ((tup->fields & field) != 0) {
+		outbuf_putc(out, '"');
+		outbuf_time(out, t, iso8601);
+		outbuf_putc(out, '"');
+	}
+	outbuf_putc(out, ',');
+}
+
+/* present_csv_quoted -- display one CSV string, in double quotes.
+ */
+static void
+present_csv_quoted(outbuf_t out, const char *str) {
+	outbuf_putc(out, '"');
+	outbuf_puts(out, str);
+	outbuf_putc(out, '"');
 }
 
 /* present_minimal_lookup -- render one DNSDB tuple as a "line"
@@ -544,7 +728,7 @@ present_csv_line(pdns_tuple_ct tup, const char *rdata) {
 void
 present_minimal_lookup(pdns_tuple_ct tup,
 		       query_ct query,
-		       writer_t writer __attribute__ ((unused)))
+		       writer_t writer)
 {
 	/* here is why this presenter is incompatible with sorting. */
 	assert(query != NULL);
@@ -568,33 +752,30 @@ present_minimal_lookup(pdns_tuple_ct tup,
 
 	/* for RHS queries, output the LHS once, and exit. */
 	if (!left) {
-		present_minimal_thing(tup->rrname);
+		present_minimal_thing(writer->out, tup->rrname);
 		return;
 	}
 
 	/* for LHS queries, output each RHS found. */
-	if (json_is_array(tup->obj.rdata)) {
-		size_t index;
-		json_t *rr;
-
-		json_array_foreach(tup->obj.rdata, index, rr) {
-			const char *rdata = NULL;
+	if ((tup->fields & TUP_RDATA_ARRAY) != 0) {
+		for (size_t i = 0; i < tup->nrdata; i++) {
+			const char *rdata = tup->rdatas[i];
 
-			if (json_is_string(rr))
-				rdata = json_string_value(rr);
-			else
+			if (rdata == NULL)
 				rdata = "[bad value]";
-			present_minimal_thing(rdata);
+			present_minimal_thing(writer->out, rdata);
 		}
 	} else {
-		present_minimal_thing(tup->rdata);
+		present_minimal_thing(writer->out, tup->rdata);
 	}
 }
 
 static void
-present_minimal_thing(const char *thing) {
-	if (!deduper_tas(minimal_deduper, thing))
-		puts(thing);
+present_minimal_thing(outbuf_t out, const char *thing) {
+	if (!deduper_tas(minimal_deduper, thing)) {
+		outbuf_puts(out, thing);
+		outbuf_putc(out, '\n');
+	}
 }
 
 /* present_csv_summarize -- render a summarize result as CSV.
@@ -602,88 +783,112 @@ present_minimal_thing(const char *thing) {
 void
 present_csv_summarize(pdns_tuple_ct tup,
 		      query_ct query __attribute__ ((unused)),
-		      writer_t writer __attribute__ ((unused)))
+		      writer_t writer)
 {
-	printf("time_first,time_last,zone_first,zone_last,"
-	       "count,num_results\n");
+	outbuf_t out = writer->out;
+
+	outbuf_puts(out, "time_first,time_last,zone_first,zone_last,"
+		    "count,num_results\n");
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL)
-		printf("\"%s\"", time_str(tup->time_first, iso8601));
-	putchar(',');
-	if (tup->obj.time_last != NULL)
-		printf("\"%s\"", time_str(tup->time_last, iso8601));
-	putchar(',');
-	if (tup->obj.zone_first != NULL)
-		printf("\"%s\"", time_str(tup->zone_first, iso8601));
-	putchar(',');
-	if (tup->obj.zone_last != NULL)
-		printf("\"%s\"", time_str(tup->zone_last, iso8601));
-	putchar(',');
+	present_csv_time(out, tup, TUP_TIME_FIRST, tup->time_first);
+	present_csv_time(out, tup, TUP_TIME_LAST, tup->time_last);
+	present_csv_time(out, tup, TUP_ZONE_FIRST, tup->zone_first);
+	present_csv_time(out, tup, TUP_ZONE_LAST, tup->zone_last);
 
 	/* Count and num_results. */
-	if (tup->obj.count != NULL)
-		printf("%lld", (long long) tup->count);
-	putchar(',');
-	if (tup->obj.num_results != NULL)
-		printf("%lld", tup->num_results);
-	putchar('\n');
+	if ((tup->fields & TUP_COUNT) != 0)
+		outbuf_putll(out, (long long) tup->count);
+	outbuf_putc(out, ',');
+	if ((tup->fields & TUP_NUM_RESULTS) != 0)
+		outbuf_putll(out, tup->num_results);
+	outbuf_putc(out, '\n');
 }
 
-/* tuple_make -- create one DNSDB tuple object out of a JSON object.
+/* tuple_make -- create one DNSDB tuple object out of a line of JSON.
  */
 const char *
 tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
 	const char *msg = NULL;
-	json_error_t error;
+	struct jspan key, str;
+	struct jscan js;
+	char *next;
 
 	memset(tup, 0, sizeof *tup);
 	DEBUG(4, true, "[%d] '%-*.*s'\n", (int)len, (int)len, (int)len, buf);
-	tup->obj.main = json_loadb(buf, len, 0, &error);
-	if (tup->obj.main == NULL) {
-		my_logf("warning: json_loadb: %d:%d: %s %s",
-			error.line, error.column,
-			error.text, error.source);
-		abort();
-	}
 	if (debug_level >= 4) {
-		char *pretty = json_dumps(tup->obj.main, JSON_INDENT(2));
-		my_logf("%s", pretty);
-		free(pretty);
+		json_t *main = json_loadb(buf, len, 0, NULL);
+		if (main != NULL) {
+			char *pretty = json_dumps(main, JSON_INDENT(2));
+			my_logf("%s", pretty);
+			free(pretty);
+			json_decref(main);
+		}
+	}
+
+	/* no unescaped string is longer than it was with its quotes. */
+	next = arena_alloc(line_arena, len + 1);
+	jscan_init(&js, buf, len);
+
+	switch (jscan_peek(&js)) {
+	case jt_object:
+		break;
+	case jt_array:
+		/* valid, but it has nothing we'd look for. */
+		(void) jscan_skip(&js, psys->encap == encap_cof ?
+				  &tup->cof : NULL);
+		goto done;
+	case jt_error:
+		goto done;
+	case jt_string:
+	case jt_number:
+	case jt_true:
+	case jt_false:
+	case jt_null:
+		/* FALLTHROUGH */
+	default:
+		msg = "JSON text must be an object or array";
+		goto ouch;
 	}
 
 	switch (psys->encap) {
 	case encap_cof:
 		/* the COF just is the JSON object. */
-		tup->obj.cof_obj = tup->obj.main;
+		if ((msg = tuple_cof_scan(tup, &js, &next)) != NULL)
+			goto ouch;
 		break;
 	case encap_saf:
 		/* the COF is embedded in the JSONL object. */
-		tup->obj.saf_cond = json_object_get(tup->obj.main, "cond");
-		if (tup->obj.saf_cond != NULL) {
-			if (!json_is_string(tup->obj.saf_cond)) {
-				msg = "cond must be a string";
-				goto ouch;
-			}
-			tup->cond = json_string_value(tup->obj.saf_cond);
-		}
-
-		tup->obj.saf_msg = json_object_get(tup->obj.main, "msg");
-		if (tup->obj.saf_msg != NULL) {
-			if (!json_is_string(tup->obj.saf_msg)) {
-				msg = "msg must be a string";
-				goto ouch;
-			}
-			tup->msg = json_string_value(tup->obj.saf_msg);
-		}
-
-		tup->obj.saf_obj = json_object_get(tup->obj.main, "obj");
-		if (tup->obj.saf_obj != NULL) {
-			if (!json_is_object(tup->obj.saf_obj)) {
-				msg = "obj must be an object";
-				goto ouch;
+		(void) jscan_object(&js);
+		while (jscan_member(&js, &key)) {
+			if (jspan_eq(key, "cond")) {
+				if (jscan_peek(&js) != jt_string) {
+					msg = "cond must be a string";
+					goto ouch;
+				}
+				(void) jscan_string(&js, &str);
+				tup->cond = next;
+				next = jspan_unescape(next, str);
+			} else if (jspan_eq(key, "msg")) {
+				if (jscan_peek(&js) != jt_string) {
+					msg = "msg must be a string";
+					goto ouch;
+				}
+				(void) jscan_string(&js, &str);
+				tup->msg = next;
+				next = jspan_unescape(next, str);
+			} else if (jspan_eq(key, "obj")) {
+				if (jscan_peek(&js) != jt_object) {
+					msg = "obj must be an object";
+					goto ouch;
+				}
+				msg = tuple_cof_scan(tup, &js, &next);
+				if (msg != NULL)
+					goto ouch;
+				tup->fields |= TUP_OBJ;
+			} else {
+				(void) jscan_skip(&js, NULL);
 			}
-			tup->obj.cof_obj = tup->obj.saf_obj;
 		}
 		break;
 	default:
@@ -691,127 +896,34 @@ tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
 		abort();
 	}
 
-	/* Timestamps. */
-	tup->obj.zone_first = json_object_get(tup->obj.cof_obj,
-					      "zone_time_first");
-	if (tup->obj.zone_first != NULL) {
-		if (!json_is_integer(tup->obj.zone_first)) {
-			msg = "zone_time_first must be an integer";
-			goto ouch;
-		}
-		tup->zone_first = (u_long)
-			json_integer_value(tup->obj.zone_first);
-	}
-	tup->obj.zone_last =
-		json_object_get(tup->obj.cof_obj, "zone_time_last");
-	if (tup->obj.zone_last != NULL) {
-		if (!json_is_integer(tup->obj.zone_last)) {
-			msg = "zone_time_last must be an integer";
-			goto ouch;
-		}
-		tup->zone_last = (u_long)
-			json_integer_value(tup->obj.zone_last);
-	}
-	tup->obj.time_first = json_object_get(tup->obj.cof_obj, "time_first");
-	if (tup->obj.time_first != NULL) {
-		if (!json_is_integer(tup->obj.time_first)) {
-			msg = "time_first must be an integer";
-			goto ouch;
-		}
-		tup->time_first = (u_long)
-			json_integer_value(tup->obj.time_first);
-	}
-	tup->obj.time_last = json_object_get(tup->obj.cof_obj, "time_last");
-	if (tup->obj.time_last != NULL) {
-		if (!json_is_integer(tup->obj.time_last)) {
-			msg = "time_last must be an integer";
-			goto ouch;
-		}
-		tup->time_last = (u_long)
-			json_integer_value(tup->obj.time_last);
-	}
-
-	/* Count. */
-	tup->obj.count = json_object_get(tup->obj.cof_obj, "count");
-	if (tup->obj.count != NULL) {
-		if (!json_is_integer(tup->obj.count)) {
-			msg = "count must be an integer";
-			goto ouch;
-		}
-		tup->count = json_integer_value(tup->obj.count);
-	}
-	/* Bailiwick. */
-	tup->obj.bailiwick = json_object_get(tup->obj.cof_obj, "bailiwick");
-	if (tup->obj.bailiwick != NULL) {
-		if (!json_is_string(tup->obj.bailiwick)) {
-			msg = "bailiwick must be a string";
-			goto ouch;
-		}
-		tup->bailiwick = json_string_value(tup->obj.bailiwick);
-	}
-	/* num_results -- just for a summarize. */
-	tup->obj.num_results =
-		json_object_get(tup->obj.cof_obj, "num_results");
-	if (tup->obj.num_results != NULL) {
-		if (!json_is_integer(tup->obj.num_results)) {
-			msg = "num_results must be an integer";
-			goto ouch;
-		}
-		tup->num_results = json_integer_value(tup->obj.num_results);
+ done:
+	if (!jscan_end(&js)) {
+		msg = js.err;
+		goto ouch;
 	}
 
 	/* Records. */
-	tup->obj.rrname = json_object_get(tup->obj.cof_obj, "rrname");
-	if (tup->obj.rrname != NULL) {
-		if (!json_is_string(tup->obj.rrname)) {
-			msg = "rrname must be a string";
-			goto ouch;
-		}
-
-		char *r = strdup(json_string_value(tup->obj.rrname));
-		int dot = 0;
+	if ((tup->fields & TUP_RRNAME) != 0 &&
+	    (transforms & (TRANS_REVERSE|TRANS_CHOMP)) != 0)
+	{
+		char *r;
 
 		if ((transforms & TRANS_REVERSE) != 0) {
-			char *t = reverse(r);
-			DESTROY(r);
-			r = t;
-			t = NULL;
-			/* leading dot comes from reverse() */
+			r = reverse(tup->orig_rrname);
+			/* in chomp+reverse, the dot to chomp is now leading. */
 			if ((transforms & TRANS_CHOMP) != 0)
-				dot = 1;
-		} else if ((transforms & TRANS_CHOMP) != 0) {
+				r++;
+		} else {
 			/* unescaped trailing dot? */
+			r = arena_strdup(line_arena, tup->orig_rrname);
 			size_t l = strlen(r);
 			if (l > 0 && r[l-1] == '.' &&
 			    (l == 1 || r[l-2] != '\\'))
 				r[l-1] = '\0';
 		}
-
-		if (dot) {
-			/* in chomp+reverse, the dot to chomp is now leading. */
-			tup->rrname = strdup(r + dot);
-			DESTROY(r);
-		} else {
-			tup->rrname = r;
-		}
-	}
-	tup->obj.rrtype = json_object_get(tup->obj.cof_obj, "rrtype");
-	if (tup->obj.rrtype != NULL) {
-		if (!json_is_string(tup->obj.rrtype)) {
-			msg = "rrtype must be a string";
-			goto ouch;
-		}
-		tup->rrtype = json_string_value(tup->obj.rrtype);
-	}
-	tup->obj.rdata = json_object_get(tup->obj.cof_obj, "rdata");
-	if (tup->obj.rdata != NULL) {
-		if (json_is_string(tup->obj.rdata)) {
-			tup->rdata = json_string_value(tup->obj.rdata);
-		} else if (!json_is_array(tup->obj.rdata)) {
-			msg = "rdata must be a string or array";
-			goto ouch;
-		}
-		/* N.b., the array case is for the consumer to iterate over. */
+		tup->rrname = r;
+	} else {
+		tup->rrname = tup->orig_rrname;
 	}
 
 	assert(msg == NULL);
@@ -819,19 +931,194 @@ tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
 
  ouch:
 	assert(msg != NULL);
-	tuple_unmake(tup);
 	return msg;
 }
 
-/* tuple_unmake -- deallocate the heap storage associated with one tuple.
+/* the COF members that a tuple keeps, by the TUP_* bit each one sets. */
+static const struct cof_name {
+	const char	*name;
+	size_t		len;
+	unsigned	field;
+} cof_names[] = {
+#define COF_NAME(name, field) { name, sizeof name - 1, field }
+	COF_NAME("rrname", TUP_RRNAME),
+	COF_NAME("rrtype", TUP_RRTYPE),
+	COF_NAME("rdata", TUP_RDATA),
+	COF_NAME("count", TUP_COUNT),
+	COF_NAME("time_first", TUP_TIME_FIRST),
+	COF_NAME("time_last", TUP_TIME_LAST),
+	COF_NAME("bailiwick", TUP_BAILIWICK),
+	COF_NAME("zone_time_first", TUP_ZONE_FIRST),
+	COF_NAME("zone_time_last", TUP_ZONE_LAST),
+	COF_NAME("num_results", TUP_NUM_RESULTS),
+#undef COF_NAME
+};
+
+/* cof_member -- map a member name to its TUP_* bit, or 0 if not kept.
+ *
+ * names with escapes are rare enough to leave to jspan_eq(); the rest are
+ * matched on length first, so most names cost a single memcmp().
  */
-void
-tuple_unmake(pdns_tuple_t tup) {
-	DESTROY(tup->rrname);
-	json_decref(tup->obj.main);
+static unsigned
+cof_member(struct jspan key) {
+	for (size_t i = 0; i < sizeof cof_names / sizeof cof_names[0]; i++) {
+		const struct cof_name *cn = &cof_names[i];
+
+		if (key.escaped) {
+			if (jspan_eq(key, cn->name))
+				return cn->field;
+		} else if (key.len == cn->len &&
+			   memcmp(key.ptr, cn->name, cn->len) == 0) {
+			return cn->field;
+		}
+	}
+	return 0;
+}
+
+/* tuple_cof_scan -- scan a COF object's members into a tuple.
+ *
+ * unescaped strings are appended at *nextp.
+ */
+static const char *
+tuple_cof_scan(pdns_tuple_t tup, struct jscan *js, char **nextp) {
+	const char *start;
+	struct jspan key, str;
+	long long val;
+	size_t size = 0;
+
+	/* a repeated object replaces what came before, as it would in a DOM. */
+	tup->fields = 0;
+	tup->nrdata = 0;
+	(void) jscan_object(js);
+	start = js->ptr - 1;
+	while (jscan_member(js, &key)) {
+		switch (cof_member(key)) {
+		/* Timestamps. */
+		case TUP_ZONE_FIRST:
+			if (!jscan_integer(js, &val))
+				return "zone_time_first must be an integer";
+			tup->zone_first = (u_long)val;
+			tup->fields |= TUP_ZONE_FIRST;
+			break;
+		case TUP_ZONE_LAST:
+			if (!jscan_integer(js, &val))
+				return "zone_time_last must be an integer";
+			tup->zone_last = (u_long)val;
+			tup->fields |= TUP_ZONE_LAST;
+			break;
+		case TUP_TIME_FIRST:
+			if (!jscan_integer(js, &val))
+				return "time_first must be an integer";
+			tup->time_first = (u_long)val;
+			tup->fields |= TUP_TIME_FIRST;
+			break;
+		case TUP_TIME_LAST:
+			if (!jscan_integer(js, &val))
+				return "time_last must be an integer";
+			tup->time_last = (u_long)val;
+			tup->fields |= TUP_TIME_LAST;
+			break;
+		/* Count. */
+		case TUP_COUNT:
+			if (!jscan_integer(js, &val))
+				return "count must be an integer";
+			tup->count = (json_int_t)val;
+			tup->fields |= TUP_COUNT;
+			break;
+		/* num_results -- just for a summarize. */
+		case TUP_NUM_RESULTS:
+			if (!jscan_integer(js, &val))
+				return "num_results must be an integer";
+			tup->num_results = (json_int_t)val;
+			tup->fields |= TUP_NUM_RESULTS;
+			break;
+		/* Bailiwick. */
+		case TUP_BAILIWICK:
+			if (jscan_peek(js) != jt_string)
+				return "bailiwick must be a string";
+			(void) jscan_string(js, &str);
+			tup->bailiwick = *nextp;
+			*nextp = jspan_unescape(*nextp, str);
+			tup->fields |= TUP_BAILIWICK;
+			break;
+		/* Records. */
+		case TUP_RRNAME:
+			if (jscan_peek(js) != jt_string)
+				return "rrname must be a string";
+			(void) jscan_string(js, &str);
+			tup->orig_rrname = *nextp;
+			*nextp = jspan_unescape(*nextp, str);
+			tup->fields |= TUP_RRNAME;
+			break;
+		case TUP_RRTYPE:
+			if (jscan_peek(js) != jt_string)
+				return "rrtype must be a string";
+			(void) jscan_string(js, &str);
+			tup->rrtype = *nextp;
+			*nextp = jspan_unescape(*nextp, str);
+			tup->fields |= TUP_RRTYPE;
+			break;
+		case TUP_RDATA:
+			switch (jscan_peek(js)) {
+			case jt_string:
+				(void) jscan_string(js, &str);
+				tup->rdata = *nextp;
+				*nextp = jspan_unescape(*nextp, str);
+				tup->fields &= ~(unsigned)TUP_RDATA_ARRAY;
+				tup->fields |= TUP_RDATA;
+				break;
+			case jt_array:
+				tup->rdata = NULL;
+				tup->nrdata = 0;
+				(void) jscan_array(js);
+				while (jscan_element(js)) {
+					const char *rdata = NULL;
+
+					if (jscan_peek(js) == jt_string) {
+						(void) jscan_string(js, &str);
+						rdata = *nextp;
+						*nextp = jspan_unescape(*nextp,
+									str);
+					} else {
+						(void) jscan_skip(js, NULL);
+					}
+					if (tup->nrdata == size) {
+						tup->rdatas = arena_grow(
+							line_arena, tup->rdatas,
+							size * sizeof(char *),
+							(size == 0 ? 4 : size * 2) *
+							sizeof(char *));
+						size = size == 0 ? 4 : size * 2;
+					}
+					tup->rdatas[tup->nrdata++] = rdata;
+				}
+				tup->fields |= TUP_RDATA|TUP_RDATA_ARRAY;
+				break;
+			case jt_error:
+				break;
+			case jt_object:
+			case jt_number:
+			case jt_true:
+			case jt_false:
+			case jt_null:
+				/* FALLTHROUGH */
+			default:
+				return "rdata must be a string or array";
+			}
+			break;
+		default:
+			(void) jscan_skip(js, NULL);
+			break;
+		}
+	}
+	tup->cof.ptr = start;
+	tup->cof.len = (size_t)(js->ptr - start);
+	return NULL;
 }
 
 /* countoff{_r,_debug} -- count and map the labels in a DNS name.
+ *
+ * the map is allocated from the line arena.
  */
 static struct counted *
 countoff_r(const char *src, int nlabel) {
@@ -867,7 +1154,7 @@ countoff_r(const char *src, int nlabel) {
 		len--; /*'\0'*/
 		if (len != 0)
 			nlabel++;
-		c = (struct counted *)malloc(COUNTED_SIZE(nlabel));
+		c = arena_alloc(line_arena, COUNTED_SIZE(nlabel));
 		memset(c, 0, COUNTED_SIZE(nlabel));
 		c->nlabel = nlabel;
 		c->nalnum = nalnum;
@@ -900,12 +1187,12 @@ countoff_debug(const char *place, const char *thing, const struct counted *c) {
 
 /* reverse -- put a domain name into TLD-first order.
  *
- * returns NULL if errno is set, else, a heap string.
+ * returns a string allocated from the line arena.
  */
 char *
 reverse(const char *src) {
 	struct counted *c = countoff(src);
-	char *ret = malloc(c->nchar + 1/*'.'*/ + 1/*'\0'*/);
+	char *ret = arena_alloc(line_arena, c->nchar + 1/*'.'*/ + 1/*'\0'*/);
 	char *p = ret;
 	size_t nchar = 0;
 
@@ -918,17 +1205,17 @@ reverse(const char *src) {
 		nchar += c->lens[i];
 	}
 	*p = '\0';
-	DESTROY(c);
 	return ret;
 }
 
 /* pdns_blob -- process one deblocked json pdns blob as a counted string.
  *
- * presents, or outputs to POSIX sort(1), the blob, and then frees it.
+ * presents, or gives to the writer's sorter, the blob. whatever this allocates
+ * is on the line arena, which the caller resets.
  * returns number of tuples processed (for now, 1 or 0).
  */
 int
-pdns_blob(fetch_t fetch, size_t len) {
+pdns_blob(fetch_t fetch, const char *buf, size_t len) {
 	query_t query = fetch->query;
 	writer_t writer = query->writer;
 	struct pdns_tuple tup;
@@ -936,10 +1223,10 @@ pdns_blob(fetch_t fetch, size_t len) {
 	const char *msg;
 	int ret = 0;
 
-	msg = tuple_make(&tup, fetch->buf, len);
+	msg = tuple_make(&tup, buf, len);
 	if (msg != NULL) {
 		my_logf("%s", msg);
-		goto more;
+		goto next;
 	}
 
 	if (psys->encap == encap_saf) {
@@ -979,7 +1266,7 @@ pdns_blob(fetch_t fetch, size_t len) {
 		/* A COF keepalive will have no "obj"
 		 * but may have a "cond" or "msg".
 		 */
-		if (tup.obj.saf_obj == NULL) {
+		if ((tup.fields & TUP_OBJ) == 0) {
 			DEBUG(4, true,
 			      "COF object is empty, i.e. a keepalive\n");
 			goto next;
@@ -997,53 +1284,96 @@ pdns_blob(fetch_t fetch, size_t len) {
 		last = (u_long)tup.zone_last;
 	}
 
+	/* a -W window keeps only what was first seen within it; the server
+	 * was asked for a little more, see launch_windows(). what's dropped
+	 * still counts as delivered, since retries resume by offset.
+	 */
+	if ((fetch->window_lo != 0 && first < fetch->window_lo) ||
+	    (fetch->window_hi != 0 && first >= fetch->window_hi))
+	{
+		DEBUG(3, true, "outside window [%lu..%lu): %lu\n",
+		      fetch->window_lo, fetch->window_hi, first);
+		fetch->delivered++;
+		goto next;
+	}
+
 	if (sorting != no_sort) {
-		/* POSIX sort(1) is given six extra fields at the front
-		 * of each line (first,last,duration,count,name,data)
-		 * which are accessed as -k1 .. -k7 on the
-		 * sort command line. we strip them off later
-		 * when reading the result back. the reason
-		 * for all this PDP11-era logic is to avoid
-		 * having to store the full result in memory.
-		 */
-		char *dyn_rrname = sortable_rrname(&tup),
-			*dyn_rdata = sortable_rdata(&tup);
-
-		DEBUG(3, true, "dyn_rrname = '%s'\n", dyn_rrname);
-		DEBUG(3, true, "dyn_rdata = '%s'\n", dyn_rdata);
-		fprintf(writer->sort_stdin,
-			"%lu %lu %lu %lu %s %s %s %*.*s\n",
-			(unsigned long)first,
-			(unsigned long)last,
-			(unsigned long)(last - first),
-			(unsigned long)tup.count,
-			or_else(dyn_rrname, "n/a"),
-			tup.rrtype,
-			or_else(dyn_rdata, "n/a"),
-			(int)len, (int)len, fetch->buf);
-		DEBUG(2, true, "sort0: '%lu %lu %lu %lu %s %s %s %*.*s'\n",
-		      (unsigned long)first,
-		      (unsigned long)last,
-		      (unsigned long)(last - first),
-		      (unsigned long)tup.count,
-		      or_else(dyn_rrname, "n/a"),
-		      tup.rrtype,
-		      or_else(dyn_rdata, "n/a"),
-		      (int)len, (int)len, fetch->buf);
-		DESTROY(dyn_rrname);
-		DESTROY(dyn_rdata);
-	} else {
-		/* before the sort, we know the query that caused the tuple. */
-		(*presenter->output)(&tup, query, writer);
+		sorter_add(writer->sorter, &tup, buf, len, first, last);
+		/* its ASINFO lookups can be in flight while the rest comes. */
+		if (writer->output_limit <= 0)
+			(void) pdns_asinfo(query, &tup, buf, len);
+	} else if (!pdns_asinfo(query, &tup, buf, len)) {
+		pdns_output(query, &tup);
 	}
 
 	ret = 1;
  next:
-	tuple_unmake(&tup);
- more:
 	return ret;
 }
 
+/* pdns_present -- present a line that pdns_blob() had the writer hold.
+ *
+ * whatever this allocates is on the line arena, which the caller resets.
+ */
+void
+pdns_present(query_t query, const char *buf, size_t len) {
+	struct pdns_tuple tup;
+	const char *msg;
+
+	msg = tuple_make(&tup, buf, len);
+	if (msg != NULL) {
+		my_logf("%s", msg);
+		return;
+	}
+	pdns_output(query, &tup);
+}
+
+/* pdns_output -- present one tuple, knowing the query that caused it.
+ */
+static void
+pdns_output(query_t query, pdns_tuple_ct tup) {
+	/* before the sort, we know the query that caused the tuple. */
+	if ((transforms & TRANS_QDETAIL) != 0 && query->qdetail == NULL)
+		query->qdetail = qdetail_json(query);
+	arena_json(line_arena);
+	(*presenter->output)(tup, query, query->writer);
+	arena_json(NULL);
+}
+
+/* pdns_asinfo -- start a tuple's ASINFO lookups, if -a wants any.
+ *
+ * returns true if the writer is to hold the line until they're done,
+ * which is also so if it's holding any line that came before this one.
+ */
+static bool
+pdns_asinfo(query_t query, pdns_tuple_ct tup, const char *buf, size_t len) {
+	bool array = (tup->fields & TUP_RDATA_ARRAY) != 0;
+	size_t nrdata = array ? tup->nrdata : 1, nlookup = 0;
+	writer_t writer = query->writer;
+	asinfo_t *lookups;
+
+	if (!asinfo_lookup || !presenter->asinfo)
+		return false;
+	if ((tup->fields & TUP_RRTYPE) == 0 || (tup->fields & TUP_RDATA) == 0)
+		nrdata = 0;
+	lookups = arena_alloc(line_arena, nrdata * sizeof *lookups);
+	for (size_t i = 0; i < nrdata; i++) {
+		const char *rdata = array ? tup->rdatas[i] : tup->rdata;
+		asinfo_t a = NULL;
+
+#ifndef CRIPPLED_LIBC
+		if (rdata != NULL)
+			a = asinfo_start(tup->rrtype, rdata);
+#endif
+		if (a != NULL)
+			lookups[nlookup++] = a;
+	}
+	if (sorting != no_sort || (nlookup == 0 && writer->held == NULL))
+		return false;
+	writer_hold(writer, query, lookups, nlookup, buf, len);
+	return true;
+}
+
 /* pick_system -- find a named system descriptor, return t/f as to "found?"
  *
  * returns if psys != NULL, or exits fatally otherwise.
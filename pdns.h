@@ -19,43 +19,49 @@
 
 #include <jansson.h>
 #include "netio.h"
+#include "jscan.h"
 
-/* ".main" is the primary jansson library object from a json_loadb().
- * all the other fields in this structure will point inside main, as
- * borrowed references, so const.  main must be deallocated
- * by json_decref() which then invalidates all the other fields.
+/* a tuple is scanned from one line of JSON by tuple_make(), which keeps
+ * only what the presenters and the sort keys need. "fields" says which
+ * members were present. ".cof" is the span of the COF object within the
+ * line (for SAF, the "obj" member; else the whole line), which JSON output
+ * copies or splices from. the line must outlive the tuple.
  *
- * ".cof_obj" points to the object that contains time_first...num_results.
- * If not using SAF encapulation, then cof_obj points to main.
- * If using SAF encapulation, then saf_cond, saf_msg, and saf_obj are
- * parsed from main and cof_obj is repointed to saf_obj.
+ * the strings are unescaped copies. they, and anything else that a tuple
+ * points to, are allocated from the line arena, and go away with the next
+ * arena_reset(line_arena). tup->orig_rrname is always original, and
+ * tup->rrname is sometimes reversed or chomped.
  *
- * tup->obj.rrname is always original, tup->rrname is sometimes reversed.
- * as a result, tup->rrname is always heap-allocated, even if unreversed.
+ * an rdata member that is an array is kept in .rdatas/.nrdata, where any
+ * element that isn't a string is NULL; a plain string goes in .rdata.
  */
-struct pdns_json {
-	json_t *main;
-	const json_t *cof_obj, *saf_obj, *saf_cond, *saf_msg,
-		*time_first, *time_last, *zone_first, *zone_last,
-		*bailiwick, *rrname, *rrtype, *rdata,
-		*count, *num_results;
-};
+#define	TUP_TIME_FIRST	0x0001
+#define	TUP_TIME_LAST	0x0002
+#define	TUP_ZONE_FIRST	0x0004
+#define	TUP_ZONE_LAST	0x0008
+#define	TUP_COUNT	0x0010
+#define	TUP_NUM_RESULTS	0x0020
+#define	TUP_BAILIWICK	0x0040
+#define	TUP_RRNAME	0x0080
+#define	TUP_RRTYPE	0x0100
+#define	TUP_RDATA	0x0200
+#define	TUP_RDATA_ARRAY	0x0400
+#define	TUP_OBJ		0x0800
+#define	TUP_HAS(tup, bits) (((tup)->fields & (bits)) == (bits))
 
 struct pdns_tuple {
-	struct pdns_json  obj;
+	unsigned	  fields;
+	struct jspan	  cof;
 	u_long		  time_first, time_last, zone_first, zone_last;
 	const char	 *bailiwick, *rrtype, *rdata, *cond, *msg;
-	char		 *rrname;
+	char		 *orig_rrname, *rrname;
+	const char	**rdatas;
+	size_t		  nrdata;
 	json_int_t	  count, num_results;
 };
 typedef struct pdns_tuple *pdns_tuple_t;
 typedef const struct pdns_tuple *pdns_tuple_ct;
 
-struct pdns_fence {
-	u_long	first_after, first_before, last_after, last_before;
-};
-typedef const struct pdns_fence *pdns_fence_ct;
-
 struct pdns_system {
 	/* name of this pdns system, as specifiable by the user. */
 	const char	*name;
@@ -85,10 +91,25 @@ struct pdns_system {
 	 */
 	void		(*info)(void);
 
-	/* add authentication information to the fetch request being created.
-	 * may be NULL if auth is not needed by this pDNS system.
+	/* fetch the server's rate limits and pass them to the I/O engine,
+	 * via io_pace() and io_paging().  called before the first query and
+	 * periodically during a batch, when io_limits_due() says so.
+	 * may be NULL if this pDNS system doesn't publish rate limits.
+	 */
+	void		(*limits)(void);
+
+	/* add authentication information to a newly created easy handle.
+	 * handles are pooled and reused, so this is not called per fetch.
+	 * may be NULL if this pDNS system doesn't authenticate this way.
+	 */
+	void		(*auth)(CURL *);
+
+	/* append authentication headers to the header list, which is
+	 * built once and shared by all fetches. returns the new list head.
+	 * may be NULL if this pDNS system doesn't authenticate this way.
 	 */
-	void		(*auth)(fetch_t);
+	struct curl_slist *
+			(*headers)(struct curl_slist *);
 
 	/* map a non-200 HTTP rcode from a fetch to an error indicator. */
 	const char *	(*status)(fetch_t);
@@ -120,6 +141,7 @@ typedef const struct pdns_system *pdns_system_ct;
 struct presenter {
 	void		(*output)(pdns_tuple_ct, query_ct, writer_t);
 	bool		sortable;
+	bool		asinfo;		/* annotates addresses, with -a */
 };
 typedef const struct presenter *presenter_ct;
 
@@ -170,17 +192,21 @@ void present_minimal_lookup(pdns_tuple_ct, query_ct, writer_t);
 void present_text_summarize(pdns_tuple_ct, query_ct, writer_t);
 void present_csv_summarize(pdns_tuple_ct, query_ct, writer_t);
 const char *tuple_make(pdns_tuple_t, const char *, size_t);
-void tuple_unmake(pdns_tuple_t);
 struct counted *countoff(const char *);
 void countoff_debug(const char *, const char *, const struct counted *);
 char *reverse(const char *);
-int pdns_blob(fetch_t, size_t);
+int pdns_blob(fetch_t, const char *, size_t);
+void pdns_present(query_t, const char *, size_t);
 void pick_system(const char *, const char *);
 void read_config(void);
 
 /* Some HTTP status codes we handle specifically */
 #define HTTP_OK		   200
 #define HTTP_NOT_FOUND	   404
+#define HTTP_TOO_MANY	   429
+#define HTTP_BAD_GATEWAY   502
+#define HTTP_UNAVAILABLE   503
+#define HTTP_GATEWAY_TIMEOUT 504
 
 #if WANT_PDNS_DNSDB
 #include "pdns_dnsdb.h"
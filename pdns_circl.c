@@ -27,7 +27,7 @@
 #include "globals.h"
 
 static char *circl_url(const char *, char *, qparam_ct, pdns_fence_ct, bool);
-static void circl_auth(fetch_t);
+static void circl_auth(CURL *);
 static const char *circl_status(fetch_t);
 static const char *circl_verb_ok(const char *, qparam_ct);
 static const char *circl_ready(void);
@@ -39,7 +39,7 @@ static char *circl_authinfo = NULL;
 
 static const struct pdns_system circl = {
 	"circl", "https://www.circl.lu/pdns/query", encap_cof,
-	circl_url, NULL, circl_auth, circl_status, circl_verb_ok,
+	circl_url, NULL, NULL, circl_auth, NULL, circl_status, circl_verb_ok,
 	circl_setval, circl_ready, circl_destroy
 };
 
@@ -134,13 +134,9 @@ circl_url(const char *path, char *sep,
 }
 
 static void
-circl_auth(fetch_t fetch) {
-	if (fetch->easy != NULL) {
-		curl_easy_setopt(fetch->easy, CURLOPT_USERPWD,
-				 circl_authinfo);
-		curl_easy_setopt(fetch->easy, CURLOPT_HTTPAUTH,
-				 CURLAUTH_BASIC);
-	}
+circl_auth(CURL *easy) {
+	curl_easy_setopt(easy, CURLOPT_USERPWD, circl_authinfo);
+	curl_easy_setopt(easy, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
 }
 
 static const char *
@@ -64,7 +64,9 @@ static const char *dnsdb_ready(void);
 static void dnsdb_destroy(void);
 static char *dnsdb_url(const char *, char *, qparam_ct, pdns_fence_ct, bool);
 static void dnsdb_info(void);
-static void dnsdb_auth(fetch_t);
+static void dnsdb_limits(void);
+static void dnsdb_rate_limit(ps_user_t);
+static struct curl_slist *dnsdb_headers(struct curl_slist *);
 static const char *dnsdb_status(fetch_t);
 static const char *dnsdb_verb_ok(const char *, qparam_ct);
 
@@ -86,14 +88,14 @@ static const char dnsdb2_url_prefix[] = "/dnsdb/v2";
 
 static const struct pdns_system dnsdb1 = {
 	"dnsdb1", "https://api.dnsdb.info", encap_cof,
-	dnsdb_url, dnsdb_info, dnsdb_auth, dnsdb_status, dnsdb_verb_ok,
-	dnsdb_setval, dnsdb_ready, dnsdb_destroy
+	dnsdb_url, dnsdb_info, dnsdb_limits, NULL, dnsdb_headers, dnsdb_status,
+	dnsdb_verb_ok, dnsdb_setval, dnsdb_ready, dnsdb_destroy
 };
 
 static const struct pdns_system dnsdb2 = {
 	"dnsdb2", "https://api.dnsdb.info/dnsdb/v2", encap_saf,
-	dnsdb_url, dnsdb_info, dnsdb_auth, dnsdb_status, dnsdb_verb_ok,
-	dnsdb_setval, dnsdb_ready, dnsdb_destroy
+	dnsdb_url, dnsdb_info, dnsdb_limits, NULL, dnsdb_headers, dnsdb_status,
+	dnsdb_verb_ok, dnsdb_setval, dnsdb_ready, dnsdb_destroy
 };
 
 /*---------------------------------------------------------------- public
@@ -356,18 +358,75 @@ dnsdb_infoback(writer_t writer) {
 
 static void
 dnsdb_info(void) {
+	DEBUG(1, true, "dnsdb_info()\n");
+	dnsdb_rate_limit(dnsdb_infoback);
+}
+
+/* dnsdb_limitsback -- turn the rate_limit object into pacing and paging.
+ */
+static void
+dnsdb_limitsback(writer_t writer) {
+	struct rate_tuple tup;
+	const char *msg;
+
+	if (writer->ps_buf == NULL) {
+		my_logf("warning: no rate_limit response, limits unchanged");
+		return;
+	}
+	msg = rate_tuple_make(&tup, writer->ps_buf, writer->ps_len);
+	if (msg != NULL) {
+		my_logf("warning: rate_limit: %s, limits unchanged", msg);
+		return;
+	}
+	if (pacing) {
+		if (tup.burst_size.rk == rk_int &&
+		    tup.burst_window.rk == rk_int)
+		{
+			io_pace((long)tup.burst_size.as_int,
+				(long)tup.burst_window.as_int);
+		} else {
+			DEBUG(1, true, "no burst rate limit, not pacing\n");
+			io_pace(0, 0);
+		}
+	}
+	if (paging) {
+		if (tup.results_max.rk == rk_int &&
+		    (tup.offset_max.rk == rk_int ||
+		     tup.offset_max.rk == rk_unlimited))
+		{
+			io_paging((long)tup.results_max.as_int,
+				  tup.offset_max.rk == rk_int
+				  ? (long)tup.offset_max.as_int : 0);
+		} else {
+			my_logf("warning: no results_max, not paging");
+			io_paging(0, 0);
+		}
+	}
+	rate_tuple_unmake(&tup);
+}
+
+static void
+dnsdb_limits(void) {
+	DEBUG(1, true, "dnsdb_limits()\n");
+	dnsdb_rate_limit(dnsdb_limitsback);
+}
+
+/* dnsdb_rate_limit -- fetch the rate_limit object and hand it to ps_user.
+ * this runs all outstanding fetches to completion.
+ */
+static void
+dnsdb_rate_limit(ps_user_t ps_user) {
 	query_t query = NULL;
 	writer_t writer;
 
-	DEBUG(1, true, "dnsdb_info()\n");
-
 	/* start a meta_query writer. */
-	writer = writer_init(qparam_empty.output_limit, dnsdb_infoback, true);
+	writer = writer_init(qparam_empty.output_limit, ps_user, true);
 
 	/* create a rump query. */
 	CREATE(query, sizeof(struct query));
 	query->writer = writer;
-	query->descr = strdup("rate_limit");
+	query->descr = arena_strdup(writer->arena, "rate_limit");
+	query->unmetered = true;
 	writer->queries = query;
 
 	/* start a status fetch. */
@@ -381,16 +440,17 @@ dnsdb_info(void) {
 	writer_fini(writer);
 }
 
-static void
-dnsdb_auth(fetch_t fetch) {
+static struct curl_slist *
+dnsdb_headers(struct curl_slist *hdrs) {
 	if (api_key != NULL) {
 		char *key_header;
 
 		if (asprintf(&key_header, "X-Api-Key: %s", api_key) < 0)
 			my_panic(true, "asprintf");
-		fetch->hdrs = curl_slist_append(fetch->hdrs, key_header);
+		hdrs = curl_slist_append(hdrs, key_header);
 		DESTROY(key_header);
 	}
+	return hdrs;
 }
 
 static const char *
@@ -534,7 +594,7 @@ rate_tuple_make(rate_tuple_t tup, const char *buf, size_t len) {
 		my_logf("warning: json_loadb: %d:%d: %s %s",
 			error.line, error.column,
 			error.text, error.source);
-		abort();
+		return "Unparseable rate_limit response";
 	}
 	if (debug_level >= 4) {
 		char *pretty = json_dumps(tup->obj.main, JSON_INDENT(2));
@@ -0,0 +1,862 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* getline() and strtok_r() do not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfx2as.h"
+
+/* the binary form is a header; then each family's index (IPv4, then
+ * IPv6); then each family's trie nodes; then for each family, the AS of
+ * each prefix, as an offset into the pool; then for each family, each
+ * prefix's address; then the pool of AS strings, each NUL terminated. it
+ * is in host order, as the header says, so one from elsewhere is just
+ * compiled again.
+ *
+ * each trie is path compressed: a node's children agree with its first
+ * len bits, and with each other on none past that. a node is a prefix if
+ * it has a value, or else only a fork; every leaf is a prefix. node 0 is
+ * unused, so that 0 can mean no child, and the rest are in depth first
+ * order. a lookup follows the address's bits down as far as the trie
+ * goes, noting prefixes on the way, then compares the address with the
+ * last of them, once. the longest noted prefix no longer than what those
+ * two share is the one that matches.
+ *
+ * the index saves a lookup the first PFX_INDEX_BITS levels of that. for
+ * every value of an address's first that many bits, it says where the
+ * walk would be by then, and which shorter prefix, if any, matches.
+ */
+#define	PFX_MAGIC "dnsdbqP1"
+#define	PFX_ORDER 0x01020304
+#define	PFX_SUFFIX ".trie"
+#define	PFX_NONE 0xffffffu		/* no value, and the most values */
+#define	PFX_MAX_BITS 128
+#define	PFX_INDEX_BITS 16
+#define	PFX_INDEX_SIZE (1 << PFX_INDEX_BITS)
+#define	PFX_NO_BEST 0xffffffffu
+
+struct pfx_header {
+	char		magic[8];
+	uint32_t	order;
+	uint32_t	root[2];
+	uint32_t	nnodes[2];	/* including node 0 */
+	uint32_t	nvalues[2];
+	uint32_t	npool;
+};
+
+struct pfx_node {
+	uint32_t	child[2];
+	uint32_t	info;		/* length << 24 | value */
+};
+
+struct pfx_index {
+	uint32_t	node;
+	uint32_t	best;		/* info, or PFX_NO_BEST */
+};
+
+/* one family's trie, as it is used. */
+struct pfx_trie {
+	const struct pfx_index *index;
+	const struct pfx_node *nodes;
+	const uint32_t	*as;		/* per value, offset into the pool */
+	const uint8_t	*keys;		/* per value, .width octets */
+	uint32_t	root;
+	int		width;		/* octets in an address */
+};
+
+struct pfx2as {
+	void		*base;		/* mmap()'d, or else malloc()'d */
+	size_t		size;
+	bool		mapped;
+	struct pfx_trie	trie[2];
+	const char	*pool;
+	size_t		nvalues[2];
+};
+
+/* one family's trie, while it is being compiled. each node also keeps
+ * some value whose address its own prefix begins, to compare with.
+ */
+struct pfx_build {
+	struct pfx_node	*nodes;
+	uint32_t	*keyof;
+	uint32_t	*as;
+	uint8_t		*keys;
+	size_t		nnodes, nvalues, maxnodes, maxvalues;
+	uint32_t	root;
+	int		width;
+};
+
+/* everything being compiled: both tries, and the pool, whose strings are
+ * each kept once, found by hash (offset + 1, or 0 if the slot is empty).
+ */
+struct pfx_compiler {
+	struct pfx_build build[2];
+	char		*pool;
+	size_t		npool, maxpool;
+	uint32_t	*interned;
+	size_t		buckets, ninterned;
+};
+
+static pfx2as_t pfx_load(void *, size_t, bool, const char **);
+static pfx2as_t pfx_map(const char *, const char **);
+static bool pfx_compiled(const char *);
+static void *pfx_compile(FILE *, size_t *, const char **);
+static const char *pfx_line(struct pfx_compiler *, char *);
+static uint32_t pfx_intern(struct pfx_compiler *, const char *);
+static const char *pfx_insert(struct pfx_build *, const uint8_t *, int,
+			      uint32_t);
+static uint32_t pfx_node_new(struct pfx_build *, int, uint32_t, uint32_t);
+static void *pfx_serialize(const struct pfx_compiler *, size_t *);
+static void pfx_renumber(const struct pfx_build *, struct pfx_node *);
+static void pfx_index(const struct pfx_trie *, struct pfx_index *);
+static bool pfx_save(const char *, const void *, size_t);
+static void pfx_compiler_free(struct pfx_compiler *);
+static int pfx_bit(const uint8_t *, int);
+static int pfx_common(const uint8_t *, const uint8_t *, int);
+static void *pfx_grow(void *, size_t *, size_t, size_t);
+
+/* pfx2as_open(path, errp) -- open a pfx2as table, compiling it if need be
+ *
+ * return NULL with *errp saying why, if it can't be.
+ *
+ * a table in text form is compiled to path.trie, which is used instead
+ * for as long as it is newer. if that can't be written, the compiled
+ * form is only kept in memory.
+ */
+pfx2as_t
+pfx2as_open(const char *path, const char **errp) {
+	struct stat st, cst;
+	char *compiled = NULL;
+	pfx2as_t ret = NULL;
+	void *base;
+	size_t size;
+	FILE *fp;
+
+	if (pfx_compiled(path))
+		return pfx_map(path, errp);
+	if (stat(path, &st) < 0) {
+		*errp = strerror(errno);
+		return NULL;
+	}
+	if (asprintf(&compiled, "%s%s", path, PFX_SUFFIX) < 0) {
+		*errp = strerror(errno);
+		return NULL;
+	}
+	if (stat(compiled, &cst) == 0 && cst.st_mtime > st.st_mtime &&
+	    pfx_compiled(compiled) &&
+	    (ret = pfx_map(compiled, errp)) != NULL)
+	{
+		free(compiled);
+		return ret;
+	}
+	if ((fp = fopen(path, "r")) == NULL) {
+		*errp = strerror(errno);
+		free(compiled);
+		return NULL;
+	}
+	base = pfx_compile(fp, &size, errp);
+	fclose(fp);
+	if (base != NULL) {
+		if (pfx_save(compiled, base, size) &&
+		    (ret = pfx_map(compiled, errp)) != NULL)
+			free(base);
+		else
+			ret = pfx_load(base, size, false, errp);
+	}
+	free(compiled);
+	return ret;
+}
+
+/* pfx2as_lookup(table, af, addr, prefix, len) -- longest prefix match
+ *
+ * return the AS(es) of the longest prefix covering this address (which
+ * is AF_INET or AF_INET6, in network order), or NULL if none does.
+ *
+ * side effect: *prefix and *len will say what that prefix is; the former
+ * is in the table, in network order.
+ */
+const char *
+pfx2as_lookup(pfx2as_t table, int af, const void *addr,
+	      const void **prefix, int *len)
+{
+	const struct pfx_trie *trie = &table->trie[af == AF_INET6];
+	const uint8_t *a = addr, *key;
+	const struct pfx_index *ix = &trie->index[a[0] << 8 | a[1]];
+	uint32_t noted[PFX_MAX_BITS + 1], n, found = ix->best, value;
+	int nnoted = 0, common;
+
+	for (n = ix->node; n != 0; ) {
+		const struct pfx_node *node = &trie->nodes[n];
+		int bits = (int)(node->info >> 24);
+
+		if ((node->info & PFX_NONE) != PFX_NONE)
+			noted[nnoted++] = node->info;
+		if (bits == trie->width * 8)
+			break;
+		n = node->child[pfx_bit(a, bits)];
+	}
+	if (nnoted > 0) {
+		key = trie->keys + (noted[nnoted - 1] & PFX_NONE) *
+			(size_t)trie->width;
+		common = pfx_common(a, key, trie->width);
+		while (nnoted > 0 && (int)(noted[nnoted - 1] >> 24) > common)
+			nnoted--;
+		if (nnoted > 0)
+			found = noted[nnoted - 1];
+	}
+	if (found == PFX_NO_BEST)
+		return NULL;
+	value = found & PFX_NONE;
+	*prefix = trie->keys + value * (size_t)trie->width;
+	*len = (int)(found >> 24);
+	return table->pool + trie->as[value];
+}
+
+/* pfx2as_count(table, n4, n6) -- how many IPv4 and IPv6 prefixes it has
+ */
+void
+pfx2as_count(pfx2as_t table, size_t *n4, size_t *n6) {
+	*n4 = table->nvalues[0];
+	*n6 = table->nvalues[1];
+}
+
+/* pfx2as_close(tablep) -- release a table, and everything in it
+ */
+void
+pfx2as_close(pfx2as_t *tablep) {
+	pfx2as_t table = *tablep;
+
+	*tablep = NULL;
+	if (table->mapped)
+		munmap(table->base, table->size);
+	else
+		free(table->base);
+	free(table);
+}
+
+/* private. */
+
+/* pfx_load(base, size, mapped, errp) -- check over a table's binary form,
+ * and take it (either way) if it is sound.
+ *
+ * every node is checked, so that a lookup can trust what it finds.
+ */
+static pfx2as_t
+pfx_load(void *base, size_t size, bool mapped, const char **errp) {
+	const struct pfx_header *hdr = base;
+	size_t need = sizeof *hdr + 2 * PFX_INDEX_SIZE * sizeof(struct pfx_index);
+	const char *p = base;
+	pfx2as_t table;
+	int f;
+
+	if (size < sizeof *hdr ||
+	    memcmp(hdr->magic, PFX_MAGIC, sizeof hdr->magic) != 0 ||
+	    hdr->order != PFX_ORDER)
+		goto bad;
+	for (f = 0; f < 2; f++)
+		need += hdr->nnodes[f] * sizeof(struct pfx_node) +
+			hdr->nvalues[f] * (sizeof(uint32_t) + (f ? 16 : 4));
+	need += hdr->npool;
+	if (need != size || hdr->npool == 0 || p[size - 1] != '\0')
+		goto bad;
+
+	table = calloc(1, sizeof *table);
+	if (table == NULL) {
+		*errp = strerror(errno);
+		goto fail;
+	}
+	p += sizeof *hdr;
+	for (f = 0; f < 2; f++) {
+		table->trie[f].index = (const struct pfx_index *)(const void *)p;
+		p += PFX_INDEX_SIZE * sizeof(struct pfx_index);
+	}
+	for (f = 0; f < 2; f++) {
+		table->trie[f].nodes = (const struct pfx_node *)(const void *)p;
+		table->trie[f].root = hdr->root[f];
+		table->trie[f].width = f ? 16 : 4;
+		table->nvalues[f] = hdr->nvalues[f];
+		p += hdr->nnodes[f] * sizeof(struct pfx_node);
+	}
+	for (f = 0; f < 2; f++) {
+		table->trie[f].as = (const uint32_t *)(const void *)p;
+		p += hdr->nvalues[f] * sizeof(uint32_t);
+	}
+	for (f = 0; f < 2; f++) {
+		table->trie[f].keys = (const uint8_t *)p;
+		p += hdr->nvalues[f] * (size_t)table->trie[f].width;
+	}
+	table->pool = p;
+
+	for (f = 0; f < 2; f++) {
+		const struct pfx_trie *trie = &table->trie[f];
+		uint32_t nnodes = hdr->nnodes[f];
+
+		if (nnodes == 0 || trie->root >= nnodes ||
+		    (nnodes == 1) != (trie->root == 0))
+			goto bad_table;
+		for (uint32_t n = 1; n < nnodes; n++) {
+			const struct pfx_node *node = &trie->nodes[n];
+			uint32_t value = node->info & PFX_NONE;
+			int bits = (int)(node->info >> 24);
+
+			if (bits > trie->width * 8 ||
+			    (value != PFX_NONE && value >= hdr->nvalues[f]))
+				goto bad_table;
+			/* lengths only grow, so every lookup ends. */
+			for (int c = 0; c < 2; c++)
+				if (node->child[c] >= nnodes ||
+				    (node->child[c] != 0 &&
+				     (int)(trie->nodes[node->child[c]].info
+					   >> 24) <= bits))
+					goto bad_table;
+		}
+		for (uint32_t v = 0; v < hdr->nvalues[f]; v++)
+			if (trie->as[v] >= hdr->npool)
+				goto bad_table;
+		for (size_t i = 0; i < PFX_INDEX_SIZE; i++)
+			if (trie->index[i].node >= nnodes ||
+			    (trie->index[i].best != PFX_NO_BEST &&
+			     ((trie->index[i].best & PFX_NONE) == PFX_NONE ||
+			      (trie->index[i].best & PFX_NONE) >=
+			      hdr->nvalues[f])))
+				goto bad_table;
+	}
+	table->base = base;
+	table->size = size;
+	table->mapped = mapped;
+	return table;
+
+ bad_table:
+	free(table);
+ bad:
+	*errp = "not a sound compiled pfx2as table";
+ fail:
+	if (mapped)
+		munmap(base, size);
+	else
+		free(base);
+	return NULL;
+}
+
+/* pfx_map(path, errp) -- map a table's binary form, and check it over.
+ */
+static pfx2as_t
+pfx_map(const char *path, const char **errp) {
+	struct stat st;
+	void *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		*errp = strerror(errno);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		*errp = strerror(errno);
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		*errp = strerror(errno);
+		return NULL;
+	}
+	return pfx_load(base, (size_t)st.st_size, true, errp);
+}
+
+/* pfx_compiled(path) -- is this a table's binary form (or an attempt)?
+ */
+static bool
+pfx_compiled(const char *path) {
+	char magic[sizeof PFX_MAGIC - 1];
+	bool ret = false;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) != NULL) {
+		ret = fread(magic, sizeof magic, 1, fp) == 1 &&
+			memcmp(magic, PFX_MAGIC, sizeof magic) == 0;
+		fclose(fp);
+	}
+	return ret;
+}
+
+/* pfx_compile(fp, sizep, errp) -- compile a table's text form
+ *
+ * return its binary form (malloc'd), or else NULL, with *errp saying why.
+ */
+static void *
+pfx_compile(FILE *fp, size_t *sizep, const char **errp) {
+	static char why[100];
+	struct pfx_compiler c;
+	size_t size = 0, lineno = 0;
+	char *line = NULL;
+	void *ret = NULL;
+	const char *err = NULL;
+
+	memset(&c, 0, sizeof c);
+	for (int f = 0; f < 2; f++) {
+		c.build[f].width = f ? 16 : 4;
+		/* node 0 is never used. */
+		(void) pfx_node_new(&c.build[f], 0, PFX_NONE, 0);
+	}
+	while (err == NULL && getline(&line, &size, fp) >= 0) {
+		lineno++;
+		if ((err = pfx_line(&c, line)) != NULL) {
+			snprintf(why, sizeof why, "line %zu: %s", lineno, err);
+			err = why;
+		}
+	}
+	free(line);
+	if (err == NULL && ferror(fp))
+		err = strerror(errno);
+	if (err == NULL && c.build[0].nvalues + c.build[1].nvalues == 0)
+		err = "no prefixes";
+	if (err == NULL) {
+		ret = pfx_serialize(&c, sizep);
+		if (ret == NULL)
+			err = strerror(errno);
+	}
+	pfx_compiler_free(&c);
+	if (ret == NULL)
+		*errp = err;
+	return ret;
+}
+
+/* pfx_line(c, line) -- compile one line of a table's text form
+ *
+ * return NULL on success, or else, reason (static string) for failure.
+ */
+static const char *
+pfx_line(struct pfx_compiler *c, char *line) {
+	char *tok[3], *save = NULL, *addr, *length, *as, *end, *p;
+	uint8_t key[PFX_MAX_BITS / 8];
+	struct pfx_build *b;
+	int ntok = 0, f;
+	long len;
+
+	for (p = strtok_r(line, " \t\r\n", &save); p != NULL;
+	     p = strtok_r(NULL, " \t\r\n", &save))
+	{
+		if (ntok == 0 && *p == '#')
+			break;
+		if (ntok == 3)
+			return "more than address, length, and AS";
+		tok[ntok++] = p;
+	}
+	if (ntok == 0)
+		return NULL;
+	addr = tok[0];
+	if (ntok == 3) {
+		length = tok[1];
+		as = tok[2];
+	} else if (ntok == 2 && (length = strchr(addr, '/')) != NULL) {
+		*length++ = '\0';
+		as = tok[1];
+	} else {
+		return "expected address, length, and AS";
+	}
+
+	f = strchr(addr, ':') != NULL;
+	b = &c->build[f];
+	if (inet_pton(f ? AF_INET6 : AF_INET, addr, key) != 1)
+		return "bad address";
+	len = strtol(length, &end, 10);
+	if (end == length || *end != '\0' || len < 0 || len > b->width * 8)
+		return "bad prefix length";
+	/* the address is kept only as far as the prefix goes. */
+	for (int i = (int)len; i < b->width * 8; i++)
+		key[i >> 3] &= (uint8_t)~(0x80 >> (i & 7));
+
+	/* MOAS (_) and AS sets (,) both become lists, as ASINFO DNS has. */
+	for (p = as; *p != '\0'; p++) {
+		if (*p == '_' || *p == ',')
+			*p = ' ';
+		else if (*p < '0' || *p > '9')
+			return "bad AS";
+	}
+	if (*as == '\0')
+		return "bad AS";
+	return pfx_insert(b, key, (int)len, pfx_intern(c, as));
+}
+
+/* pfx_intern(c, as) -- add a string to the pool, if it isn't there yet
+ *
+ * return its offset in the pool.
+ */
+static uint32_t
+pfx_intern(struct pfx_compiler *c, const char *as) {
+	size_t len = strlen(as) + 1, i;
+	uint32_t hash = 2166136261u, off;
+
+	for (const char *p = as; *p != '\0'; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	if (c->ninterned * 2 >= c->buckets) {
+		size_t buckets = c->buckets == 0 ? 1024 : c->buckets * 2;
+		uint32_t *table = calloc(buckets, sizeof *table);
+
+		if (table == NULL)
+			abort();
+		for (i = 0; i < c->buckets; i++) {
+			size_t j;
+
+			if (c->interned[i] == 0)
+				continue;
+			hash = 2166136261u;
+			for (const char *p = c->pool + c->interned[i] - 1;
+			     *p != '\0'; p++)
+				hash = (hash ^ (uint8_t)*p) * 16777619u;
+			for (j = hash & (buckets - 1); table[j] != 0;
+			     j = (j + 1) & (buckets - 1))
+				;
+			table[j] = c->interned[i];
+		}
+		free(c->interned);
+		c->interned = table;
+		c->buckets = buckets;
+		hash = 2166136261u;
+		for (const char *p = as; *p != '\0'; p++)
+			hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	for (i = hash & (c->buckets - 1); c->interned[i] != 0;
+	     i = (i + 1) & (c->buckets - 1))
+		if (strcmp(c->pool + c->interned[i] - 1, as) == 0)
+			return c->interned[i] - 1;
+	off = (uint32_t)c->npool;
+	c->pool = pfx_grow(c->pool, &c->maxpool, c->npool + len, 1);
+	memcpy(c->pool + c->npool, as, len);
+	c->npool += len;
+	c->interned[i] = off + 1;
+	c->ninterned++;
+	return off;
+}
+
+/* pfx_insert(b, key, len, as) -- add a prefix to a trie, or replace its AS
+ *
+ * return NULL on success, or else, reason (static string) for failure.
+ */
+static const char *
+pfx_insert(struct pfx_build *b, const uint8_t *key, int len, uint32_t as) {
+	uint32_t parent = 0, n, new, fork, value;
+	int side = 0, common = 0, bits = 0;
+	const uint8_t *nkey = NULL;
+	size_t max;
+
+	if (b->nvalues == PFX_NONE)
+		return "too many prefixes";
+	value = (uint32_t)b->nvalues;
+	for (n = b->root; n != 0; n = b->nodes[n].child[side]) {
+		bits = (int)(b->nodes[n].info >> 24);
+		nkey = b->keys + b->keyof[n] * (size_t)b->width;
+		common = pfx_common(key, nkey, b->width);
+		if (common > bits)
+			common = bits;
+		if (common > len)
+			common = len;
+		if (common == bits && common == len) {
+			uint32_t old = b->nodes[n].info & PFX_NONE;
+
+			if (old != PFX_NONE) {
+				b->as[old] = as;
+				return NULL;
+			}
+			break;
+		}
+		if (common < bits)
+			break;
+		/* n covers the prefix, which goes somewhere below it. */
+		parent = n;
+		side = pfx_bit(key, bits);
+	}
+
+	/* the prefix's value, whose address also stands for its node's.
+	 * the keys may move, so n's is found again after.
+	 */
+	max = b->maxvalues;
+	b->as = pfx_grow(b->as, &b->maxvalues, b->nvalues + 1, sizeof *b->as);
+	b->keys = pfx_grow(b->keys, &max, b->nvalues + 1, (size_t)b->width);
+	b->as[value] = as;
+	memcpy(b->keys + value * (size_t)b->width, key, (size_t)b->width);
+	b->nvalues++;
+	if (n != 0)
+		nkey = b->keys + b->keyof[n] * (size_t)b->width;
+
+	if (n != 0 && common == bits) {
+		/* the prefix is a fork that was already there. */
+		b->nodes[n].info = (uint32_t)bits << 24 | value;
+		return NULL;
+	}
+	new = pfx_node_new(b, len, value, value);
+	if (n == 0) {
+		/* nothing there yet. */
+	} else if (common == len) {
+		/* the prefix covers n, so goes above it. */
+		b->nodes[new].child[pfx_bit(nkey, len)] = n;
+	} else {
+		/* the prefix and n part ways, so fork where they do. */
+		fork = pfx_node_new(b, common, PFX_NONE, value);
+		b->nodes[fork].child[pfx_bit(key, common)] = new;
+		b->nodes[fork].child[pfx_bit(nkey, common)] = n;
+		new = fork;
+	}
+	if (parent == 0)
+		b->root = new;
+	else
+		b->nodes[parent].child[side] = new;
+	return NULL;
+}
+
+/* pfx_node_new(b, len, value, keyof) -- add a node, with no children yet
+ *
+ * return its index.
+ */
+static uint32_t
+pfx_node_new(struct pfx_build *b, int len, uint32_t value, uint32_t keyof) {
+	size_t max = b->maxnodes;
+
+	b->nodes = pfx_grow(b->nodes, &b->maxnodes, b->nnodes + 1,
+			    sizeof *b->nodes);
+	b->keyof = pfx_grow(b->keyof, &max, b->nnodes + 1, sizeof *b->keyof);
+	b->nodes[b->nnodes].child[0] = b->nodes[b->nnodes].child[1] = 0;
+	b->nodes[b->nnodes].info = (uint32_t)len << 24 | value;
+	b->keyof[b->nnodes] = keyof;
+	return (uint32_t)b->nnodes++;
+}
+
+/* pfx_serialize(c, sizep) -- lay out a compiled table in its binary form
+ *
+ * return it (malloc'd), or NULL if there's no memory for it.
+ */
+static void *
+pfx_serialize(const struct pfx_compiler *c, size_t *sizep) {
+	struct pfx_header hdr;
+	size_t size = sizeof hdr + 2 * PFX_INDEX_SIZE * sizeof(struct pfx_index);
+	struct pfx_trie trie[2];
+	char *ret, *p;
+	int f;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, PFX_MAGIC, sizeof hdr.magic);
+	hdr.order = PFX_ORDER;
+	for (f = 0; f < 2; f++) {
+		const struct pfx_build *b = &c->build[f];
+
+		hdr.root[f] = b->root;
+		hdr.nnodes[f] = (uint32_t)b->nnodes;
+		hdr.nvalues[f] = (uint32_t)b->nvalues;
+		size += b->nnodes * sizeof *b->nodes +
+			b->nvalues * (sizeof *b->as + (size_t)b->width);
+	}
+	hdr.npool = (uint32_t)c->npool;
+	size += c->npool;
+	if ((ret = malloc(size)) == NULL)
+		return NULL;
+	p = ret;
+	memcpy(p, &hdr, sizeof hdr);
+	p += sizeof hdr;
+	for (f = 0; f < 2; f++) {
+		trie[f].index = (struct pfx_index *)(void *)p;
+		p += PFX_INDEX_SIZE * sizeof(struct pfx_index);
+	}
+	for (f = 0; f < 2; f++) {
+		pfx_renumber(&c->build[f], (struct pfx_node *)(void *)p);
+		trie[f].nodes = (struct pfx_node *)(void *)p;
+		trie[f].root = c->build[f].nnodes > 1 ? 1 : 0;
+		trie[f].width = c->build[f].width;
+		hdr.root[f] = trie[f].root;
+		p += c->build[f].nnodes * sizeof *c->build[f].nodes;
+	}
+	for (f = 0; f < 2; f++) {
+		if (c->build[f].nvalues != 0)
+			memcpy(p, c->build[f].as,
+			       c->build[f].nvalues * sizeof *c->build[f].as);
+		p += c->build[f].nvalues * sizeof *c->build[f].as;
+	}
+	for (f = 0; f < 2; f++) {
+		size_t len = c->build[f].nvalues * (size_t)c->build[f].width;
+
+		if (len != 0)
+			memcpy(p, c->build[f].keys, len);
+		trie[f].keys = (const uint8_t *)p;
+		p += len;
+	}
+	memcpy(p, c->pool, c->npool);
+	for (f = 0; f < 2; f++)
+		pfx_index(&trie[f], (struct pfx_index *)(void *)
+			  (ret + sizeof hdr +
+			   (size_t)f * PFX_INDEX_SIZE * sizeof(struct pfx_index)));
+	memcpy(ret, &hdr, sizeof hdr);
+	*sizep = size;
+	return ret;
+}
+
+/* pfx_renumber(b, nodes) -- copy a trie's nodes, in depth first order
+ *
+ * so that a lookup's walk tends to stay within the same few pages.
+ */
+static void
+pfx_renumber(const struct pfx_build *b, struct pfx_node *nodes) {
+	/* nodes yet to visit, and where each is to be linked in. */
+	struct visit {
+		uint32_t	old, parent;
+		int		side;
+	} stack[2 * PFX_MAX_BITS + 2], *v;
+	uint32_t next = 1;
+	int depth = 0;
+
+	memset(&nodes[0], 0, sizeof nodes[0]);
+	if (b->root != 0) {
+		v = &stack[depth++];
+		v->old = b->root;
+		v->parent = 0;
+		v->side = 0;
+	}
+	while (depth > 0) {
+		const struct pfx_node *old = &b->nodes[stack[--depth].old];
+		uint32_t new = next++;
+
+		v = &stack[depth];
+		if (v->parent != 0)
+			nodes[v->parent].child[v->side] = new;
+		nodes[new].child[0] = nodes[new].child[1] = 0;
+		nodes[new].info = old->info;
+		/* the 0 side is visited first, so it comes next. */
+		for (int side = 1; side >= 0; side--)
+			if (old->child[side] != 0) {
+				v = &stack[depth++];
+				v->old = old->child[side];
+				v->parent = new;
+				v->side = side;
+			}
+	}
+}
+
+/* pfx_index(trie, index) -- work out a trie's index, see above.
+ */
+static void
+pfx_index(const struct pfx_trie *trie, struct pfx_index *index) {
+	uint8_t addr[PFX_MAX_BITS / 8];
+
+	memset(addr, 0, sizeof addr);
+	for (size_t i = 0; i < PFX_INDEX_SIZE; i++) {
+		uint32_t n = trie->root, best = PFX_NO_BEST;
+
+		addr[0] = (uint8_t)(i >> 8);
+		addr[1] = (uint8_t)i;
+		while (n != 0) {
+			uint32_t info = trie->nodes[n].info;
+			int bits = (int)(info >> 24);
+
+			if (bits >= PFX_INDEX_BITS)
+				break;
+			if ((info & PFX_NONE) != PFX_NONE &&
+			    pfx_common(addr, trie->keys + (info & PFX_NONE) *
+				       (size_t)trie->width,
+				       trie->width) >= bits)
+				best = info;
+			n = trie->nodes[n].child[pfx_bit(addr, bits)];
+		}
+		index[i].node = n;
+		index[i].best = best;
+	}
+}
+
+/* pfx_save(path, base, size) -- write out a compiled table, all or nothing
+ *
+ * return true if it was.
+ */
+static bool
+pfx_save(const char *path, const void *base, size_t size) {
+	char *temp = NULL;
+	bool ret = false;
+	int fd;
+
+	if (asprintf(&temp, "%s.XXXXXX", path) < 0)
+		return false;
+	if ((fd = mkstemp(temp)) >= 0) {
+		ret = write(fd, base, size) == (ssize_t)size;
+		if (close(fd) < 0)
+			ret = false;
+		if (ret)
+			ret = rename(temp, path) == 0;
+		if (!ret)
+			unlink(temp);
+	}
+	free(temp);
+	return ret;
+}
+
+/* pfx_compiler_free(c) -- release what compiling a table used.
+ */
+static void
+pfx_compiler_free(struct pfx_compiler *c) {
+	for (int f = 0; f < 2; f++) {
+		free(c->build[f].nodes);
+		free(c->build[f].keyof);
+		free(c->build[f].as);
+		free(c->build[f].keys);
+	}
+	free(c->pool);
+	free(c->interned);
+}
+
+/* pfx_bit(key, i) -- bit i of an address, counting from the left.
+ */
+static int
+pfx_bit(const uint8_t *key, int i) {
+	return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* pfx_common(a, b, width) -- how many leading bits two addresses share.
+ */
+static int
+pfx_common(const uint8_t *a, const uint8_t *b, int width) {
+	for (int i = 0; i < width; i++)
+		if (a[i] != b[i])
+			return i * 8 + __builtin_clz((unsigned)(a[i] ^ b[i])) -
+				(int)(sizeof(unsigned) - 1) * 8;
+	return width * 8;
+}
+
+/* pfx_grow(ptr, maxp, need, size) -- make room for need elements of size,
+ * doubling, as realloc() would.
+ */
+static void *
+pfx_grow(void *ptr, size_t *maxp, size_t need, size_t size) {
+	if (need > *maxp) {
+		size_t max = *maxp == 0 ? 1024 : *maxp;
+
+		while (max < need)
+			max *= 2;
+		if ((ptr = realloc(ptr, max * size)) == NULL)
+			abort();
+		*maxp = max;
+	}
+	return ptr;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PFX2AS_H_INCLUDED
+#define __PFX2AS_H_INCLUDED 1
+
+#include <stdbool.h>
+
+/* a pfx2as table maps IPv4 and IPv6 prefixes to the AS(es) originating
+ * them, and finds the longest prefix covering an address. its text form
+ * has one prefix per line, either as "address length AS" (CAIDA's
+ * routeviews pfx2as) or "address/length AS", where AS may be several,
+ * separated by _ or , (which become spaces). its binary form is compiled
+ * from that once, and is used in place, memory mapped.
+ */
+
+struct pfx2as;
+typedef struct pfx2as *pfx2as_t;
+
+pfx2as_t pfx2as_open(const char *, const char **);
+const char *pfx2as_lookup(pfx2as_t, int, const void *, const void **, int *);
+void pfx2as_count(pfx2as_t, size_t *, size_t *);
+void pfx2as_close(pfx2as_t *);
+
+#endif /*__PFX2AS_H_INCLUDED*/
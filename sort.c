@@ -14,42 +14,132 @@
  * limitations under the License.
  */
 
-/* asprintf() does not appear on linux without this */
-#define _GNU_SOURCE
-
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <arpa/inet.h>
 
 #include "defs.h"
 #include "sort.h"
 #include "globals.h"
 
-/* in the POSIX sort(1) intermediate format, the fields are:
- * #1 first
- * #2 last
- * #3 duration
- * #4 count
- * #5 rrname
- * #7 rrtype
- * #6 rdata
- * #8 mode
- * #9 json
+#define	MAX_KEYS 7
+
+/* a sort key is a string of octets that memcmp() orders as the sort keys
+ * do, so that the sorter never needs to look at a tuple to compare two.
+ * the first, last, duration, and count keys are 64-bit big-endian numbers.
+ * the name, type, and data keys each compare from their own field to the
+ * end of the tuple's line, as sort(1) once did with text, so only the
+ * first of them is encoded: its field and those after it, each escaped
+ * (NUL becomes NUL 0xff) and ended by two NULs, which order a field
+ * before any that it's a prefix of. no key after that one can matter,
+ * because two records are equal (and duplicates for -u) only if their
+ * lines are. a reversed key has its octets complemented.
+ *
+ * a record is one tuple, flattened so that it can be compared, spilled to
+ * a file, and read back with nothing to fix up but the tuple's pointers.
+ * offsets are relative to .data, which holds the rdatas offset array, the
+ * sort key, the line, and the tuple's strings, NUL-terminated. the key's
+ * first eight octets are kept in the header too, where most comparisons
+ * can be settled without touching .data.
  */
+typedef enum {
+	ss_bailiwick, ss_rrtype, ss_rdata, ss_orig_rrname, ss_rrname, ss_count
+} sortstr_e;
 
-#define	MAX_KEYS 7
+#define	NO_STR UINT32_MAX
+
+struct sortrec {
+	uint32_t	size;		/* of the whole record, must be first */
+	uint32_t	key_off, key_len;
+	uint64_t	key_head;	/* first octets of the key, as a number */
+	uint32_t	line_off, line_len;
+	uint32_t	cof_off, cof_len;	/* within the line */
+	uint32_t	nrdata;
+	uint32_t	str[ss_count];
+	unsigned	fields;
+	u_long		time_first, time_last, zone_first, zone_last;
+	json_int_t	count, num_results;
+	char		data[];
+};
+typedef struct sortrec *sortrec_t;
+typedef const struct sortrec *sortrec_ct;
 
-extern char **environ;
+/* one sorted run being merged, either spilled or the last one in memory. */
+struct sortrun {
+	FILE		*file;
+	sortrec_t	rec;		/* current record, or NULL at the end */
+	size_t		size;		/* of rec's buffer, if spilled */
+	size_t		next;		/* next of sorter->recs, if not */
+};
+typedef struct sortrun *sortrun_t;
 
-static void sortable_rdatum(sortbuf_t, const char *, const char *);
-static void sortable_dnsname(sortbuf_t, const char *);
-static void sortable_hexify(sortbuf_t, const u_char *, size_t);
+struct sorter {
+	arena_t		arena;		/* records of the run being gathered */
+	sortrec_t	*recs;
+	size_t		nrec, maxrec;
+	size_t		mem;		/* used by the run being gathered */
+	struct sortbuf	key;		/* of the tuple being added */
+	/* with an output limit, only that many records are wanted. those
+	 * not already beaten by the cutoff, a copy of the best limit'th
+	 * record of any one run compacted or spilled so far, are kept, and
+	 * no more than that many are given back.
+	 */
+	size_t		limit;
+	sortrec_t	cutoff;
+	size_t		cutoff_size;
+	size_t		given;
+	arena_t		spare;
+	struct sortrun	*runs;
+	size_t		nrun;
+	size_t		*heap;		/* of runs, by current record */
+	size_t		nheap;
+	bool		merging;
+	sortrec_t	prev;		/* last one given back, for -u */
+	size_t		prev_size;
+	bool		have_prev;
+};
+
+static int sortrec_cmp(sortrec_ct, sortrec_ct);
+static int sortrec_qcmp(const void *, const void *);
+static inline int octets_cmp(const char *, size_t, const char *, size_t);
+static uint32_t sortrec_str(sortrec_t, uint32_t *, const char *);
+static void sorter_spill(sorter_t);
+static void sorter_compact(sorter_t);
+static void sorter_cutoff(sorter_t, sortrec_ct);
+static void sorter_merge(sorter_t);
+static bool sortrun_advance(sorter_t, sortrun_t);
+static void sortheap_down(sorter_t, size_t);
+static void sort_key_numbers(sortbuf_t, u_long, u_long, json_int_t);
+static void sort_key_fields(sortbuf_t, pdns_tuple_ct);
+static void sort_key_rdatum(sortbuf_t, const char *, const char *);
+static void sort_key_dnsname(sortbuf_t, const char *);
+static void sort_key_octets(sortbuf_t, const u_char *, size_t);
+static void sort_key_end(sortbuf_t);
+static void sort_key_u64(sortbuf_t, uint64_t);
+static char *sortbuf_reserve(sortbuf_t, size_t);
 
 static struct sortkey keys[MAX_KEYS];
 static int nkeys = 0;
+static int fields_key;		/* the first of name, type, or data */
+static size_t numbers_len;	/* of the keys before that one */
+
+static const struct sortkey_name {
+	const char	*name;
+	sortkey_e	key;
+} sortkey_names[] = {
+	{ "first", sk_first },
+	{ "last", sk_last },
+	{ "duration", sk_duration },
+	{ "count", sk_count },
+	{ "name", sk_name },
+	{ "type", sk_type },
+	{ "data", sk_data },
+};
 
 /* sort_ready -- finish initializing the sort related metadata.
  *
@@ -66,42 +156,38 @@ sort_ready(void) {
 	(void) add_sort_key("name");
 	(void) add_sort_key("type");
 	(void) add_sort_key("data");
+
+	for (fields_key = 0; fields_key < nkeys; fields_key++)
+		if (keys[fields_key].key == sk_name ||
+		    keys[fields_key].key == sk_type ||
+		    keys[fields_key].key == sk_data)
+			break;
+	numbers_len = (size_t)fields_key * sizeof(uint64_t);
 }
 
-/* add_sort_key -- add a key for use by POSIX sort.
+/* add_sort_key -- add a key for use by the sorter.
  *
  * Returns NULL if no error, otherwise a static error message.
  */
 const char *
 add_sort_key(const char *key_name) {
-	const char *key = NULL;
-	char *computed;
-	int x;
+	const struct sortkey_name *kn;
 
 	if (nkeys == MAX_KEYS)
 		return "too many sort keys given.";
-	if (strcasecmp(key_name, "first") == 0)
-		key = "-k1n";
-	else if (strcasecmp(key_name, "last") == 0)
-		key = "-k2n";
-	else if (strcasecmp(key_name, "duration") == 0)
-		key = "-k3n";
-	else if (strcasecmp(key_name, "count") == 0)
-		key = "-k4n";
-	else if (strcasecmp(key_name, "name") == 0)
-		key = "-k5";
-	else if (strcasecmp(key_name, "type") == 0)
-		key = "-k6";
-	else if (strcasecmp(key_name, "data") == 0)
-		key = "-k7";
-	else
+	for (kn = sortkey_names;
+	     kn < sortkey_names + sizeof sortkey_names / sizeof *kn;
+	     kn++)
+		if (strcasecmp(key_name, kn->name) == 0)
+			break;
+	if (kn == sortkey_names + sizeof sortkey_names / sizeof *kn)
 		return "key must be in "
 		        "first|last|duration|count|name|type|data";
-	x = asprintf(&computed, "%s%s", key,
-		     sorting == reverse_sort ? "r" : "");
-	if (x < 0)
-		my_panic(true, "asprintf");
-	keys[nkeys++] = (struct sortkey){strdup(key_name), computed};
+	for (int n = 0; n < nkeys; n++)
+		if (keys[n].key == kn->key)
+			return "sort key already given.";
+	keys[nkeys++] = (struct sortkey){strdup(key_name), kn->key,
+					 sorting == reverse_sort};
 	return NULL;
 }
 
@@ -124,168 +210,642 @@ void
 sort_destroy(void) {
 	int n;
 
-	for (n = 0; n < nkeys; n++) {
+	for (n = 0; n < nkeys; n++)
 		DESTROY(keys[n].specified);
-		DESTROY(keys[n].computed);
+}
+
+/* sorter_new(limit) -- create an empty sorter
+ *
+ * if limit isn't 0, only that many tuples will be taken from the sorter,
+ * and it can discard any that can't be among them.
+ */
+sorter_t
+sorter_new(size_t limit) {
+	sorter_t sorter = NULL;
+
+	CREATE(sorter, sizeof *sorter);
+	sorter->arena = arena_new(SORT_ARENA_CHUNK);
+	sorter->limit = limit;
+	return sorter;
+}
+
+/* sorter_add -- give a sorter one tuple, and the line it came from
+ *
+ * first and last are the times that the first, last, and duration keys
+ * use. the tuple, which lives on the line arena, is copied.
+ */
+void
+sorter_add(sorter_t sorter, pdns_tuple_ct tup, const char *line, size_t len,
+	   u_long first, u_long last)
+{
+	const char *strs[ss_count] = {
+		[ss_bailiwick] = tup->bailiwick,
+		[ss_rrtype] = tup->rrtype,
+		[ss_rdata] = tup->rdata,
+		[ss_orig_rrname] = tup->orig_rrname,
+		[ss_rrname] = tup->rrname,
+	};
+	size_t size;
+	uint32_t nrdata = 0, used;
+	sortrec_t rec;
+	sortbuf_t key = &sorter->key;
+
+	assert(sorting != no_sort);
+
+	/* most tuples that can't make the cutoff lose on a numeric key,
+	 * before the rest of the sort key is needed.
+	 */
+	key->size = 0;
+	sort_key_numbers(key, first, last, tup->count);
+	if (sorter->cutoff != NULL && numbers_len != 0 &&
+	    memcmp(key->base, sorter->cutoff->data + sorter->cutoff->key_off,
+		   numbers_len) > 0)
+		return;
+	sort_key_fields(key, tup);
+
+	/* add up the size, then fill in the record. */
+	if ((tup->fields & TUP_RDATA_ARRAY) != 0)
+		nrdata = (uint32_t)tup->nrdata;
+	size = sizeof *rec + nrdata * sizeof(uint32_t) + key->size + len;
+	for (int ss = 0; ss < ss_count; ss++)
+		if (strs[ss] != NULL)
+			size += strlen(strs[ss]) + 1;
+	for (uint32_t i = 0; i < nrdata; i++)
+		if (tup->rdatas[i] != NULL)
+			size += strlen(tup->rdatas[i]) + 1;
+	if (size > UINT32_MAX)
+		my_panic(false, "sort record too large");
+
+	rec = arena_alloc(sorter->arena, size);
+	*rec = (struct sortrec){
+		.size = (uint32_t)size,
+		.nrdata = nrdata,
+		.fields = tup->fields,
+		.time_first = tup->time_first,
+		.time_last = tup->time_last,
+		.zone_first = tup->zone_first,
+		.zone_last = tup->zone_last,
+		.count = tup->count,
+		.num_results = tup->num_results,
+	};
+	used = nrdata * (uint32_t)sizeof(uint32_t);
+	rec->key_off = used;
+	rec->key_len = (uint32_t)key->size;
+	memcpy(rec->data + used, key->base, key->size);
+	for (size_t i = 0; i < sizeof rec->key_head; i++)
+		rec->key_head = rec->key_head << 8 |
+			(i < key->size ? (u_char)key->base[i] : 0U);
+	used += rec->key_len;
+	rec->line_off = used;
+	rec->line_len = (uint32_t)len;
+	memcpy(rec->data + used, line, len);
+	used += rec->line_len;
+	if (tup->cof.ptr != NULL) {
+		rec->cof_off = (uint32_t)(tup->cof.ptr - line);
+		rec->cof_len = (uint32_t)tup->cof.len;
+	} else {
+		rec->cof_off = NO_STR;
 	}
+
+	for (int ss = 0; ss < ss_count; ss++)
+		rec->str[ss] = sortrec_str(rec, &used, strs[ss]);
+	for (uint32_t i = 0; i < nrdata; i++) {
+		uint32_t off = sortrec_str(rec, &used, tup->rdatas[i]);
+
+		memcpy(rec->data + i * sizeof(uint32_t), &off, sizeof off);
+	}
+	assert(offsetof(struct sortrec, data) + used <= size);
+
+	/* one that ties with the cutoff is a duplicate of it. */
+	if (sorter->cutoff != NULL && sortrec_cmp(rec, sorter->cutoff) >= 0) {
+		(void) arena_grow(sorter->arena, rec, size, 0);
+		return;
+	}
+
+	if (sorter->nrec == sorter->maxrec) {
+		sorter->maxrec = sorter->maxrec == 0 ? 1024 :
+			sorter->maxrec * 2;
+		sorter->recs = realloc(sorter->recs,
+				       sorter->maxrec * sizeof *sorter->recs);
+		if (sorter->recs == NULL)
+			my_panic(true, "realloc");
+	}
+	sorter->recs[sorter->nrec++] = rec;
+	sorter->mem += size + sizeof rec;
+
+	/* compacting at twice the limit keeps its cost proportional to the
+	 * input. if that many records won't fit, spill them as a run, which
+	 * only keeps the limit's worth too.
+	 */
+	if (sorter->mem >= SORT_MEM_MAX)
+		sorter_spill(sorter);
+	else if (sorter->limit != 0 && sorter->nrec >= 2 * sorter->limit)
+		sorter_compact(sorter);
 }
 
-/* exec_sort -- replace this fork with a POSIX sort program
+/* sorter_next -- give back the next tuple in sort key order
+ *
+ * returns false when there are no more. the first call ends sorter_add().
+ * the tuple lives until the next call, and its rdatas on the line arena.
  */
-__attribute__((noreturn)) void
-exec_sort(int p1[], int p2[]) {
-	char *sort_argv[3+MAX_KEYS], **sap;
-	int n;
+bool
+sorter_next(sorter_t sorter, pdns_tuple_t tup) {
+	sortrec_t rec;
+	sortrun_t run;
+
+	if (!sorter->merging)
+		sorter_merge(sorter);
+	if (sorter->limit != 0 && sorter->given == sorter->limit)
+		return false;
 
-	if (dup2(p1[0], STDIN_FILENO) < 0 ||
-	    dup2(p2[1], STDOUT_FILENO) < 0) {
-		perror("dup2");
-		_exit(1);
+	/* the smallest current record is at the top of the heap. skip
+	 * any that -u would, which are the same as the one given last.
+	 */
+	do {
+		if (sorter->nheap == 0)
+			return false;
+		run = &sorter->runs[sorter->heap[0]];
+		rec = run->rec;
+		if (sorter->have_prev && sortrec_cmp(sorter->prev, rec) == 0) {
+			if (!sortrun_advance(sorter, run))
+				sorter->heap[0] = sorter->heap[--sorter->nheap];
+			sortheap_down(sorter, 0);
+			rec = NULL;
+		}
+	} while (rec == NULL);
+
+	/* keep a copy, since a spilled run reuses its buffer. */
+	if (sorter->prev_size < rec->size) {
+		sorter->prev_size = rec->size;
+		sorter->prev = realloc(sorter->prev, rec->size);
+		if (sorter->prev == NULL)
+			my_panic(true, "realloc");
 	}
-	close(p1[0]); close(p1[1]);
-	close(p2[0]); close(p2[1]);
-	sap = sort_argv;
-	*sap++ = strdup("sort");
-	*sap++ = strdup("-u");
-	for (n = 0; n < nkeys; n++)
-		*sap++ = strdup(keys[n].computed);
-	*sap++ = NULL;
-	putenv(strdup("LC_ALL=C"));
-	DEBUG(1, true, "\"%s\" args:", path_sort);
-	for (sap = sort_argv; *sap != NULL; sap++)
-		DEBUG(1, false, " [%s]", *sap);
-	DEBUG(1, false, "\n");
-	execve(path_sort, sort_argv, environ);
-	perror("execve");
-	for (sap = sort_argv; *sap != NULL; sap++)
-		DESTROY(*sap);
-	_exit(1);
+	memcpy(sorter->prev, rec, rec->size);
+	sorter->have_prev = true;
+	sorter->given++;
+	if (!sortrun_advance(sorter, run))
+		sorter->heap[0] = sorter->heap[--sorter->nheap];
+	sortheap_down(sorter, 0);
+
+	rec = sorter->prev;
+	*tup = (struct pdns_tuple){
+		.fields = rec->fields,
+		.time_first = rec->time_first,
+		.time_last = rec->time_last,
+		.zone_first = rec->zone_first,
+		.zone_last = rec->zone_last,
+		.count = rec->count,
+		.num_results = rec->num_results,
+	};
+	if (rec->cof_off != NO_STR)
+		tup->cof = (struct jspan){
+			rec->data + rec->line_off + rec->cof_off,
+			rec->cof_len, false
+		};
+#define	SORTREC_STR(ss) \
+	(rec->str[ss] == NO_STR ? NULL : rec->data + rec->str[ss])
+	tup->bailiwick = SORTREC_STR(ss_bailiwick);
+	tup->rrtype = SORTREC_STR(ss_rrtype);
+	tup->rdata = SORTREC_STR(ss_rdata);
+	tup->orig_rrname = SORTREC_STR(ss_orig_rrname);
+	tup->rrname = SORTREC_STR(ss_rrname);
+#undef SORTREC_STR
+	if ((rec->fields & TUP_RDATA_ARRAY) != 0) {
+		const char **rdatas = arena_alloc(line_arena,
+			(rec->nrdata + 1) * sizeof *rdatas);
+
+		for (uint32_t i = 0; i < rec->nrdata; i++) {
+			uint32_t off;
+
+			memcpy(&off, rec->data + i * sizeof off, sizeof off);
+			rdatas[i] = off == NO_STR ? NULL : rec->data + off;
+		}
+		tup->rdatas = rdatas;
+		tup->nrdata = rec->nrdata;
+	}
+	return true;
 }
 
-/* sortable_rrname -- return a POSIX-sort-collatable rendition of RR name+type.
+/* sorter_destroy -- release all resources of a sorter
  */
-char *
-sortable_rrname(pdns_tuple_ct tup) {
-	struct sortbuf buf = {};
-
-	sortable_dnsname(&buf, json_string_value(tup->obj.rrname));
-	buf.base = realloc(buf.base, buf.size+1);
-	buf.base[buf.size++] = '\0';
-	return buf.base;
+void
+sorter_destroy(sorter_t *sorterp) {
+	sorter_t sorter = *sorterp;
+
+	for (size_t n = 0; n < sorter->nrun; n++) {
+		sortrun_t run = &sorter->runs[n];
+
+		if (run->file != NULL) {
+			fclose(run->file);
+			DESTROY(run->rec);
+		}
+	}
+	DESTROY(sorter->runs);
+	DESTROY(sorter->heap);
+	DESTROY(sorter->recs);
+	DESTROY(sorter->prev);
+	DESTROY(sorter->cutoff);
+	DESTROY(sorter->key.base);
+	arena_destroy(&sorter->arena);
+	if (sorter->spare != NULL)
+		arena_destroy(&sorter->spare);
+	DESTROY(*sorterp);
 }
 
-/* sortable_rdata -- return a POSIX-sort-collatable rendition of RR data set.
+/* sortrec_cmp -- compare two records by the sort keys, in their order
  */
-char *
-sortable_rdata(pdns_tuple_ct tup) {
-	struct sortbuf buf = {};
-
-	if (json_is_array(tup->obj.rdata)) {
-		size_t index;
-		json_t *rr;
-
-		json_array_foreach(tup->obj.rdata, index, rr) {
-			if (json_is_string(rr))
-				sortable_rdatum(&buf, tup->rrtype,
-						json_string_value(rr));
-			else
-				my_logf("warning: rdata slot is not a string");
+static int
+sortrec_cmp(sortrec_ct a, sortrec_ct b) {
+	int r;
+
+	if (a->key_head != b->key_head)
+		return a->key_head < b->key_head ? -1 : 1;
+	r = octets_cmp(a->data + a->key_off, a->key_len,
+			   b->data + b->key_off, b->key_len);
+
+	if (r != 0)
+		return r;
+	r = octets_cmp(a->data + a->line_off, a->line_len,
+		       b->data + b->line_off, b->line_len);
+	return keys[fields_key].reverse ? -r : r;
+}
+
+/* sortrec_qcmp -- qsort() wrapper for sortrec_cmp()
+ */
+static int
+sortrec_qcmp(const void *a, const void *b) {
+	return sortrec_cmp(*(sortrec_ct const *)a, *(sortrec_ct const *)b);
+}
+
+/* octets_cmp -- compare two counted strings as memcmp() would
+ *
+ * a string sorts before any longer one that it's a prefix of.
+ */
+static inline int
+octets_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+
+	if (r != 0)
+		return r;
+	return (alen > blen) - (alen < blen);
+}
+
+/* sortrec_str -- copy a string, or NULL, into a record under construction
+ *
+ * returns its offset in rec->data, or NO_STR.
+ */
+static uint32_t
+sortrec_str(sortrec_t rec, uint32_t *usedp, const char *str) {
+	uint32_t off = *usedp;
+	size_t len;
+
+	if (str == NULL)
+		return NO_STR;
+	len = strlen(str) + 1;
+	memcpy(rec->data + off, str, len);
+	*usedp += (uint32_t)len;
+	return off;
+}
+
+/* sorter_spill -- sort the run being gathered and move it to a file
+ *
+ * with a limit, only the run's best that many distinct records are kept,
+ * and the last of them becomes the cutoff if it's better.
+ */
+static void
+sorter_spill(sorter_t sorter) {
+	sortrec_ct last = NULL;
+	size_t kept = 0;
+	sortrun_t run;
+	FILE *file;
+
+	DEBUG(1, true, "sorter_spill(%zu recs, %zu octets)\n",
+	      sorter->nrec, sorter->mem);
+	qsort(sorter->recs, sorter->nrec, sizeof *sorter->recs,
+	      sortrec_qcmp);
+	file = tmpfile();
+	if (file == NULL)
+		my_panic(true, "tmpfile");
+	for (size_t n = 0; n < sorter->nrec; n++) {
+		sortrec_ct rec = sorter->recs[n];
+
+		if (sorter->limit != 0) {
+			if (kept == sorter->limit)
+				break;
+			if (last != NULL && sortrec_cmp(last, rec) == 0)
+				continue;
 		}
-	} else {
-		sortable_rdatum(&buf, tup->rrtype, tup->rdata);
+		if (fwrite(rec, 1, rec->size, file) != rec->size)
+			my_panic(true, "sort fwrite");
+		last = rec;
+		kept++;
 	}
-	buf.base = realloc(buf.base, buf.size+1);
-	buf.base[buf.size++] = '\0';
-	return buf.base;
+	if (sorter->limit != 0 && kept == sorter->limit)
+		sorter_cutoff(sorter, last);
+	if (fflush(file) != 0)
+		my_panic(true, "sort fflush");
+	rewind(file);
+
+	sorter->runs = realloc(sorter->runs,
+			       (sorter->nrun + 1) * sizeof *sorter->runs);
+	if (sorter->runs == NULL)
+		my_panic(true, "realloc");
+	run = &sorter->runs[sorter->nrun++];
+	*run = (struct sortrun){ .file = file };
+	sorter->nrec = 0;
+	sorter->mem = 0;
+	arena_reset(sorter->arena);
 }
 
-/* sortable_rdatum -- called only by sortable_rdata(): realloc and normalize.
+/* sorter_compact -- keep only the best records, up to the output limit
  *
- * this converts (lossily) addresses into hex strings, and extracts the
- * server-name component of a few other types like MX. all other rdata
- * are left in their normal string form, because it's hard to know what
- * to sort by with something like TXT, and extracting the serial number
- * from an SOA using a language like C is a bit ugly.
+ * duplicates are dropped here too, so that the limit counts records that
+ * sorter_next() would give back. the survivors move to the spare arena,
+ * and the last of them becomes the cutoff if there are enough.
  */
 static void
-sortable_rdatum(sortbuf_t buf, const char *rrtype, const char *rdatum) {
+sorter_compact(sorter_t sorter) {
+	arena_t arena;
+	size_t n, kept = 0;
+
+	qsort(sorter->recs, sorter->nrec, sizeof *sorter->recs,
+	      sortrec_qcmp);
+	if (sorter->spare == NULL)
+		sorter->spare = arena_new(SORT_ARENA_CHUNK);
+	sorter->mem = 0;
+	for (n = 0; n < sorter->nrec && kept < sorter->limit; n++) {
+		sortrec_ct rec = sorter->recs[n];
+
+		if (kept != 0 && sortrec_cmp(sorter->recs[kept - 1], rec) == 0)
+			continue;
+		sorter->recs[kept++] = memcpy(arena_alloc(sorter->spare,
+							  rec->size),
+					      rec, rec->size);
+		sorter->mem += rec->size + sizeof rec;
+	}
+	DEBUG(2, true, "sorter_compact(%zu recs) kept %zu\n",
+	      sorter->nrec, kept);
+	sorter->nrec = kept;
+	if (kept == sorter->limit)
+		sorter_cutoff(sorter, sorter->recs[kept - 1]);
+	arena = sorter->arena;
+	arena_reset(arena);
+	sorter->arena = sorter->spare;
+	sorter->spare = arena;
+}
+
+/* sorter_cutoff -- make a record the cutoff, if it's better than the last
+ *
+ * every record from here on that ties with or follows it can be dropped,
+ * since a limit's worth of distinct records come before it.
+ */
+static void
+sorter_cutoff(sorter_t sorter, sortrec_ct rec) {
+	if (sorter->cutoff != NULL && sortrec_cmp(rec, sorter->cutoff) >= 0)
+		return;
+	if (sorter->cutoff_size < rec->size) {
+		sorter->cutoff_size = rec->size;
+		sorter->cutoff = realloc(sorter->cutoff, rec->size);
+		if (sorter->cutoff == NULL)
+			my_panic(true, "realloc");
+	}
+	memcpy(sorter->cutoff, rec, rec->size);
+}
+
+/* sorter_merge -- sort the last run, and start merging all of them
+ */
+static void
+sorter_merge(sorter_t sorter) {
+	sortrun_t run;
+
+	DEBUG(1, true, "sorter_merge(%zu recs, %zu runs)\n",
+	      sorter->nrec, sorter->nrun);
+	qsort(sorter->recs, sorter->nrec, sizeof *sorter->recs,
+	      sortrec_qcmp);
+	sorter->runs = realloc(sorter->runs,
+			       (sorter->nrun + 1) * sizeof *sorter->runs);
+	if (sorter->runs == NULL)
+		my_panic(true, "realloc");
+	run = &sorter->runs[sorter->nrun++];
+	*run = (struct sortrun){ .file = NULL };
+
+	sorter->heap = calloc(sorter->nrun, sizeof *sorter->heap);
+	if (sorter->heap == NULL)
+		my_panic(true, "calloc");
+	for (size_t n = 0; n < sorter->nrun; n++)
+		if (sortrun_advance(sorter, &sorter->runs[n]))
+			sorter->heap[sorter->nheap++] = n;
+	for (size_t n = sorter->nheap / 2; n-- > 0; )
+		sortheap_down(sorter, n);
+	sorter->merging = true;
+}
+
+/* sortrun_advance -- make a run's next record its current one
+ *
+ * returns false if the run has no more.
+ */
+static bool
+sortrun_advance(sorter_t sorter, sortrun_t run) {
+	uint32_t size;
+
+	if (run->file == NULL) {
+		if (run->next == sorter->nrec) {
+			run->rec = NULL;
+			return false;
+		}
+		run->rec = sorter->recs[run->next++];
+		return true;
+	}
+	if (fread(&size, sizeof size, 1, run->file) != 1) {
+		if (ferror(run->file))
+			my_panic(true, "sort fread");
+		return false;
+	}
+	if (run->size < size) {
+		run->size = size;
+		run->rec = realloc(run->rec, size);
+		if (run->rec == NULL)
+			my_panic(true, "realloc");
+	}
+	run->rec->size = size;
+	if (fread((char *)run->rec + sizeof size, 1, size - sizeof size,
+		  run->file) != size - sizeof size)
+		my_panic(true, "sort fread");
+	return true;
+}
+
+/* sortheap_down -- restore the merge heap below one of its entries
+ */
+static void
+sortheap_down(sorter_t sorter, size_t n) {
+	size_t *heap = sorter->heap;
+
+	for (;;) {
+		size_t least = n, l = 2 * n + 1, r = l + 1, t;
+
+		if (l < sorter->nheap &&
+		    sortrec_cmp(sorter->runs[heap[l]].rec,
+				sorter->runs[heap[least]].rec) < 0)
+			least = l;
+		if (r < sorter->nheap &&
+		    sortrec_cmp(sorter->runs[heap[r]].rec,
+				sorter->runs[heap[least]].rec) < 0)
+			least = r;
+		if (least == n)
+			return;
+		t = heap[n], heap[n] = heap[least], heap[least] = t;
+		n = least;
+	}
+}
+
+/* sort_key -- fill a buffer with a tuple's sort key, as described above
+ *
+ * first and last are the times that the first, last, and duration keys
+ * use. the buffer is reused from call to call, and grown with realloc().
+ * two tuples compare as their keys do with memcmp(), and then, if those
+ * are equal, as their lines do, in the order of the first of the name,
+ * type, and data keys.
+ */
+void
+sort_key(sortbuf_t buf, pdns_tuple_ct tup, u_long first, u_long last) {
+	buf->size = 0;
+	sort_key_numbers(buf, first, last, tup->count);
+	sort_key_fields(buf, tup);
+}
+
+/* sort_key_numbers -- add the numeric keys before the first field key
+ */
+static void
+sort_key_numbers(sortbuf_t buf, u_long first, u_long last, json_int_t count) {
+	for (int n = 0; n < fields_key; n++) {
+		uint64_t val = 0;
+
+		switch (keys[n].key) {
+		case sk_first:
+			val = first;
+			break;
+		case sk_last:
+			val = last;
+			break;
+		case sk_duration:
+			val = last - first;
+			break;
+		case sk_count:
+			val = (u_long)count;
+			break;
+		case sk_name:
+			/* FALLTHROUGH */
+		case sk_type:
+			/* FALLTHROUGH */
+		case sk_data:
+			abort();
+		}
+		sort_key_u64(buf, keys[n].reverse ? ~val : val);
+	}
+}
+
+/* sort_key_fields -- add the first field key and the fields after it
+ */
+static void
+sort_key_fields(sortbuf_t buf, pdns_tuple_ct tup) {
+	size_t start = buf->size;
+
+	switch (keys[fields_key].key) {
+	case sk_name:
+		sort_key_dnsname(buf, tup->orig_rrname);
+		sort_key_end(buf);
+		/* FALLTHROUGH */
+	case sk_type:
+		sort_key_octets(buf, (const u_char *)tup->rrtype,
+				strlen(tup->rrtype));
+		sort_key_end(buf);
+		/* FALLTHROUGH */
+	case sk_data:
+		if ((tup->fields & TUP_RDATA_ARRAY) != 0) {
+			for (size_t i = 0; i < tup->nrdata; i++) {
+				if (tup->rdatas[i] != NULL)
+					sort_key_rdatum(buf, tup->rrtype,
+							tup->rdatas[i]);
+				else
+					my_logf("warning: rdata slot "
+						"is not a string");
+			}
+		} else {
+			sort_key_rdatum(buf, tup->rrtype, tup->rdata);
+		}
+		sort_key_end(buf);
+		break;
+	case sk_first:
+		/* FALLTHROUGH */
+	case sk_last:
+		/* FALLTHROUGH */
+	case sk_duration:
+		/* FALLTHROUGH */
+	case sk_count:
+		abort();
+	}
+	if (keys[fields_key].reverse)
+		for (size_t i = start; i < buf->size; i++)
+			buf->base[i] = (char)~buf->base[i];
+}
+
+/* sort_key_rdatum -- add one rdatum, normalized, to a sort key
+ *
+ * addresses become their binary form, and a few types like MX become the
+ * server-name component. all other rdata are left in their normal string
+ * form, because it's hard to know what to sort by with something like
+ * TXT, and extracting the serial number from an SOA using a language
+ * like C is a bit ugly.
+ */
+static void
+sort_key_rdatum(sortbuf_t buf, const char *rrtype, const char *rdatum) {
 	if (strcmp(rrtype, "A") == 0) {
 		u_char a[4];
 
 		if (inet_pton(AF_INET, rdatum, a) != 1)
 			memset(a, 0, sizeof a);
-		sortable_hexify(buf, a, sizeof a);
+		sort_key_octets(buf, a, sizeof a);
 	} else if (strcmp(rrtype, "AAAA") == 0) {
 		u_char aaaa[16];
 
 		if (inet_pton(AF_INET6, rdatum, aaaa) != 1)
 			memset(aaaa, 0, sizeof aaaa);
-		sortable_hexify(buf, aaaa, sizeof aaaa);
+		sort_key_octets(buf, aaaa, sizeof aaaa);
 	} else if (strcmp(rrtype, "NS") == 0 ||
 		   strcmp(rrtype, "PTR") == 0 ||
 		   strcmp(rrtype, "CNAME") == 0 ||
 		   strcmp(rrtype, "DNAME") == 0)
 	{
-		sortable_dnsname(buf, rdatum);
+		sort_key_dnsname(buf, rdatum);
 	} else if (strcmp(rrtype, "MX") == 0 ||
 		   strcmp(rrtype, "RP") == 0)
 	{
 		const char *space = strrchr(rdatum, ' ');
 
 		if (space != NULL)
-			sortable_dnsname(buf, space+1);
+			sort_key_dnsname(buf, space+1);
 		else
-			sortable_hexify(buf, (const u_char *)rdatum,
+			sort_key_octets(buf, (const u_char *)rdatum,
 					strlen(rdatum));
 	} else {
-		sortable_hexify(buf, (const u_char *)rdatum, strlen(rdatum));
+		sort_key_octets(buf, (const u_char *)rdatum, strlen(rdatum));
 	}
 }
 
-/* sortable_hexify -- convert src into hex string or placeholder in buffer
- */
-static void
-sortable_hexify(sortbuf_t buf, const u_char *src, size_t len) {
-	if (len == 0) {
-		buf->base = realloc(buf->base, buf->size + 1);
-		buf->base[buf->size++] = '=';
-	} else {
-		buf->base = realloc(buf->base, buf->size + len*2);
-		for (size_t i = 0; i < len; i++) {
-			static const char hex[] = "0123456789abcdef";
-			unsigned int ch = src[i];
-			buf->base[buf->size++] = hex[ch >> 4];
-			buf->base[buf->size++] = hex[ch & 0xf];
-		}
-	}
-}
-
-/* sortable_dnsname -- make a sortable dns name; destructive and lossy.
+/* sort_key_dnsname -- add a dns name to a sort key; lossy.
  *
- * to be lexicographically sortable, a dnsname has to be converted to
- * TLD-first, all uppercase letters must be converted to lower case,
- * and all characters except dots then converted to hexadecimal. this
- * transformation is for POSIX sort's use, and is irreversibly lossy.
+ * to be bytewise collatable, a dnsname has to be converted to TLD-first,
+ * all uppercase letters must be converted to lower case, and everything
+ * but letters and digits dropped. this transformation is for the
+ * sorter's use, and is irreversibly lossy.
  */
 static void
-sortable_dnsname(sortbuf_t buf, const char *name) {
+sort_key_dnsname(sortbuf_t buf, const char *name) {
 	struct counted *c = countoff(name);
-
-	// ensure our result buffer is large enough.
-	size_t new_size = buf->size + c->nalnum;
-	if (new_size == 0) {
-		DESTROY(c);
-		buf->base = realloc(buf->base, 1);
-		buf->base[0] = '.';
-		buf->size = 1;
-		return;
-	}
-	if (new_size != buf->size)
-		buf->base = realloc(buf->base, new_size);
-	char *p = buf->base + buf->size;
-
-	// collatable names are TLD-first, alphanumeric only, lower case.
+	char *p = sortbuf_reserve(buf, c->nalnum);
 	size_t nchar = 0;
+
 	for (ssize_t i = (ssize_t)(c->nlabel-1); i >= 0; i--) {
 		size_t dot = (name[c->nchar - nchar - 1] == '.');
 		ssize_t j = (ssize_t)(c->lens[i] - dot);
@@ -297,9 +857,60 @@ sortable_dnsname(sortbuf_t buf, const char *name) {
 		}
 		nchar += c->lens[i];
 	}
-	DESTROY(c);
+	buf->size += c->nalnum;
+	assert(p == buf->base + buf->size);
+}
 
-	// update our counted-string output.
+/* sort_key_octets -- add arbitrary octets to a sort key, escaping NULs
+ */
+static void
+sort_key_octets(sortbuf_t buf, const u_char *src, size_t len) {
+	char *p = sortbuf_reserve(buf, len * 2);
+
+	for (size_t i = 0; i < len; i++) {
+		*p++ = (char)src[i];
+		if (src[i] == '\0')
+			*p++ = (char)0xff;
+	}
 	buf->size = (size_t)(p - buf->base);
-	assert(buf->size == new_size);
+}
+
+/* sort_key_end -- end a field of a sort key
+ */
+static void
+sort_key_end(sortbuf_t buf) {
+	char *p = sortbuf_reserve(buf, 2);
+
+	p[0] = p[1] = '\0';
+	buf->size += 2;
+}
+
+/* sort_key_u64 -- add a number to a sort key, big-endian
+ */
+static void
+sort_key_u64(sortbuf_t buf, uint64_t val) {
+	char *p = sortbuf_reserve(buf, sizeof val);
+
+	for (int i = (int)sizeof val - 1; i >= 0; i--) {
+		p[i] = (char)(val & 0xff);
+		val >>= 8;
+	}
+	buf->size += sizeof val;
+}
+
+/* sortbuf_reserve -- make room for len more octets, return where they go
+ */
+static char *
+sortbuf_reserve(sortbuf_t buf, size_t len) {
+	if (buf->base == NULL || buf->size + len > buf->max) {
+		size_t max = buf->max == 0 ? 256 : buf->max;
+
+		while (max < buf->size + len)
+			max *= 2;
+		buf->base = realloc(buf->base, max);
+		if (buf->base == NULL)
+			my_panic(true, "realloc");
+		buf->max = max;
+	}
+	return buf->base + buf->size;
 }
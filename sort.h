@@ -21,21 +21,36 @@
 
 #include "pdns.h"
 
-struct sortbuf { char *base; size_t size; };
+struct sortbuf { char *base; size_t size, max; };
 typedef struct sortbuf *sortbuf_t;
 
-struct sortkey { char *specified, *computed; };
+typedef enum {
+	sk_first, sk_last, sk_duration, sk_count, sk_name, sk_type, sk_data
+} sortkey_e;
+
+struct sortkey { char *specified; sortkey_e key; bool reverse; };
 typedef struct sortkey *sortkey_t;
 typedef const struct sortkey *sortkey_ct;
 
 typedef enum { no_sort = 0, normal_sort, reverse_sort } sort_e;
 
+/* a sorter takes tuples in any order and gives them back in sort key
+ * order, without duplicates. it holds them in memory up to SORT_MEM_MAX,
+ * and beyond that in sorted runs in temporary files, merged at the end;
+ * or, when only the first so many are wanted, just those in memory.
+ */
+struct sorter;
+typedef struct sorter *sorter_t;
+
 const char *add_sort_key(const char *);
 sortkey_ct find_sort_key(const char *);
 void sort_ready(void);
 void sort_destroy(void);
-__attribute__((noreturn)) void exec_sort(int p1[], int p2[]);
-char *sortable_rrname(pdns_tuple_ct);
-char *sortable_rdata(pdns_tuple_ct);
+sorter_t sorter_new(size_t);
+void sorter_add(sorter_t, pdns_tuple_ct, const char *, size_t,
+		u_long, u_long);
+bool sorter_next(sorter_t, pdns_tuple_t);
+void sorter_destroy(sorter_t *);
+void sort_key(sortbuf_t, pdns_tuple_ct, u_long, u_long);
 
 #endif /*SORT_H_INCLUDED*/
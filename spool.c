@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* a spool holds a stream of octets for later replay. it is kept in memory
+ * until all spools together would exceed SPOOL_MEM_MAX, after which any
+ * spool that grows moves into an anonymous temporary file.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "spool.h"
+#include "globals.h"
+
+/* memory that all spools together may use before spilling to files. */
+#define	SPOOL_MEM_MAX (32 * 1024 * 1024)
+
+/* smallest memory allocation for a spool; it grows by doubling. */
+#define	SPOOL_MEM_MIN 16384
+
+struct spool {
+	char	*buf;		/* in-memory contents, if not spilled */
+	size_t	size;		/* allocated size of buf */
+	size_t	len;		/* octets written */
+	size_t	off;		/* octets read back */
+	FILE	*file;		/* spilled contents, if any */
+	bool	reading;	/* writing is over */
+};
+
+static size_t spool_mem = 0;
+
+static void spool_spill(spool_t);
+
+/* spool_new -- create an empty spool
+ */
+spool_t
+spool_new(void) {
+	spool_t spool = NULL;
+
+	CREATE(spool, sizeof *spool);
+	return spool;
+}
+
+/* spool_write -- append some octets to a spool
+ */
+void
+spool_write(spool_t spool, const char *ptr, size_t len) {
+	assert(!spool->reading);
+	if (spool->file == NULL && spool->len + len > spool->size) {
+		size_t size = spool->size == 0 ? SPOOL_MEM_MIN : spool->size;
+
+		while (spool->len + len > size)
+			size *= 2;
+		if (spool_mem - spool->size + size > SPOOL_MEM_MAX) {
+			spool_spill(spool);
+		} else {
+			spool->buf = realloc(spool->buf, size);
+			if (spool->buf == NULL)
+				my_panic(true, "realloc");
+			spool_mem = spool_mem - spool->size + size;
+			spool->size = size;
+		}
+	}
+	if (spool->file != NULL) {
+		if (fwrite(ptr, 1, len, spool->file) != len)
+			my_panic(true, "spool fwrite");
+	} else {
+		memcpy(spool->buf + spool->len, ptr, len);
+	}
+	spool->len += len;
+}
+
+/* spool_read -- read back up to len octets from a spool, return # read
+ *
+ * once a spool has been read from, it may not be written to.
+ */
+size_t
+spool_read(spool_t spool, char *ptr, size_t len) {
+	if (!spool->reading) {
+		spool->reading = true;
+		if (spool->file != NULL) {
+			if (fflush(spool->file) != 0)
+				my_panic(true, "spool fflush");
+			rewind(spool->file);
+		}
+	}
+	if (len > spool->len - spool->off)
+		len = spool->len - spool->off;
+	if (spool->file != NULL) {
+		if (fread(ptr, 1, len, spool->file) != len)
+			my_panic(true, "spool fread");
+	} else {
+		memcpy(ptr, spool->buf + spool->off, len);
+	}
+	spool->off += len;
+	return len;
+}
+
+/* spool_destroy -- release all resources of a spool
+ */
+void
+spool_destroy(spool_t *spoolp) {
+	spool_t spool = *spoolp;
+
+	if (spool->file != NULL)
+		fclose(spool->file);
+	spool_mem -= spool->size;
+	DESTROY(spool->buf);
+	DESTROY(*spoolp);
+}
+
+/* spool_spill -- move a spool's contents from memory to a temporary file
+ */
+static void
+spool_spill(spool_t spool) {
+	DEBUG(2, true, "spool_spill(%zu)\n", spool->len);
+	spool->file = tmpfile();
+	if (spool->file == NULL)
+		my_panic(true, "tmpfile");
+	if (spool->len != 0 &&
+	    fwrite(spool->buf, 1, spool->len, spool->file) != spool->len)
+		my_panic(true, "spool fwrite");
+	spool_mem -= spool->size;
+	spool->size = 0;
+	DESTROY(spool->buf);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2021 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SPOOL_H_INCLUDED
+#define __SPOOL_H_INCLUDED 1
+
+struct spool;
+typedef struct spool *spool_t;
+
+spool_t spool_new(void);
+void spool_write(spool_t, const char *, size_t);
+size_t spool_read(spool_t, char *, size_t);
+void spool_destroy(spool_t *);
+
+#endif /*__SPOOL_H_INCLUDED*/
@@ -29,6 +29,22 @@
 #include "globals.h"
 #include "ns_ttl.h"
 
+#define	SECS_PER_DAY 86400
+
+/* days from 0000-03-01 to 1970-01-01, and from then to 9999-12-31. */
+#define	DAYS_0000_03_01 719468UL
+#define	DAY_9999_12_31 2932896UL
+
+static void civil_date(char *, u_long);
+
+/* "00" through "99", for formatting two digits at a time. */
+static const char two_digits[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
 /* time_cmp -- compare two absolute timestamps, give -1, 0, or 1.
  */
 int
@@ -46,17 +62,83 @@ time_cmp(u_long a, u_long b) {
  */
 const char *
 time_str(u_long x, bool iso8601fmt) {
-	static char ret[sizeof "yyyy-mm-ddThh:mm:ssZ"];
+	static struct time_cache cache;
+	static char ret[TIME_FMT_MAX];
+
+	(void) time_fmt(ret, x, iso8601fmt, &cache);
+	return ret;
+}
+
+/* time_fmt -- format one (possibly zero) timestamp into a caller's buffer
+ *
+ *	dst must have room for TIME_FMT_MAX octets. returns the length of
+ *	the string, which is "0", "%F %T", or "%FT%TZ", always in GMT.
+ *
+ *	results come in runs from the same day, so the date is kept in the
+ *	caller's cache from one call to the next, and only the time of day
+ *	is formatted anew.
+ */
+size_t
+time_fmt(char *dst, u_long x, bool iso8601fmt, struct time_cache *cache) {
+	u_long day = x / SECS_PER_DAY;
+	unsigned sec = (unsigned)(x % SECS_PER_DAY);
+	char *p = dst;
 
 	if (x == 0) {
-		strcpy(ret, "0");
-	} else {
-		time_t t = (time_t)x;
-		struct tm result, *y = gmtime_r(&t, &result);
+		strcpy(dst, "0");
+		return 1;
+	}
+	if (cache->date[0] == '\0' || day != cache->day) {
+		civil_date(cache->date, day);
+		cache->day = day;
+	}
+	memcpy(p, cache->date, sizeof cache->date - 1);
+	p += sizeof cache->date - 1;
+	*p++ = iso8601fmt ? 'T' : ' ';
+	memcpy(p, two_digits + 2 * (sec / 3600), 2);
+	p += 2;
+	*p++ = ':';
+	memcpy(p, two_digits + 2 * (sec / 60 % 60), 2);
+	p += 2;
+	*p++ = ':';
+	memcpy(p, two_digits + 2 * (sec % 60), 2);
+	p += 2;
+	if (iso8601fmt)
+		*p++ = 'Z';
+	*p = '\0';
+	return (size_t)(p - dst);
+}
 
-		strftime(ret, sizeof ret, iso8601fmt ? "%FT%TZ" : "%F %T", y);
+/* civil_date -- format the day this many days after 1970-01-01 as "%F"
+ *
+ *	this is the proleptic gregorian calendar that gmtime() uses, with
+ *	years starting on March 1 so that leap days fall at the end. days
+ *	after 9999-12-31 would need a longer year, and give "9999-99-99".
+ */
+static void
+civil_date(char *dst, u_long day) {
+	u_long doe, yoe, doy, mp, y, m, d;
+
+	if (day > DAY_9999_12_31) {
+		memcpy(dst, "9999-99-99", sizeof "9999-99-99");
+		return;
 	}
-	return ret;
+	day += DAYS_0000_03_01;
+	doe = day % 146097;			/* day of 400-year era */
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;		/* month, from March */
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = day / 146097 * 400 + yoe + (m <= 2);
+
+	memcpy(dst, two_digits + 2 * (y / 100), 2);
+	memcpy(dst + 2, two_digits + 2 * (y % 100), 2);
+	dst[4] = '-';
+	memcpy(dst + 5, two_digits + 2 * m, 2);
+	dst[7] = '-';
+	memcpy(dst + 8, two_digits + 2 * d, 2);
+	dst[10] = '\0';
 }
 
 /* timeval_str -- format one timeval (NULL means current time)
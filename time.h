@@ -21,8 +21,18 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+/* room for the longest result of time_fmt(), including its NUL. */
+#define	TIME_FMT_MAX (sizeof "yyyy-mm-ddThh:mm:ssZ")
+
+/* the last date time_fmt() formatted for one caller; zeroed, it's empty. */
+struct time_cache {
+	u_long		day;
+	char		date[sizeof "yyyy-mm-dd"];
+};
+
 int time_cmp(u_long, u_long);
 const char *time_str(u_long, bool);
+size_t time_fmt(char *, u_long, bool, struct time_cache *);
 const char *timeval_str(const struct timeval *, bool);
 int time_get(const char *, u_long *);
 